@@ -0,0 +1,203 @@
+#include "rtc_buffer.h"
+#include "rtc_envelope.h"
+#include "rtc_lz.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// compression ratio and CPU cost of the built-in codec on the kind of
+// traffic the examples produce
+//
+// usage: bench_compression [-n megabytes] [-t threshold]
+
+#define DEFAULT_MEGABYTES 64
+#define DEFAULT_THRESHOLD 128
+
+struct sample {
+    const char *name;
+    // share of the traffic, in messages
+    int weight;
+    struct rtc_buffer data;
+};
+
+static const char *words[] = {"hey",  "anyone", "up",    "for", "a",
+                              "game", "tonight", "sure", "gg",  "lag",
+                              "brb",  "the",    "server", "is", "back"};
+
+static void appendf(struct rtc_buffer *buf, const char *fmt, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    rtc_buffer_append(buf, line, n);
+}
+
+static void chatMessage(struct rtc_buffer *buf, int seed) {
+    appendf(buf, "{\"type\":\"CHAT\",\"payload\":\"");
+    for (int i = 0; i < 6 + seed % 10; i++)
+        appendf(buf, "%s%s", i > 0 ? " " : "",
+                words[(seed * 7 + i * 3) % (sizeof(words) / sizeof(*words))]);
+    appendf(buf, "\"}");
+}
+
+static void playerMove(struct rtc_buffer *buf, int seed) {
+    appendf(buf, "{\"type\":\"PLAYER_MOVE\",\"payload\":{\"player_x\":%.4f,"
+                 "\"player_y\":%.4f}}",
+            100 + seed * 1.37, 200 - seed * 0.71);
+}
+
+static void buildSamples(struct sample *samples) {
+    // a single chat line, mostly below any useful threshold
+    chatMessage(&samples[0].data, 3);
+
+    // one position update
+    playerMove(&samples[1].data, 5);
+
+    // a tick's worth of position updates in one batch
+    struct rtc_buffer *batch = &samples[2].data;
+    rtc_buffer_reserve(batch, RTC_ENVELOPE_HEADER_SIZE);
+    batch->size = RTC_ENVELOPE_HEADER_SIZE;
+    struct rtc_buffer record = {0};
+    for (int i = 0; i < 32; i++) {
+        rtc_buffer_reset(&record);
+        playerMove(&record, i);
+        char header[RTC_ENVELOPE_RECORD_HEADER_SIZE];
+        rtc_envelope_write_record_header(header, record.size);
+        rtc_buffer_append(batch, header, sizeof(header));
+        rtc_buffer_append(batch, record.data, record.size);
+    }
+    rtc_buffer_free(&record);
+    struct rtc_envelope env = {
+        .flags = RTC_ENVELOPE_BATCH,
+        .length = batch->size - RTC_ENVELOPE_HEADER_SIZE,
+    };
+    rtc_envelope_write_header(batch->data, &env);
+
+    // chat history replayed to a peer that just joined
+    struct rtc_buffer *history = &samples[3].data;
+    for (int i = 0; i < 64; i++) {
+        chatMessage(history, i);
+        appendf(history, "\n");
+    }
+
+    // keyframe of a larger replicated object
+    struct rtc_buffer *state = &samples[4].data;
+    appendf(state, "{\"state\":\"WORLD\",\"seq\":42,\"base\":0,\"set\":{");
+    for (int i = 0; i < 24; i++)
+        appendf(state, "%s\"entity_%d\":{\"x\":%d.5,\"y\":%d.25,\"hp\":%d}",
+                i > 0 ? "," : "", i, i * 13 % 640, i * 29 % 480, 100 - i);
+    appendf(state, "}}");
+
+    // an offer as libdatachannel writes it
+    struct rtc_buffer *sdp = &samples[5].data;
+    appendf(sdp, "v=0\r\no=rtc 3911223891 0 IN IP4 127.0.0.1\r\n"
+                 "s=-\r\nt=0 0\r\na=group:BUNDLE 0\r\na=group:LS 0\r\n"
+                 "a=msid-semantic:WMS *\r\n"
+                 "a=setup:actpass\r\na=ice-ufrag:Xq7m\r\n"
+                 "a=ice-pwd:wW6yS8vFZpNq8C1sBh3eKd\r\na=ice-options:trickle\r\n"
+                 "a=fingerprint:sha-256 ");
+    for (int i = 0; i < 32; i++)
+        appendf(sdp, "%02X%s", (i * 73 + 11) & 0xFF, i < 31 ? ":" : "\r\n");
+    appendf(sdp, "m=application 9 UDP/DTLS/SCTP webrtc-datachannel\r\n"
+                 "c=IN IP4 0.0.0.0\r\na=mid:0\r\na=sendrecv\r\n"
+                 "a=sctp-port:5000\r\na=max-message-size:262144\r\n");
+    for (int i = 0; i < 8; i++)
+        appendf(sdp, "a=candidate:%d 1 UDP %u 192.168.%d.%d %d typ host\r\n",
+                i + 1, 2122317823u - i * 256, i / 4, 20 + i, 50000 + i * 7);
+    appendf(sdp, "a=end-of-candidates\r\n");
+}
+
+static double cpuSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int megabytes = DEFAULT_MEGABYTES;
+    size_t threshold = DEFAULT_THRESHOLD;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            megabytes = atoi(optarg);
+            break;
+        case 't':
+            threshold = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n megabytes] [-t threshold]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    struct sample samples[] = {
+        {.name = "chat message", .weight = 40},
+        {.name = "player move", .weight = 400},
+        {.name = "move batch", .weight = 60},
+        {.name = "chat history", .weight = 1},
+        {.name = "state keyframe", .weight = 4},
+        {.name = "sdp offer", .weight = 1},
+    };
+    int count = sizeof(samples) / sizeof(*samples);
+    buildSamples(samples);
+
+    struct rtc_buffer packed = {0};
+    struct rtc_buffer unpacked = {0};
+    size_t mix_raw = 0;
+    size_t mix_sent = 0;
+
+    printf("%-16s %8s %8s %7s %12s %12s\n", "sample", "bytes", "packed",
+           "ratio", "comp ms/MB", "decomp ms/MB");
+    for (int i = 0; i < count; i++) {
+        struct sample *s = &samples[i];
+        rtc_buffer_reset(&packed);
+        int ok = rtc_lz_pack(s->data.data, s->data.size, &packed) == 0;
+        size_t sent = ok ? packed.size : s->data.size;
+
+        int rounds = (size_t)megabytes * 1000000 / s->data.size + 1;
+        double start = cpuSeconds();
+        for (int r = 0; r < rounds; r++) {
+            rtc_buffer_reset(&packed);
+            rtc_lz_pack(s->data.data, s->data.size, &packed);
+        }
+        double compress = cpuSeconds() - start;
+
+        double decompress = 0;
+        if (ok) {
+            start = cpuSeconds();
+            for (int r = 0; r < rounds; r++) {
+                rtc_buffer_reset(&unpacked);
+                rtc_lz_unpack(packed.data, packed.size, &unpacked,
+                              s->data.size);
+            }
+            decompress = cpuSeconds() - start;
+        }
+
+        double mb = (double)rounds * s->data.size / 1e6;
+        printf("%-16s %8zu %8zu %7.2f %12.3f %12.3f\n", s->name, s->data.size,
+               sent, (double)s->data.size / sent, compress * 1e3 / mb,
+               decompress * 1e3 / mb);
+
+        // what a client with this threshold puts on the wire
+        mix_raw += s->weight * s->data.size;
+        mix_sent += s->weight * (s->data.size >= threshold ? sent
+                                                           : s->data.size);
+    }
+
+    printf("\nmix at threshold %zu: %zu -> %zu bytes, ratio %.2f\n", threshold,
+           mix_raw, mix_sent, (double)mix_raw / mix_sent);
+
+    for (int i = 0; i < count; i++)
+        rtc_buffer_free(&samples[i].data);
+    rtc_buffer_free(&packed);
+    rtc_buffer_free(&unpacked);
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "loopback_server.h"
+#include "rtc_handler.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// how fast a room of clients gets fully connected through a signaling
+// server on localhost, every pair of clients opens one connection, or with
+// -H the first client is the hub and every other one connects only to it
+//
+// usage: bench_connect [-n clients] [-t timeout] [-H]
+
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_TIMEOUT 30
+
+// the candidate stage counts every local candidate, not only the first
+static const char *stage_names[RTC_STAGE_COUNT] = {
+    "offer received", "local description", "candidate", "gathered",
+    "remote description", "connected", "open",
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int opened = 0;
+
+static void onMessageOpened(int id, void *ptr) {
+    pthread_mutex_lock(&lock);
+    opened++;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+int main(int argc, char *argv[]) {
+    int count = DEFAULT_CLIENTS;
+    int timeout = DEFAULT_TIMEOUT;
+    int hub = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:H")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        case 'H':
+            hub = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n clients] [-t timeout] [-H]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (count < 2) {
+        fprintf(stderr, "Need at least 2 clients\n");
+        return 1;
+    }
+
+    loopback_server *server = loopback_server_start(0);
+    if (server == NULL) {
+        fprintf(stderr, "Failed to start signaling server\n");
+        return 1;
+    }
+    char url[64];
+    snprintf(url, sizeof(url), "ws://127.0.0.1:%u/",
+             loopback_server_port(server));
+
+    rtc_client **clients = calloc(count, sizeof(rtc_client *));
+    int *joined = calloc(count, sizeof(int));
+    int *ret = calloc(count, sizeof(int));
+    int failed = clients == NULL || joined == NULL || ret == NULL;
+
+    // everyone joins the websocket first, so the handshakes below are all
+    // that is timed
+    for (int i = 0; !failed && i < count; i++) {
+        char name[UUID_STR_LEN];
+        generate_uuid(name);
+        clients[i] = rtc_client_initialize(NULL, 0, url, name, "bench", count,
+                                           &lock, &cond, &joined[i], &ret[i]);
+        if (clients[i] == NULL) {
+            failed = 1;
+            break;
+        }
+        rtc_client_set_message_opened_callback(clients[i], onMessageOpened);
+        if (hub)
+            rtc_client_set_topology(clients[i], i == 0 ? RTC_TOPOLOGY_HUB
+                                                       : RTC_TOPOLOGY_MEMBER);
+    }
+    // joining gets the same timeout as connecting
+    struct timespec joined_by;
+    clock_gettime(CLOCK_REALTIME, &joined_by);
+    joined_by.tv_sec += timeout;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; !failed && i < count; i++) {
+        while (!joined[i] &&
+               pthread_cond_timedwait(&cond, &lock, &joined_by) == 0)
+            ;
+        failed = !joined[i] || ret[i] != 0;
+    }
+    pthread_mutex_unlock(&lock);
+    if (failed) {
+        fprintf(stderr, "Failed to join the signaling server\n");
+        goto cleanup;
+    }
+
+    // each side of a connection reports it open, members reached through the
+    // hub are reported like direct peers, so both topologies end up with
+    // every client seeing every other one
+    int expected = count * (count - 1);
+    int connections = hub ? count - 1 : count * (count - 1) / 2;
+    uint64_t start = rtc_now_micros();
+    for (int i = 0; i < count; i++)
+        rtc_client_handle_connection(clients[i]);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    pthread_mutex_lock(&lock);
+    while (opened < expected &&
+           pthread_cond_timedwait(&cond, &lock, &deadline) == 0)
+        ;
+    int done = opened;
+    pthread_mutex_unlock(&lock);
+    double elapsed = (rtc_now_micros() - start) / 1e6;
+
+    printf("%d clients%s, %d/%d peers open in %.3f s, %.1f connections/s\n",
+           count, hub ? " around a hub" : "", done, expected, elapsed,
+           (double)connections * done / expected / elapsed);
+
+    printf("\n%-20s %8s %10s %10s %10s\n", "stage", "samples", "p50 ms",
+           "p99 ms", "max ms");
+    for (int stage = 0; stage < RTC_STAGE_COUNT; stage++) {
+        struct rtc_histogram total = {0};
+        for (int i = 0; i < count; i++) {
+            struct rtc_histogram stats;
+            if (rtc_client_get_connect_stats(clients[i], stage, &stats) == 0)
+                rtc_histogram_merge(&total, &stats);
+        }
+        printf("%-20s %8llu %10.2f %10.2f %10.2f\n", stage_names[stage],
+               (unsigned long long)total.count,
+               rtc_histogram_percentile(&total, 0.5) / 1e3,
+               rtc_histogram_percentile(&total, 0.99) / 1e3, total.max / 1e3);
+    }
+    failed = done < expected;
+
+cleanup:
+    for (int i = 0; clients != NULL && i < count; i++)
+        rtc_client_destroy(clients[i]);
+    loopback_server_stop(server);
+    free(clients);
+    free(joined);
+    free(ret);
+    return failed;
+}
@@ -0,0 +1,432 @@
+#include "loopback_server.h"
+#include "rtc_handler.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// throughput and one-way latency of messages between two clients connected
+// over localhost, for each message size, send rate and lane, both clients
+// share a clock so latency is exact, results are written as JSON
+//
+// usage: bench_datachannel [-d milliseconds] [-s sizes] [-r rates] [-j]
+//                          [-o file]
+//
+// sizes and rates are comma separated, a rate of 0 sends as fast as the
+// send queue drains, -j uses the JSON envelope instead of binary framing
+
+#define DEFAULT_DURATION 1000
+#define DEFAULT_SIZES "64,1024,16384"
+#define DEFAULT_RATES "1000,10000,0"
+#define MAX_VALUES 16
+#define CONNECT_TIMEOUT 30
+// a run is over once nothing arrived for this long after the last send
+#define DRAIN_TIMEOUT 500000
+
+struct mode {
+    const char *api;
+    // NULL sends with rtc_client_send_message
+    const char *type;
+    rtc_lane lane;
+};
+
+static const struct mode modes[] = {
+    {"send_message", NULL, RTC_LANE_CONTROL},
+    {"send_typed_object", "bench_control", RTC_LANE_CONTROL},
+    {"send_typed_object", "bench_realtime", RTC_LANE_REALTIME},
+    {"send_typed_object", "bench_bulk", RTC_LANE_BULK},
+};
+
+static const char *lane_names[] = {"control", "realtime", "bulk"};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+// channel of the receiver on the sender, -1 until it opens
+static int channel = -1;
+static int receiver_open = 0;
+
+// what arrived during the current run, messages of earlier runs still in
+// flight are ignored
+static int current_run = -1;
+static uint64_t received = 0;
+static uint64_t received_bytes = 0;
+static uint64_t received_at = 0;
+static uint64_t *latencies = NULL;
+static size_t latency_capacity = 0;
+
+static void onSenderOpened(int id, void *ptr) {
+    pthread_mutex_lock(&lock);
+    channel = id;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static void onReceiverOpened(int id, void *ptr) {
+    pthread_mutex_lock(&lock);
+    receiver_open = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static void onPayload(int id, const char *type, const char *payload, int size,
+                      void *ptr) {
+    uint64_t now = rtc_now_micros();
+
+    // run and send time lead the message in both formats
+    char head[64];
+    int length = size < (int)sizeof(head) - 1 ? size : (int)sizeof(head) - 1;
+    memcpy(head, payload, length);
+    head[length] = '\0';
+    int run;
+    unsigned long long sent_at;
+    int parsed =
+        type == NULL ? sscanf(head, "%d %llu", &run, &sent_at)
+                     : sscanf(head, "{\"run\":%d,\"t\":%llu", &run, &sent_at);
+    if (parsed != 2)
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (run == current_run) {
+        if (received == latency_capacity) {
+            size_t capacity = latency_capacity ? latency_capacity * 2 : 4096;
+            uint64_t *grown = realloc(latencies, capacity * sizeof(uint64_t));
+            if (grown != NULL) {
+                latencies = grown;
+                latency_capacity = capacity;
+            }
+        }
+        if (received < latency_capacity) {
+            latencies[received++] = now - sent_at;
+            received_bytes += size;
+            received_at = now;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static int parseList(const char *list, int *values) {
+    int count = 0;
+    const char *p = list;
+    while (*p != '\0' && count < MAX_VALUES) {
+        char *end;
+        long value = strtol(p, &end, 10);
+        if (end == p || value < 0)
+            return -1;
+        values[count++] = value;
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return -1;
+    }
+    return count;
+}
+
+static void sleepUntil(uint64_t micros) {
+    struct timespec ts = {
+        .tv_sec = micros / 1000000,
+        .tv_nsec = (micros % 1000000) * 1000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// latencies must be sorted
+static uint64_t percentile(size_t count, double p) {
+    if (count == 0)
+        return 0;
+    size_t rank = p * count;
+    return latencies[rank < count ? rank : count - 1];
+}
+
+static json_object *runOne(rtc_client *sender, int run,
+                           const struct mode *mode, int size, int rate,
+                           int duration) {
+    // a message of about size bytes, padded after the run and send time
+    char *message = malloc(size + 64);
+    json_object *obj = json_object_new_object();
+    json_object *sent_at = json_object_new_int64(0);
+    json_object_object_add(obj, "run", json_object_new_int(run));
+    json_object_object_add(obj, "t", sent_at);
+    if (message == NULL || obj == NULL || sent_at == NULL) {
+        free(message);
+        json_object_put(obj);
+        return NULL;
+    }
+    int pad = size > 48 ? size - 48 : 0;
+    memset(message, 'x', pad);
+    message[pad] = '\0';
+    json_object_object_add(obj, "pad", json_object_new_string(message));
+
+    struct rtc_peer_stats before, after;
+    rtc_client_get_peer_stats(sender, channel, &before);
+
+    pthread_mutex_lock(&lock);
+    current_run = run;
+    received = 0;
+    received_bytes = 0;
+    received_at = 0;
+    pthread_mutex_unlock(&lock);
+
+    uint64_t sent = 0;
+    uint64_t start = rtc_now_micros();
+    uint64_t end = start + (uint64_t)duration * 1000;
+    for (uint64_t now = start; now < end; now = rtc_now_micros()) {
+        if (rate > 0) {
+            uint64_t next = start + sent * 1000000 / rate;
+            if (next > now)
+                sleepUntil(next);
+        } else if (rtc_client_get_queue_depth(sender, channel, NULL) > 0) {
+            // unpaced, but without overrunning the send queue
+            usleep(50);
+            continue;
+        }
+
+        uint64_t t = rtc_now_micros();
+        if (mode->type == NULL) {
+            int n = snprintf(message, size + 64, "%d %llu ", run,
+                             (unsigned long long)t);
+            memset(message + n, 'x', size > n ? size - n : 0);
+            message[size > n ? size : n] = '\0';
+            rtc_client_send_message(sender, message);
+        } else {
+            json_object_set_int64(sent_at, t);
+            rtc_client_send_typed_object(sender, mode->type, obj);
+        }
+        sent++;
+    }
+
+    // wait for the rest to arrive, realtime messages may never do
+    uint64_t last_count = 0;
+    uint64_t last_change = rtc_now_micros();
+    for (;;) {
+        usleep(10000);
+        rtc_client_get_peer_stats(sender, channel, &after);
+        uint64_t dropped = after.dropped - before.dropped;
+        pthread_mutex_lock(&lock);
+        uint64_t count = received;
+        pthread_mutex_unlock(&lock);
+        uint64_t now = rtc_now_micros();
+        if (count != last_count) {
+            last_count = count;
+            last_change = now;
+        }
+        if (count + dropped >= sent || now - last_change > DRAIN_TIMEOUT)
+            break;
+    }
+
+    pthread_mutex_lock(&lock);
+    current_run = -1;
+    size_t count = received;
+    qsort(latencies, count, sizeof(uint64_t), compareLatency);
+    double elapsed = received_at > start ? (received_at - start) / 1e6 : 0;
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += latencies[i];
+
+    json_object *result = json_object_new_object();
+    json_object_object_add(result, "api", json_object_new_string(mode->api));
+    json_object_object_add(result, "lane",
+                           json_object_new_string(lane_names[mode->lane]));
+    json_object_object_add(result, "size", json_object_new_int(size));
+    json_object_object_add(result, "rate", json_object_new_int(rate));
+    json_object_object_add(result, "sent", json_object_new_int64(sent));
+    json_object_object_add(result, "received", json_object_new_int64(count));
+    json_object_object_add(
+        result, "dropped",
+        json_object_new_int64(after.dropped - before.dropped));
+    json_object_object_add(
+        result, "msgs_per_sec",
+        json_object_new_double(elapsed > 0 ? count / elapsed : 0));
+    json_object_object_add(
+        result, "mb_per_sec",
+        json_object_new_double(elapsed > 0 ? received_bytes / elapsed / 1e6
+                                           : 0));
+    json_object *latency = json_object_new_object();
+    json_object_object_add(
+        latency, "mean", json_object_new_int64(count ? total / count : 0));
+    json_object_object_add(latency, "p50",
+                           json_object_new_int64(percentile(count, 0.5)));
+    json_object_object_add(latency, "p99",
+                           json_object_new_int64(percentile(count, 0.99)));
+    json_object_object_add(latency, "p999",
+                           json_object_new_int64(percentile(count, 0.999)));
+    json_object_object_add(
+        latency, "max",
+        json_object_new_int64(count ? latencies[count - 1] : 0));
+    json_object_object_add(result, "latency_us", latency);
+
+    fprintf(stderr,
+            "%-18s %-8s %6d B %6d/s: %8llu/%-8llu %10.0f msg/s %8.2f MB/s "
+            "p50 %6llu us p99 %6llu us\n",
+            mode->api, lane_names[mode->lane], size, rate,
+            (unsigned long long)count, (unsigned long long)sent,
+            elapsed > 0 ? count / elapsed : 0,
+            elapsed > 0 ? received_bytes / elapsed / 1e6 : 0,
+            (unsigned long long)percentile(count, 0.5),
+            (unsigned long long)percentile(count, 0.99));
+    pthread_mutex_unlock(&lock);
+
+    free(message);
+    json_object_put(obj);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    int duration = DEFAULT_DURATION;
+    const char *size_list = DEFAULT_SIZES;
+    const char *rate_list = DEFAULT_RATES;
+    rtc_framing framing = RTC_FRAMING_BINARY;
+    const char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:r:jo:")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            size_list = optarg;
+            break;
+        case 'r':
+            rate_list = optarg;
+            break;
+        case 'j':
+            framing = RTC_FRAMING_JSON;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-d milliseconds] [-s sizes] [-r rates] [-j] "
+                    "[-o file]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    int sizes[MAX_VALUES];
+    int rates[MAX_VALUES];
+    int size_count = parseList(size_list, sizes);
+    int rate_count = parseList(rate_list, rates);
+    if (size_count <= 0 || rate_count <= 0 || duration <= 0) {
+        fprintf(stderr, "Invalid sizes, rates or duration\n");
+        return 1;
+    }
+
+    loopback_server *server = loopback_server_start(0);
+    if (server == NULL) {
+        fprintf(stderr, "Failed to start signaling server\n");
+        return 1;
+    }
+    char url[64];
+    snprintf(url, sizeof(url), "ws://127.0.0.1:%u/",
+             loopback_server_port(server));
+
+    rtc_client *clients[2] = {NULL, NULL};
+    int joined[2] = {0, 0};
+    int ret[2] = {0, 0};
+    int failed = 0;
+    for (int i = 0; i < 2 && !failed; i++) {
+        char name[UUID_STR_LEN];
+        generate_uuid(name);
+        clients[i] = rtc_client_initialize(NULL, 0, url, name, "bench", 2,
+                                           &lock, &cond, &joined[i], &ret[i]);
+        if (clients[i] == NULL) {
+            failed = 1;
+            break;
+        }
+        rtc_client_set_framing(clients[i], framing);
+        // ids have to match on both sides
+        for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+            if (modes[m].type == NULL)
+                continue;
+            rtc_client_register_type(clients[i], m, modes[m].type);
+            rtc_client_set_type_lane(clients[i], modes[m].type,
+                                     modes[m].lane);
+        }
+    }
+    rtc_client *sender = clients[0];
+    rtc_client *receiver = clients[1];
+    if (!failed) {
+        rtc_client_set_message_opened_callback(sender, onSenderOpened);
+        rtc_client_set_message_opened_callback(receiver, onReceiverOpened);
+        rtc_client_set_payload_received_callback(receiver, onPayload);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CONNECT_TIMEOUT;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < 2 && !failed; i++) {
+        while (!joined[i] &&
+               pthread_cond_timedwait(&cond, &lock, &deadline) == 0)
+            ;
+        failed = !joined[i] || ret[i] != 0;
+    }
+    pthread_mutex_unlock(&lock);
+    if (!failed) {
+        rtc_client_handle_connection(sender);
+        rtc_client_handle_connection(receiver);
+    }
+    pthread_mutex_lock(&lock);
+    while (!failed && (channel < 0 || !receiver_open) &&
+           pthread_cond_timedwait(&cond, &lock, &deadline) == 0)
+        ;
+    failed = failed || channel < 0 || !receiver_open;
+    pthread_mutex_unlock(&lock);
+    if (failed) {
+        fprintf(stderr, "Failed to connect the clients\n");
+        goto cleanup;
+    }
+
+    json_object *root = json_object_new_object();
+    json_object *runs = json_object_new_array();
+    json_object_object_add(root, "benchmark",
+                           json_object_new_string("datachannel"));
+    json_object_object_add(
+        root, "framing",
+        json_object_new_string(framing == RTC_FRAMING_BINARY ? "binary"
+                                                             : "json"));
+    json_object_object_add(root, "duration_ms", json_object_new_int(duration));
+    json_object_object_add(root, "runs", runs);
+
+    int run = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+        for (int s = 0; s < size_count; s++) {
+            for (int r = 0; r < rate_count; r++) {
+                json_object *result = runOne(sender, run++, &modes[m],
+                                             sizes[s], rates[r], duration);
+                if (result != NULL)
+                    json_object_array_add(runs, result);
+            }
+        }
+    }
+
+    FILE *out = output != NULL ? fopen(output, "w") : stdout;
+    if (out != NULL) {
+        fprintf(out, "%s\n",
+                json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY));
+        if (out != stdout)
+            fclose(out);
+    } else {
+        fprintf(stderr, "Failed to open %s\n", output);
+        failed = 1;
+    }
+    json_object_put(root);
+
+cleanup:
+    rtc_client_destroy(receiver);
+    rtc_client_destroy(sender);
+    loopback_server_stop(server);
+    free(latencies);
+    return failed;
+}
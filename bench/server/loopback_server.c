@@ -0,0 +1,196 @@
+#include "loopback_server.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <json-c/json.h>
+#include <rtc/rtc.h>
+
+struct connection {
+    int ws;
+    char user[64];
+    char room[256];
+    bool closed;
+};
+
+struct loopback_server {
+    int id;
+    uint16_t port;
+    // every socket until the server stops, sockets can't be deleted from
+    // their own callbacks
+    struct connection *connections;
+    int count;
+    pthread_mutex_t lock;
+};
+
+static void onClient(int wsserver, int ws, void *ptr);
+static void onClientOpen(int ws, void *ptr);
+static void onClientMessage(int ws, const char *message, int size, void *ptr);
+static void onClientClosed(int ws, void *ptr);
+static struct connection *findConnection(loopback_server *server, int ws);
+static void readQuery(const char *path, const char *key, char *out,
+                      size_t size);
+
+loopback_server *loopback_server_start(uint16_t port) {
+    loopback_server *server = calloc(1, sizeof(loopback_server));
+    if (server == NULL)
+        return NULL;
+    pthread_mutex_init(&server->lock, NULL);
+
+    rtcWsServerConfiguration config = {
+        .port = port,
+        .bindAddress = "127.0.0.1",
+    };
+    // clients connect only once the port is known, so the user pointer is
+    // set before any of them arrives
+    server->id = rtcCreateWebSocketServer(&config, onClient);
+    if (server->id < 0) {
+        pthread_mutex_destroy(&server->lock);
+        free(server);
+        return NULL;
+    }
+    rtcSetUserPointer(server->id, server);
+    server->port = rtcGetWebSocketServerPort(server->id);
+    return server;
+}
+
+uint16_t loopback_server_port(loopback_server *server) { return server->port; }
+
+void loopback_server_stop(loopback_server *server) {
+    rtcDeleteWebSocketServer(server->id);
+
+    // no client can be added once the server is deleted, so the sockets are
+    // deleted in place, without the lock since deleting waits for the
+    // socket's callbacks, which take it
+    pthread_mutex_lock(&server->lock);
+    int count = server->count;
+    pthread_mutex_unlock(&server->lock);
+
+    for (int i = 0; i < count; i++)
+        rtcDeleteWebSocket(server->connections[i].ws);
+
+    free(server->connections);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
+
+static void onClient(int wsserver, int ws, void *ptr) {
+    loopback_server *server = ptr;
+
+    pthread_mutex_lock(&server->lock);
+    struct connection *connections = realloc(
+        server->connections, (server->count + 1) * sizeof(struct connection));
+    if (connections != NULL) {
+        server->connections = connections;
+        connections[server->count++] = (struct connection){.ws = ws};
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (connections == NULL) {
+        fprintf(stderr, "Dropped client %d\n", ws);
+        return;
+    }
+    rtcSetUserPointer(ws, server);
+    rtcSetOpenCallback(ws, onClientOpen);
+    rtcSetMessageCallback(ws, onClientMessage);
+    rtcSetClosedCallback(ws, onClientClosed);
+}
+
+static void onClientOpen(int ws, void *ptr) {
+    loopback_server *server = ptr;
+    char path[512];
+    if (rtcGetWebSocketPath(ws, path, sizeof(path)) < 0)
+        path[0] = '\0';
+
+    pthread_mutex_lock(&server->lock);
+    struct connection *connection = findConnection(server, ws);
+    if (connection != NULL) {
+        readQuery(path, "user", connection->user, sizeof(connection->user));
+        readQuery(path, "room", connection->room, sizeof(connection->room));
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void onClientMessage(int ws, const char *message, int size, void *ptr) {
+    loopback_server *server = ptr;
+    // text arrives with a negative size, and is relayed as text
+    int length = size < 0 ? -size - 1 : size;
+
+    json_tokener *tokener = json_tokener_new();
+    json_object *root =
+        tokener != NULL ? json_tokener_parse_ex(tokener, message, length)
+                        : NULL;
+    json_object *value;
+    const char *protocol =
+        json_object_object_get_ex(root, "protocol", &value)
+            ? json_object_get_string(value)
+            : NULL;
+    const char *endpoint =
+        json_object_object_get_ex(root, "endpoint", &value)
+            ? json_object_get_string(value)
+            : NULL;
+    bool to_room = protocol != NULL && strcmp(protocol, "one-to-room") == 0;
+    bool to_one = protocol != NULL && endpoint != NULL &&
+                  strcmp(protocol, "one-to-one") == 0;
+
+    pthread_mutex_lock(&server->lock);
+    struct connection *sender = findConnection(server, ws);
+    for (int i = 0; sender != NULL && (to_room || to_one) && i < server->count;
+         i++) {
+        struct connection *other = &server->connections[i];
+        if (other == sender || other->closed ||
+            strcmp(other->room, sender->room) != 0)
+            continue;
+        if (to_room || strcmp(other->user, endpoint) == 0)
+            rtcSendMessage(other->ws, message, size);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    json_object_put(root);
+    if (tokener != NULL)
+        json_tokener_free(tokener);
+}
+
+static void onClientClosed(int ws, void *ptr) {
+    loopback_server *server = ptr;
+
+    pthread_mutex_lock(&server->lock);
+    struct connection *connection = findConnection(server, ws);
+    if (connection != NULL)
+        connection->closed = true;
+    pthread_mutex_unlock(&server->lock);
+}
+
+// must be called with the lock held
+static struct connection *findConnection(loopback_server *server, int ws) {
+    for (int i = 0; i < server->count; i++) {
+        if (server->connections[i].ws == ws)
+            return &server->connections[i];
+    }
+    return NULL;
+}
+
+// copies the value of key from the query of path, empty if it has none,
+// values are taken as they are, the clients send plain names
+static void readQuery(const char *path, const char *key, char *out,
+                      size_t size) {
+    out[0] = '\0';
+    const char *query = strchr(path, '?');
+    size_t key_length = strlen(key);
+    while (query != NULL) {
+        query++;
+        if (strncmp(query, key, key_length) == 0 && query[key_length] == '=') {
+            const char *value = query + key_length + 1;
+            size_t length = strcspn(value, "&");
+            if (length >= size)
+                length = size - 1;
+            memcpy(out, value, length);
+            out[length] = '\0';
+            return;
+        }
+        query = strchr(query, '&');
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef LOOPBACK_SERVER_H
+#define LOOPBACK_SERVER_H
+
+#include <stdint.h>
+
+// signaling server on localhost speaking the protocol of rtc_handler, so
+// benchmarks need no outside service
+//
+// clients connect with ?user=name&room=name, one-to-room messages go to
+// everyone else in the sender's room and one-to-one messages to the user
+// named by "endpoint" in it, messages are relayed unchanged
+typedef struct loopback_server loopback_server;
+
+// port 0 picks a free one, NULL on error
+loopback_server *loopback_server_start(uint16_t port);
+uint16_t loopback_server_port(loopback_server *server);
+void loopback_server_stop(loopback_server *server);
+
+#endif // LOOPBACK_SERVER_H
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 
 #define MAX_SERVERS 100
+#define MAX_PEERS 64
 
 #define INPUT_HEIGHT 3
 #define MAX_INPUT 256
@@ -36,27 +37,32 @@ void free_messages();
 void reprint_messages();
 
 void onMessageOpen(int id, void *ptr) {
+    rtc_peer_context *peer = (rtc_peer_context *)ptr;
     char sent_message[256];
-    snprintf(sent_message, 256, "[%d]: %s", id, "Data channel opened");
+    snprintf(sent_message, sizeof(sent_message), "[%s]: %s", peer->uuid,
+             "Data channel opened");
 
     add_message_to_buffer(sent_message);
 }
 
 void onMessageReceived(int id, const char *message, int size, void *ptr) {
+    rtc_peer_context *peer = (rtc_peer_context *)ptr;
     char sent_message[256];
 
     json_object *root = json_tokener_parse(message);
-    json_object *sender = json_object_object_get(root, "sender");
     json_object *payload = json_object_object_get(root, "payload");
-    snprintf(sent_message, size, "[%s]: %s", json_object_get_string(sender),
+    snprintf(sent_message, sizeof(sent_message), "[%s]: %s", peer->uuid,
              json_object_get_string(payload));
+    json_object_put(root);
 
     add_message_to_buffer(sent_message);
 }
 
 void onMessageClose(int id, void *ptr) {
+    rtc_peer_context *peer = (rtc_peer_context *)ptr;
     char sent_message[256];
-    snprintf(sent_message, 256, "[%d]: %s", id, "Data channel closed");
+    snprintf(sent_message, sizeof(sent_message), "[%s]: %s", peer->uuid,
+             "Data channel closed");
 
     add_message_to_buffer(sent_message);
 }
@@ -131,7 +137,7 @@ int main(int argc, char *argv[]) {
     pthread_cond_init(&cond, NULL);
 
     rtc_initialize((const char **)ice_servers, count, ws_url, username, room,
-                   &lock, &cond, &ws_joined, &ws_ret_code);
+                   MAX_PEERS, &lock, &cond, &ws_joined, &ws_ret_code);
     rtc_set_message_opened_callback(onMessageOpen);
     rtc_set_message_received_callback(onMessageReceived);
     rtc_set_message_closed_callback(onMessageClose);
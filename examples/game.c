@@ -2,16 +2,44 @@
 #include "olcPixelGameEngineC.h"
 
 #include "rtc_handler.h"
+#include "rtc_prediction.h"
+#include "rtc_snapshot.h"
 #include "containers/zhash-c/zsorted_hash.h"
 
 #include <time.h>
 #include <unistd.h>
 
 #define MAX_SERVERS 100
+#define MAX_PEERS 64
+
+#define PLAYER_MOVE 1
+#define PLAYER_INPUT 2
+#define PLAYER_STATE 3
+#define INBOX_SIZE 1024
+#define EVENTS_PER_POLL 64
 
 #define TARGET_FPS 60
 #define FRAME_TIME (1000000 / TARGET_FPS) // Time per frame in microseconds
 
+// positions are sent at this rate no matter how fast frames are rendered
+#define NETWORK_TICK_RATE 20
+#define TICK_TIME (1.0f / NETWORK_TICK_RATE)
+// a bit over a second and a half of movement at the tick rate
+#define SNAPSHOT_CAPACITY 32
+// remote players are drawn this far in the past, about two ticks, so there
+// is usually a newer snapshot to interpolate towards
+#define DEFAULT_RENDER_DELAY 100
+// inputs a member keeps until the host acknowledges them, a few seconds
+// worth at the frame rate
+#define INPUT_CAPACITY 256
+// longest a single input may move a player for, in seconds
+#define MAX_INPUT_TIME 0.1f
+
+#define KEY_LEFT (1 << 0)
+#define KEY_RIGHT (1 << 1)
+#define KEY_UP (1 << 2)
+#define KEY_DOWN (1 << 3)
+
 pthread_mutex_t lock;
 pthread_cond_t cond;
 int ws_joined = 0;
@@ -20,44 +48,299 @@ int ws_ret_code = 0;
 char username[UUID_STR_LEN];
 char room[256] = "\0";
 
-float player_x, player_y;
-float player_vel_x, player_vel_y;
+rtc_client *client;
+
 float player_speed = 150.0f;
 
-struct Peer {
+// MESH moves its own player and tells everyone where it went, HUB is the
+// host moving every player from their inputs, MEMBER sends its inputs to the
+// host and predicts where they take its player until the host answers
+rtc_topology topology = RTC_TOPOLOGY_MESH;
+
+struct PlayerState {
     float x;
     float y;
 };
 
+struct PlayerInput {
+    unsigned int keys;
+    // seconds the keys were held
+    float dt;
+};
+
+struct PlayerState player;
+// members only
+struct rtc_prediction prediction;
+
+// milliseconds
+int render_delay = DEFAULT_RENDER_DELAY;
+float tick_elapsed;
+struct PlayerState sent = { -1, -1 };
+
+struct Peer {
+    // event strings only live until the next poll, the table keeps this one
+    char uuid[UUID_STR_LEN];
+    // x and y at the local time they were sent
+    struct rtc_snapshot_buffer snapshots;
+    // the host's authoritative state of a member and its last input applied
+    struct PlayerState state;
+    uint32_t sequence;
+};
+
 struct ZSortedHashTable *peers;
 
-void onMessageOpen(int id, void *ptr) {
-    struct Peer *new_peer = malloc(sizeof(struct Peer));
-    zsorted_hash_set(peers, ptr, new_peer);
+// each kind of message is built once, sends only update its fields
+struct InputMessage {
+    json_object *root;
+    json_object *sequence;
+    json_object *keys;
+    json_object *dt;
+} input_message;
+
+struct StateMessage {
+    json_object *root;
+    json_object *player;
+    json_object *x;
+    json_object *y;
+    json_object *sequence;
+    json_object *time;
+} state_message;
+
+struct MoveMessage {
+    json_object *root;
+    json_object *x;
+    json_object *y;
+    json_object *time;
+} move_message;
+
+json_object *addField(json_object *root, const char *key, json_object *value) {
+    json_object_object_add(root, key, value);
+    return value;
+}
+
+void createMessages() {
+    input_message.root = json_object_new_object();
+    input_message.sequence = addField(input_message.root, "sequence",
+                                      json_object_new_int64(0));
+    input_message.keys =
+        addField(input_message.root, "keys", json_object_new_int(0));
+    input_message.dt =
+        addField(input_message.root, "dt", json_object_new_double(0));
+
+    state_message.root = json_object_new_object();
+    state_message.player = addField(state_message.root, "player",
+                                    json_object_new_string(username));
+    state_message.x =
+        addField(state_message.root, "player_x", json_object_new_double(0));
+    state_message.y =
+        addField(state_message.root, "player_y", json_object_new_double(0));
+    state_message.sequence = addField(state_message.root, "sequence",
+                                      json_object_new_int64(0));
+    state_message.time =
+        addField(state_message.root, "time", json_object_new_int64(0));
+
+    move_message.root = json_object_new_object();
+    move_message.x =
+        addField(move_message.root, "player_x", json_object_new_double(0));
+    move_message.y =
+        addField(move_message.root, "player_y", json_object_new_double(0));
+    move_message.time =
+        addField(move_message.root, "time", json_object_new_int64(0));
+}
+
+void freeMessages() {
+    json_object_put(input_message.root);
+    json_object_put(state_message.root);
+    json_object_put(move_message.root);
 }
 
-void onMessageReceived(int id, const char *message, int size, void *ptr) {
-    json_object *root = json_tokener_parse(message);
-    json_object *sender = json_object_object_get(root, "sender");
-    json_object *payload = json_object_object_get(root, "payload");
-    json_object *x = json_object_object_get(payload, "player_x");
-    json_object *y = json_object_object_get(payload, "player_y");
-
-    struct Peer *peer =
-        zsorted_hash_get(peers, (char *)json_object_get_string(sender));
-    if (peer != NULL) {
-        peer->x = json_object_get_double(x);
-        peer->y = json_object_get_double(y);
+// the host and predicting members both move players with this, so they agree
+// on where inputs lead
+void movePlayer(void *state, const void *input, void *arg) {
+    struct PlayerState *moved = state;
+    const struct PlayerInput *in = input;
+    float dt = in->dt;
+    if (dt < 0)
+        dt = 0;
+    if (dt > MAX_INPUT_TIME)
+        dt = MAX_INPUT_TIME;
+
+    if (in->keys & KEY_LEFT)
+        moved->x -= player_speed * dt;
+    if (in->keys & KEY_RIGHT)
+        moved->x += player_speed * dt;
+    if (in->keys & KEY_UP)
+        moved->y -= player_speed * dt;
+    if (in->keys & KEY_DOWN)
+        moved->y += player_speed * dt;
+}
+
+// events are polled from the render loop, so peers is only ever touched by
+// this thread
+void onMessageOpen(int id, rtc_peer_context *context) {
+    struct Peer *new_peer = calloc(1, sizeof(struct Peer));
+    strncpy(new_peer->uuid, context->uuid, sizeof(new_peer->uuid) - 1);
+    rtc_snapshot_init(&new_peer->snapshots, SNAPSHOT_CAPACITY, 2);
+    zsorted_hash_set(peers, new_peer->uuid, new_peer);
+    // later events find the peer without a lookup
+    context->user_data = new_peer;
+}
+
+void pushSnapshot(struct Peer *peer, int id, json_object *root) {
+    json_object *x = json_object_object_get(root, "player_x");
+    json_object *y = json_object_object_get(root, "player_y");
+    json_object *sent_at = json_object_object_get(root, "time");
+
+    // the sender's clock is only comparable to ours once probes estimated
+    // its offset, until then arrival time has to do
+    uint64_t time = rtc_now_micros();
+    struct rtc_clock_estimate clock;
+    if (sent_at != NULL && rtc_client_get_clock(client, id, &clock) == 0)
+        time = json_object_get_int64(sent_at) - clock.offset;
+
+    double position[2] = { json_object_get_double(x),
+                           json_object_get_double(y) };
+    rtc_snapshot_push(&peer->snapshots, time, position);
+}
+
+void onPlayerState(int id, json_object *root) {
+    const char *uuid =
+        json_object_get_string(json_object_object_get(root, "player"));
+    if (uuid == NULL)
+        return;
+
+    if (strcmp(uuid, username) == 0) {
+        if (topology != RTC_TOPOLOGY_MEMBER)
+            return;
+        struct PlayerState state = {
+            json_object_get_double(json_object_object_get(root, "player_x")),
+            json_object_get_double(json_object_object_get(root, "player_y")),
+        };
+        uint32_t sequence =
+            json_object_get_int64(json_object_object_get(root, "sequence"));
+        // inputs the host has not seen yet are replayed on top
+        if (rtc_prediction_reconcile(&prediction, sequence, &state) == 0)
+            player = *(struct PlayerState *)prediction.state;
+        return;
     }
+
+    struct Peer *peer = zsorted_hash_get(peers, (char *)uuid);
+    if (peer != NULL)
+        pushSnapshot(peer, id, root);
 }
 
-void onMessageClose(int id, void *ptr) {
-    struct Peer *peer = zsorted_hash_delete(peers, ptr);
+void onPlayerInput(struct Peer *peer, json_object *root) {
+    uint32_t sequence =
+        json_object_get_int64(json_object_object_get(root, "sequence"));
+    struct PlayerInput input = {
+        json_object_get_int(json_object_object_get(root, "keys")),
+        json_object_get_double(json_object_object_get(root, "dt")),
+    };
+    // the control lane is ordered, anything not newer is a duplicate
+    if ((int32_t)(sequence - peer->sequence) <= 0)
+        return;
+    movePlayer(&peer->state, &input, NULL);
+    peer->sequence = sequence;
+}
+
+void onPayloadReceived(int id, const char *type, const char *payload,
+                       int size, rtc_peer_context *context) {
+    struct Peer *peer = context->user_data;
+    if (type == NULL || peer == NULL)
+        return;
+
+    // binary framed payloads are not NUL terminated
+    json_tokener *tok = json_tokener_new();
+    json_object *root = json_tokener_parse_ex(tok, payload, size);
+    json_tokener_free(tok);
+
+    if (strcmp(type, "PLAYER_MOVE") == 0)
+        pushSnapshot(peer, id, root);
+    else if (strcmp(type, "PLAYER_STATE") == 0)
+        onPlayerState(id, root);
+    else if (strcmp(type, "PLAYER_INPUT") == 0 &&
+             topology == RTC_TOPOLOGY_HUB)
+        onPlayerInput(peer, root);
+    json_object_put(root);
+}
+
+void onMessageClose(int id, rtc_peer_context *context) {
+    struct Peer *peer = zsorted_hash_delete(peers, context->uuid);
+    context->user_data = NULL;
+    if (peer != NULL)
+        rtc_snapshot_free(&peer->snapshots);
     free(peer);
 }
 
+void pollEvents() {
+    rtc_event events[EVENTS_PER_POLL];
+    int count;
+    while ((count = rtc_client_poll(client, events, EVENTS_PER_POLL)) > 0) {
+        for (int i = 0; i < count; i++) {
+            rtc_event *event = &events[i];
+            switch (event->kind) {
+            case RTC_EVENT_OPENED:
+                onMessageOpen(event->id, event->context);
+                break;
+            case RTC_EVENT_MESSAGE:
+                onPayloadReceived(event->id, event->type, event->payload,
+                                  event->size, event->context);
+                break;
+            case RTC_EVENT_CLOSED:
+                onMessageClose(event->id, event->context);
+                break;
+            }
+        }
+    }
+}
+
+void sendInput(uint32_t sequence, const struct PlayerInput *input) {
+    json_object_set_int64(input_message.sequence, sequence);
+    json_object_set_int(input_message.keys, input->keys);
+    json_object_set_double(input_message.dt, input->dt);
+    rtc_client_send_typed_object(client, "PLAYER_INPUT", input_message.root);
+}
+
+void sendPlayerState(const char *uuid, const struct PlayerState *state,
+                     uint32_t sequence) {
+    // uuids all have the same length, so the string is only copied over
+    json_object_set_string(state_message.player, uuid);
+    json_object_set_double(state_message.x, state->x);
+    json_object_set_double(state_message.y, state->y);
+    json_object_set_int64(state_message.sequence, sequence);
+    json_object_set_int64(state_message.time, rtc_now_micros());
+    rtc_client_send_typed_object(client, "PLAYER_STATE", state_message.root);
+}
+
+// every tick, a lost state is made up for by the next one
+void sendPlayerStates() {
+    sendPlayerState(username, &player, 0);
+
+    struct ZIterator *iterator;
+    for (iterator = zcreate_iterator(peers); ziterator_exists(iterator);
+         ziterator_next(iterator)) {
+        struct Peer *peer = (struct Peer *)ziterator_get_val(iterator);
+        sendPlayerState(peer->uuid, &peer->state, peer->sequence);
+    }
+    zfree_iterator(iterator);
+}
+
+void sendMove() {
+    // the timestamp changes every tick, so only moves are sent
+    if (player.x == sent.x && player.y == sent.y)
+        return;
+
+    json_object_set_double(move_message.x, player.x);
+    json_object_set_double(move_message.y, player.y);
+    json_object_set_int64(move_message.time, rtc_now_micros());
+    // the client keeps its own copy of the state
+    rtc_client_set_state(client, "PLAYER_MOVE", move_message.root);
+    sent = player;
+}
+
 bool OnUserCreate() {
     peers = zcreate_sorted_hash_table();
+    createMessages();
 
     return true;
 }
@@ -68,48 +351,62 @@ long frame_duration;
 bool OnUserUpdate(float fElapsedTime) {
     clock_gettime(CLOCK_MONOTONIC, &start); // Start time for frame
 
+    pollEvents();
+
     PGE_Clear(olc_BLACK);
     char fps_str[256];
     snprintf(fps_str, 256, "FPS: %d", PGE_GetFPS());
     PGE_DrawString(10, 10, fps_str, olc_WHITE, 1);
 
+    uint64_t render_time = rtc_now_micros() - render_delay * 1000;
     struct ZIterator *iterator;
     for (iterator = zcreate_iterator(peers); ziterator_exists(iterator);
          ziterator_next(iterator)) {
         struct Peer *peer = (struct Peer *)ziterator_get_val(iterator);
-        PGE_FillCircle(peer->x, peer->y, 10, olc_BLUE);
+        double position[2];
+        // the host has the latest state of everyone
+        if (topology == RTC_TOPOLOGY_HUB)
+            PGE_FillCircle(peer->state.x, peer->state.y, 10, olc_BLUE);
+        else if (rtc_snapshot_sample(&peer->snapshots, render_time,
+                                     position) >= 0)
+            PGE_FillCircle(position[0], position[1], 10, olc_BLUE);
     }
     zfree_iterator(iterator);
 
     // draw player
-    PGE_FillCircle(player_x, player_y, 10, olc_RED);
-
-    player_vel_x = player_vel_y = 0;
-
-    if (PGE_GetKey(olc_A).bHeld) {
-        player_vel_x -= player_speed * fElapsedTime;
+    PGE_FillCircle(player.x, player.y, 10, olc_RED);
+
+    struct PlayerInput input = { 0, fElapsedTime };
+    if (PGE_GetKey(olc_A).bHeld)
+        input.keys |= KEY_LEFT;
+    if (PGE_GetKey(olc_D).bHeld)
+        input.keys |= KEY_RIGHT;
+    if (PGE_GetKey(olc_W).bHeld)
+        input.keys |= KEY_UP;
+    if (PGE_GetKey(olc_S).bHeld)
+        input.keys |= KEY_DOWN;
+
+    if (input.keys != 0 && topology == RTC_TOPOLOGY_MEMBER) {
+        // moves right away instead of a round trip later
+        sendInput(rtc_prediction_input(&prediction, &input), &input);
+        player = *(struct PlayerState *)prediction.state;
+    } else if (input.keys != 0) {
+        movePlayer(&player, &input, NULL);
     }
-    if (PGE_GetKey(olc_D).bHeld) {
-        player_vel_x += player_speed * fElapsedTime;
-    }
-    if (PGE_GetKey(olc_W).bHeld) {
-        player_vel_y -= player_speed * fElapsedTime;
-    }
-    if (PGE_GetKey(olc_S).bHeld) {
-        player_vel_y += player_speed * fElapsedTime;
-    }
-
-    player_x += player_vel_x;
-    player_y += player_vel_y;
 
-    // if (player_vel_x != 0 && player_vel_y != 0) {
-    json_object *root = json_object_new_object();
-    json_object_object_add(root, "player_x", json_object_new_double(player_x));
-    json_object_object_add(root, "player_y", json_object_new_double(player_y));
-    rtc_send_typed_object("PLAYER_MOVE", root);
-    // rtc_send_message(json_object_to_json_string(root));
-    json_object_put(root);
-    // }
+    // frames only move the player locally, the network tick sends where it
+    // ended up
+    tick_elapsed += fElapsedTime;
+    if (tick_elapsed >= TICK_TIME) {
+        tick_elapsed -= TICK_TIME;
+        // a stalled frame sends once instead of catching up
+        if (tick_elapsed >= TICK_TIME)
+            tick_elapsed = 0;
+        if (topology == RTC_TOPOLOGY_HUB)
+            sendPlayerStates();
+        else if (topology == RTC_TOPOLOGY_MESH)
+            sendMove();
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &end); // End time for frame
     frame_duration = (end.tv_sec - start.tv_sec) * 1000000 +
@@ -123,7 +420,10 @@ bool OnUserUpdate(float fElapsedTime) {
     return !PGE_GetKey(olc_ESCAPE).bPressed;
 }
 
-bool OnUserDestroy() { return true; }
+bool OnUserDestroy() {
+    freeMessages();
+    return true;
+}
 
 void print_usage(char *prog_name);
 void read_servers_from_file(const char *file_path, char servers[][256],
@@ -137,7 +437,7 @@ int main(int argc, char *argv[]) {
     char input_servers[256] = { 0 };
     int use_file = 0, use_stun = 0;
 
-    while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+    while ((opt = getopt(argc, argv, "f:s:d:HM")) != -1) {
         switch (opt) {
         case 'f':
             strncpy(file_path, optarg, sizeof(file_path) - 1);
@@ -147,6 +447,15 @@ int main(int argc, char *argv[]) {
             strncpy(input_servers, optarg, sizeof(input_servers) - 1);
             use_stun = 1;
             break;
+        case 'd':
+            render_delay = atoi(optarg);
+            break;
+        case 'H':
+            topology = RTC_TOPOLOGY_HUB;
+            break;
+        case 'M':
+            topology = RTC_TOPOLOGY_MEMBER;
+            break;
         default:
             print_usage(argv[0]);
             exit(EXIT_FAILURE);
@@ -196,11 +505,26 @@ int main(int argc, char *argv[]) {
     pthread_mutex_init(&lock, NULL);
     pthread_cond_init(&cond, NULL);
 
-    rtc_initialize((const char **)ice_servers, count, ws_url, username, room,
-                   &lock, &cond, &ws_joined, &ws_ret_code);
-    rtc_set_message_opened_callback(onMessageOpen);
-    rtc_set_message_received_callback(onMessageReceived);
-    rtc_set_message_closed_callback(onMessageClose);
+    client = rtc_client_initialize((const char **)ice_servers, count, ws_url,
+                                   username, room, MAX_PEERS, &lock, &cond,
+                                   &ws_joined, &ws_ret_code);
+    rtc_client_set_framing(client, RTC_FRAMING_BINARY);
+    rtc_client_register_type(client, PLAYER_MOVE, "PLAYER_MOVE");
+    // inputs stay on the control lane, a lost one would move the host's
+    // player differently than the prediction did
+    rtc_client_register_type(client, PLAYER_INPUT, "PLAYER_INPUT");
+    rtc_client_register_type(client, PLAYER_STATE, "PLAYER_STATE");
+    // every move carries the full position, so a lost one needs no resend
+    rtc_client_set_type_lane(client, "PLAYER_MOVE", RTC_LANE_REALTIME);
+    rtc_client_set_type_lane(client, "PLAYER_STATE", RTC_LANE_REALTIME);
+    // inputs are for the host, the other members only need its states
+    rtc_client_set_type_relay(client, "PLAYER_INPUT", false);
+    rtc_client_set_topology(client, topology);
+    if (topology == RTC_TOPOLOGY_MEMBER)
+        rtc_prediction_init(&prediction, &player, sizeof(player),
+                            sizeof(struct PlayerInput), INPUT_CAPACITY,
+                            movePlayer, NULL);
+    rtc_client_set_inbox(client, INBOX_SIZE);
 
     pthread_mutex_lock(&lock);
     while (!ws_joined) {
@@ -215,17 +539,22 @@ int main(int argc, char *argv[]) {
         exit(ws_ret_code);
     }
 
-    rtc_handle_connection();
+    rtc_client_handle_connection(client);
 
     PGE_SetAppName("Example WebRTC Game");
     if (PGE_Construct(320, 240, 3, 3, false, false))
         PGE_Start(&OnUserCreate, &OnUserUpdate, &OnUserDestroy);
 
+    rtc_client_destroy(client);
+    rtc_prediction_free(&prediction);
     return 0;
 }
 
 void print_usage(char *prog_name) {
-    fprintf(stderr, "Usage: %s [-f file_path] [-s ice_servers]\n", prog_name);
+    fprintf(stderr,
+            "Usage: %s [-f file_path] [-s ice_servers] [-d render_delay_ms] "
+            "[-H | -M]\n",
+            prog_name);
 }
 
 void read_servers_from_file(const char *file_path, char servers[][256],
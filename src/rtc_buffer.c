@@ -0,0 +1,160 @@
+#include "rtc_buffer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+int rtc_buffer_init(struct rtc_buffer *buf, size_t capacity) {
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+    return rtc_buffer_reserve(buf, capacity);
+}
+
+void rtc_buffer_free(struct rtc_buffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+int rtc_buffer_reserve(struct rtc_buffer *buf, size_t capacity) {
+    if (capacity <= buf->capacity)
+        return 0;
+
+    size_t new_capacity = buf->capacity > 0 ? buf->capacity : 64;
+    while (new_capacity < capacity)
+        new_capacity *= 2;
+
+    char *data = realloc(buf->data, new_capacity);
+    if (data == NULL)
+        return -1;
+    buf->data = data;
+    buf->capacity = new_capacity;
+    return 0;
+}
+
+int rtc_buffer_append(struct rtc_buffer *buf, const char *data, size_t size) {
+    // an empty buffer has no storage to copy nothing into yet
+    if (size == 0)
+        return 0;
+    if (rtc_buffer_reserve(buf, buf->size + size) != 0)
+        return -1;
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 0;
+}
+
+int rtc_buffer_append_json_string(struct rtc_buffer *buf, const char *data,
+                                  size_t size) {
+    static const char hex[] = "0123456789abcdef";
+
+    size_t escaped = size + 2;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char c = data[i];
+        if (c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t')
+            escaped += 1;
+        else if (c < 0x20)
+            escaped += 5;
+    }
+    if (rtc_buffer_reserve(buf, buf->size + escaped) != 0)
+        return -1;
+
+    char *out = buf->data + buf->size;
+    *out++ = '"';
+    for (size_t i = 0; i < size; i++) {
+        unsigned char c = data[i];
+        switch (c) {
+        case '"':
+        case '\\':
+            *out++ = '\\';
+            *out++ = c;
+            break;
+        case '\n':
+            *out++ = '\\';
+            *out++ = 'n';
+            break;
+        case '\r':
+            *out++ = '\\';
+            *out++ = 'r';
+            break;
+        case '\t':
+            *out++ = '\\';
+            *out++ = 't';
+            break;
+        default:
+            if (c < 0x20) {
+                memcpy(out, "\\u00", 4);
+                out[4] = hex[c >> 4];
+                out[5] = hex[c & 0xf];
+                out += 6;
+            } else {
+                *out++ = c;
+            }
+        }
+    }
+    *out++ = '"';
+    buf->size = out - buf->data;
+    return 0;
+}
+
+static const char base64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int rtc_buffer_append_base64(struct rtc_buffer *buf, const char *data,
+                             size_t size) {
+    if (rtc_buffer_reserve(buf, buf->size + (size + 2) / 3 * 4) != 0)
+        return -1;
+
+    const unsigned char *in = (const unsigned char *)data;
+    char *out = buf->data + buf->size;
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < size)
+            v |= in[i + 1] << 8;
+        if (i + 2 < size)
+            v |= in[i + 2];
+        *out++ = base64Alphabet[v >> 18 & 0x3f];
+        *out++ = base64Alphabet[v >> 12 & 0x3f];
+        *out++ = i + 1 < size ? base64Alphabet[v >> 6 & 0x3f] : '=';
+        *out++ = i + 2 < size ? base64Alphabet[v & 0x3f] : '=';
+    }
+    buf->size = out - buf->data;
+    return 0;
+}
+
+static int base64Value(char c) {
+    const char *p = c != '\0' ? strchr(base64Alphabet, c) : NULL;
+    return p != NULL ? p - base64Alphabet : -1;
+}
+
+int rtc_buffer_append_base64_decoded(struct rtc_buffer *buf, const char *text,
+                                     size_t size) {
+    if (size % 4 != 0 ||
+        rtc_buffer_reserve(buf, buf->size + size / 4 * 3) != 0)
+        return -1;
+
+    char *out = buf->data + buf->size;
+    for (size_t i = 0; i < size; i += 4) {
+        // padding may only end the text
+        int pad = 0;
+        if (i + 4 == size && text[i + 3] == '=')
+            pad = text[i + 2] == '=' ? 2 : 1;
+        uint32_t v = 0;
+        for (int j = 0; j < 4 - pad; j++) {
+            int value = base64Value(text[i + j]);
+            if (value < 0)
+                return -1;
+            v = v << 6 | value;
+        }
+        v <<= 6 * pad;
+
+        *out++ = v >> 16;
+        if (pad < 2)
+            *out++ = v >> 8;
+        if (pad < 1)
+            *out++ = v;
+    }
+    buf->size = out - buf->data;
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef RTC_BUFFER_H
+#define RTC_BUFFER_H
+
+#include <stddef.h>
+
+// growable byte buffer that keeps its storage between uses, so steady state
+// serialization into it does not allocate
+struct rtc_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+int rtc_buffer_init(struct rtc_buffer *buf, size_t capacity);
+void rtc_buffer_free(struct rtc_buffer *buf);
+int rtc_buffer_reserve(struct rtc_buffer *buf, size_t capacity);
+
+static inline void rtc_buffer_reset(struct rtc_buffer *buf) { buf->size = 0; }
+
+int rtc_buffer_append(struct rtc_buffer *buf, const char *data, size_t size);
+// appends data as a quoted and escaped JSON string
+int rtc_buffer_append_json_string(struct rtc_buffer *buf, const char *data,
+                                  size_t size);
+// appends data as padded base64 text
+int rtc_buffer_append_base64(struct rtc_buffer *buf, const char *data,
+                             size_t size);
+// appends what padded base64 text decodes to
+int rtc_buffer_append_base64_decoded(struct rtc_buffer *buf, const char *text,
+                                     size_t size);
+
+#endif // RTC_BUFFER_H
@@ -0,0 +1,121 @@
+#include "rtc_envelope.h"
+
+void rtc_envelope_write_header(char *out, const struct rtc_envelope *env) {
+    unsigned char *p = (unsigned char *)out;
+    p[0] = RTC_ENVELOPE_MAGIC;
+    p[1] = env->flags;
+    p[2] = env->type >> 8;
+    p[3] = env->type & 0xff;
+    p[4] = env->sender >> 8;
+    p[5] = env->sender & 0xff;
+    p[6] = env->length >> 24;
+    p[7] = (env->length >> 16) & 0xff;
+    p[8] = (env->length >> 8) & 0xff;
+    p[9] = env->length & 0xff;
+}
+
+int rtc_envelope_read(const char *data, int size, struct rtc_envelope *env) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (size < RTC_ENVELOPE_HEADER_SIZE || p[0] != RTC_ENVELOPE_MAGIC)
+        return -1;
+
+    env->flags = p[1];
+    env->type = (uint16_t)(p[2] << 8 | p[3]);
+    env->sender = (uint16_t)(p[4] << 8 | p[5]);
+    env->length = (uint32_t)p[6] << 24 | (uint32_t)p[7] << 16 |
+                  (uint32_t)p[8] << 8 | (uint32_t)p[9];
+    if (env->length > (uint32_t)(size - RTC_ENVELOPE_HEADER_SIZE))
+        return -1;
+    env->payload = data + RTC_ENVELOPE_HEADER_SIZE;
+
+    return 0;
+}
+
+void rtc_envelope_write_record_header(char *out, uint32_t length) {
+    unsigned char *p = (unsigned char *)out;
+    p[0] = length >> 24;
+    p[1] = (length >> 16) & 0xff;
+    p[2] = (length >> 8) & 0xff;
+    p[3] = length & 0xff;
+}
+
+int rtc_envelope_read_record(const struct rtc_envelope *batch, int offset,
+                             const char **data, int *size) {
+    if (offset < 0 || (uint32_t)offset > batch->length)
+        return -1;
+    uint32_t remaining = batch->length - offset;
+    if (remaining < RTC_ENVELOPE_RECORD_HEADER_SIZE)
+        return -1;
+
+    const unsigned char *p = (const unsigned char *)batch->payload + offset;
+    uint32_t length = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+                      (uint32_t)p[2] << 8 | (uint32_t)p[3];
+    remaining -= RTC_ENVELOPE_RECORD_HEADER_SIZE;
+    if (length == 0 || length > remaining)
+        return -1;
+
+    *data = (const char *)p + RTC_ENVELOPE_RECORD_HEADER_SIZE;
+    *size = (int)length;
+    return offset + RTC_ENVELOPE_RECORD_HEADER_SIZE + (int)length;
+}
+
+void rtc_envelope_write_stream_header(char *out,
+                                      const struct rtc_stream_header *header) {
+    unsigned char *p = (unsigned char *)out;
+    p[0] = header->kind;
+    for (int i = 0; i < 4; i++)
+        p[1 + i] = (header->stream >> (24 - 8 * i)) & 0xff;
+    for (int i = 0; i < 8; i++)
+        p[5 + i] = (header->offset >> (56 - 8 * i)) & 0xff;
+}
+
+int rtc_envelope_read_stream_header(const struct rtc_envelope *env,
+                                    struct rtc_stream_header *header,
+                                    const char **data, int *size) {
+    if (!(env->flags & RTC_ENVELOPE_STREAM) ||
+        env->length < RTC_ENVELOPE_STREAM_HEADER_SIZE)
+        return -1;
+
+    const unsigned char *p = (const unsigned char *)env->payload;
+    header->kind = p[0];
+    header->stream = 0;
+    for (int i = 0; i < 4; i++)
+        header->stream = header->stream << 8 | p[1 + i];
+    header->offset = 0;
+    for (int i = 0; i < 8; i++)
+        header->offset = header->offset << 8 | p[5 + i];
+
+    *data = env->payload + RTC_ENVELOPE_STREAM_HEADER_SIZE;
+    *size = (int)(env->length - RTC_ENVELOPE_STREAM_HEADER_SIZE);
+    return 0;
+}
+
+void rtc_envelope_write_probe(char *out, const struct rtc_probe *probe) {
+    unsigned char *p = (unsigned char *)out;
+    const uint64_t times[3] = {probe->origin, probe->received,
+                               probe->transmitted};
+    p[0] = probe->kind;
+    for (int t = 0; t < 3; t++) {
+        for (int i = 0; i < 8; i++)
+            p[1 + 8 * t + i] = (times[t] >> (56 - 8 * i)) & 0xff;
+    }
+}
+
+int rtc_envelope_read_probe(const struct rtc_envelope *env,
+                            struct rtc_probe *probe) {
+    if (!(env->flags & RTC_ENVELOPE_PROBE) ||
+        env->length != RTC_ENVELOPE_PROBE_SIZE)
+        return -1;
+
+    const unsigned char *p = (const unsigned char *)env->payload;
+    uint64_t times[3] = {0, 0, 0};
+    for (int t = 0; t < 3; t++) {
+        for (int i = 0; i < 8; i++)
+            times[t] = times[t] << 8 | p[1 + 8 * t + i];
+    }
+    probe->kind = p[0];
+    probe->origin = times[0];
+    probe->received = times[1];
+    probe->transmitted = times[2];
+    return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef RTC_ENVELOPE_H
+#define RTC_ENVELOPE_H
+
+#include <stdint.h>
+
+// compact binary framing for data channel messages
+//
+// | magic (1) | flags (1) | type (2) | sender (2) | length (4) | payload |
+//
+// all integers are big endian, the magic byte can never start a JSON
+// document so receivers can tell both framings apart from the first byte
+#define RTC_ENVELOPE_MAGIC 0xB1
+#define RTC_ENVELOPE_HEADER_SIZE 10
+
+// type id of messages sent with rtc_client_send_message
+#define RTC_ENVELOPE_UNTYPED 0
+// sender index of messages originating at the channel's remote peer, a hub
+// marks messages it forwards with the index of the member they come from
+#define RTC_ENVELOPE_DIRECT 0
+
+// the payload is a batch of whole messages, each framed as it would have
+// been on its own and prefixed with its length as a 4 byte big endian integer
+#define RTC_ENVELOPE_BATCH (1 << 0)
+#define RTC_ENVELOPE_RECORD_HEADER_SIZE 4
+// the payload is a whole datagram packed with rtc_lz_pack, batches included,
+// compressed envelopes are never nested
+#define RTC_ENVELOPE_COMPRESSED (1 << 1)
+// the payload belongs to a stream and starts with a stream header
+//
+// | kind (1) | stream (4) | offset (8) | data |
+#define RTC_ENVELOPE_STREAM (1 << 2)
+#define RTC_ENVELOPE_STREAM_HEADER_SIZE 13
+
+enum rtc_stream_kind {
+    // sender to receiver, offset is the total size and data the name
+    RTC_STREAM_OPEN = 0,
+    // sender to receiver, data belongs at offset
+    RTC_STREAM_DATA = 1,
+    // sender to receiver, no more data follows
+    RTC_STREAM_ABORT = 2,
+    // receiver to sender, the receiver holds everything before offset
+    RTC_STREAM_ACCEPT = 3,
+    RTC_STREAM_ACK = 4,
+    // receiver to sender, the stream is refused or given up
+    RTC_STREAM_REFUSE = 5,
+};
+
+struct rtc_stream_header {
+    uint8_t kind;
+    uint32_t stream;
+    uint64_t offset;
+};
+
+// the payload is a clock probe, timestamps in microseconds of the clock of
+// the side that took them
+//
+// | kind (1) | origin (8) | received (8) | transmitted (8) |
+#define RTC_ENVELOPE_PROBE (1 << 3)
+#define RTC_ENVELOPE_PROBE_SIZE 25
+
+enum rtc_probe_kind {
+    // origin is when the ping left
+    RTC_PROBE_PING = 0,
+    // echoes the ping's origin, received and transmitted are the peer's
+    RTC_PROBE_PONG = 1,
+};
+
+struct rtc_probe {
+    uint8_t kind;
+    uint64_t origin;
+    uint64_t received;
+    uint64_t transmitted;
+};
+
+// the payload tells a member of a room about another member it reaches
+// through the hub sending it, sender is the index the hub marks that
+// member's messages with
+//
+// | kind (1) | uuid, only when joined |
+#define RTC_ENVELOPE_MEMBER (1 << 4)
+// the payload is JSON text, so a hub can embed it as is for members using
+// the JSON envelope without parsing it first
+#define RTC_ENVELOPE_JSON (1 << 5)
+
+enum rtc_member_kind {
+    RTC_MEMBER_JOINED = 0,
+    RTC_MEMBER_LEFT = 1,
+};
+
+struct rtc_envelope {
+    uint8_t flags;
+    uint16_t type;
+    uint16_t sender;
+    uint32_t length;
+    const char *payload;
+};
+
+void rtc_envelope_write_header(char *out, const struct rtc_envelope *env);
+// returns 0 and fills env when data holds a well formed binary envelope
+int rtc_envelope_read(const char *data, int size, struct rtc_envelope *env);
+
+void rtc_envelope_write_record_header(char *out, uint32_t length);
+// reads the batch record starting at offset into the payload, returns the
+// offset of the next one, or -1 once the batch is exhausted or malformed
+int rtc_envelope_read_record(const struct rtc_envelope *batch, int offset,
+                             const char **data, int *size);
+
+void rtc_envelope_write_stream_header(char *out,
+                                      const struct rtc_stream_header *header);
+// returns 0 and points data at what follows the header when env holds one
+int rtc_envelope_read_stream_header(const struct rtc_envelope *env,
+                                    struct rtc_stream_header *header,
+                                    const char **data, int *size);
+
+void rtc_envelope_write_probe(char *out, const struct rtc_probe *probe);
+int rtc_envelope_read_probe(const struct rtc_envelope *env,
+                            struct rtc_probe *probe);
+
+#endif // RTC_ENVELOPE_H
@@ -1,6 +1,80 @@
 #include "rtc_handler.h"
-
-#define MAX_PEERS 3
+#include "rtc_buffer.h"
+#include "rtc_envelope.h"
+#include "rtc_inbox.h"
+#include "rtc_interest.h"
+#include "rtc_lz.h"
+#include "rtc_peer_map.h"
+#include "rtc_peer_table.h"
+#include "rtc_send_queue.h"
+#include "rtc_state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_TYPES 64
+#define MAX_STATES 64
+#define DEFAULT_KEYFRAME_INTERVAL 500
+#define DEFAULT_CANDIDATE_INTERVAL 20
+#define DEFAULT_PROBE_INTERVAL 1000
+#define DEFAULT_INTEREST_CELL 64.0
+// answered probes kept per peer, the offset comes from the one with the
+// shortest round trip, which had the least room for asymmetric delay
+#define CLOCK_SAMPLES 8
+// refuses compressed messages claiming to expand beyond this
+#define MAX_INFLATED_SIZE (1 << 24)
+#define SEND_BUFFER_SIZE 4096
+#define DEFAULT_HIGH_WATER (1 << 20)
+// power of two, at least twice the number of signal handlers
+#define SIGNAL_BUCKETS 16
+
+// capabilities exchanged in the "caps" field of HANDLE_CONNECTION and offer,
+// peers that don't send one get the plain JSON protocol
+#define CAP_BINARY_FRAMING (1 << 0)
+#define CAP_BATCHING (1 << 1)
+#define CAP_REALTIME_LANE (1 << 2)
+#define CAP_BULK_LANE (1 << 3)
+// messages carry no sender, it is known from the channel they arrive on
+#define CAP_IMPLICIT_SENDER (1 << 4)
+// replicated state is sent as deltas and acknowledged
+#define CAP_STATE_SYNC (1 << 5)
+// datagrams and signaling data may arrive compressed
+#define CAP_COMPRESSION (1 << 6)
+#define CAP_STREAMS (1 << 7)
+// local candidates may arrive several at a time in a "candidates" array
+#define CAP_CANDIDATE_BATCH (1 << 8)
+// clock probes are answered
+#define CAP_CLOCK_PROBES (1 << 9)
+// messages of other members may be forwarded through the peer, marked with
+// who sent them
+#define CAP_RELAY (1 << 10)
+// the sender is the room's hub, only ever set in signaling messages
+#define CAP_HUB (1 << 11)
+
+// every state message starts with this, json-c keeps insertion order
+#define STATE_PREFIX "{\"state\":"
+
+// stream messages stay well below libdatachannel's message size limit
+#define STREAM_CHUNK_SIZE                                                      \
+    (64 * 1024 - RTC_ENVELOPE_HEADER_SIZE - RTC_ENVELOPE_STREAM_HEADER_SIZE)
+#define DEFAULT_STREAM_WINDOW (4 << 20)
+// how long rtc_stream_open waits for an answer, in milliseconds
+#define DEFAULT_STREAM_OPEN_TIMEOUT 10000
+// receivers acknowledge at least this often
+#define STREAM_ACK_INTERVAL (256 * 1024)
+// longest a blocked stream waits before looking again, in milliseconds
+#define STREAM_POLL_INTERVAL 10
+#define STREAM_NAME_SIZE 256
+
+#define LANE_COUNT 3
+// bytes a lane may send per round and unit of weight
+#define LANE_QUANTUM 1024
 
 #ifdef DEBUG
 #define DEBUG_PRINT(...) printf(__VA_ARGS__)
@@ -10,33 +84,544 @@
     } while (0)
 #endif
 
-static rtcConfiguration config;
-static int ws_id;
-static int dataChannel[MAX_PEERS];
-static int dataChannelCount = 0;
-static int messageListener = 0;
-
-static char username[UUID_STR_LEN];
-static char room[256];
-
-static pthread_mutex_t *lock;
-static pthread_cond_t *cond;
-static int *ws_joined;
-static int *ws_ret_code;
-
-static void (*message_opened_callback)(int id, void *ptr) = NULL;
-static void (*message_received_callback)(int id, const char *message, int size,
-                                         void *ptr) = NULL;
-static void (*message_closed_callback)(int id, void *ptr) = NULL;
-
-static bool shouldRespond(json_object *root);
-static void sendNegotiation(const char *type, json_object *data);
-static void sendOneToOneNegotiation(const char *type, const char *endpoint,
-                                    const char *sdp);
-
-static void connectPeers(json_object *root);
-static void rejectPeers(json_object *root);
-static void processOffer(const char *requestee, const char *remoteOffer);
+// negotiation progress of a single peer, every peer moves through these on
+// its own so any number of handshakes can be in flight at once
+//
+// offerer:  OFFERING -> CONNECTING -> OPEN -> CLOSED
+// answerer: ANSWERING -> OPEN -> CLOSED
+enum rtc_peer_state {
+    PEER_OFFERING,
+    PEER_ANSWERING,
+    PEER_CONNECTING,
+    PEER_OPEN,
+    PEER_CLOSED,
+};
+
+// what a peer has of one of the client's replicated objects
+struct rtc_state_link {
+    // latest version the peer acknowledged, the base of the next delta
+    uint32_t acked;
+    // when the peer was last sent this object
+    uint64_t sentAt;
+    // version last sent, and when it was first sent if that was only once,
+    // otherwise its acknowledgement can't be matched to a send
+    uint32_t sentSeq;
+    uint64_t timedAt;
+};
+
+// an object replicated by a peer
+struct rtc_state_replica {
+    char key[64];
+    uint32_t latest;
+    struct rtc_state_history history;
+};
+
+struct rtc_clock_sample {
+    int64_t offset;
+    uint64_t rtt;
+};
+
+// a stream a peer sends us
+struct rtc_incoming_stream {
+    uint32_t id;
+    char name[STREAM_NAME_SIZE];
+    uint64_t size;
+    uint64_t received;
+    // the last offset acknowledged to the sender
+    uint64_t acked;
+    rtc_stream_target target;
+};
+
+// a member of the room reached through the hub
+struct rtc_relayed_member {
+    // the index the hub marks the member's messages with
+    uint16_t sender;
+    rtc_peer_context *context;
+};
+
+// an opened or closed event waiting outside of the inbox
+struct rtc_lifecycle_event {
+    struct rtc_lifecycle_event *next;
+    rtc_event_kind kind;
+    int id;
+    char peer[UUID_STR_LEN];
+    rtc_peer_context *context;
+};
+
+// one remote peer connection, used as the libdatachannel user pointer of the
+// peer connection and (inherited) of its data channels
+struct rtc_peer {
+    rtc_client *client;
+    char id[UUID_STR_LEN];
+    int pc;
+    // the control lane, identifies the peer towards the application
+    int dc;
+    // channel of every lane, 0 where the peer has none, guarded by peers_lock
+    int lanes[LANE_COUNT];
+    // bit per lane that can be sent on, guarded by peers_lock
+    unsigned int openLanes;
+    // handed to the application, outlives the peer in inbox mode until the
+    // closed event was polled
+    rtc_peer_context *context;
+    // capabilities both sides support
+    int caps;
+    // the peer is the room's hub
+    bool hub;
+    // members the hub announced, guarded by peers_lock
+    struct rtc_relayed_member *members;
+    int memberCount;
+    // messages of members being delivered, their members are not reported
+    // closed until this drops to 0, guarded by peers_lock
+    int delivering;
+    // only gets updates within radius of its position once placed, guarded
+    // by peers_lock
+    bool placed;
+    double x;
+    double y;
+    double radius;
+    // guarded by the client's peers_lock
+    enum rtc_peer_state state;
+    // messages the connection could not take yet per lane, the realtime
+    // lane never queues, guarded by peers_lock
+    struct rtc_send_queue queues[LANE_COUNT];
+    // bytes each lane may still send in the current round
+    size_t deficits[LANE_COUNT];
+    rtc_drop_policy dropPolicy;
+    // messages waiting for the next flush, guarded by peers_lock
+    struct rtc_buffer batch;
+    int batchCount;
+    // only used from the channel's message callback
+    struct rtc_buffer recvBuffer;
+    // decompressed datagrams, lanes deliver concurrently so each has its own
+    struct rtc_buffer inflateBuffers[LANE_COUNT];
+    // indexed like the client's states, guarded by peers_lock
+    struct rtc_state_link stateLinks[MAX_STATES];
+    // objects the peer replicates to us, guarded by peers_lock
+    struct rtc_state_replica *replicas;
+    int replicaCount;
+    // streams the peer sends us, guarded by peers_lock
+    struct rtc_incoming_stream *incoming;
+    int incomingCount;
+    // local candidates not signaled yet and when the first of them was
+    // gathered, guarded by peers_lock
+    json_object *candidates;
+    uint64_t candidatesAt;
+    // when the handshake started and a bit per stage reached since,
+    // guarded by peers_lock
+    uint64_t startedAt;
+    unsigned int stages;
+    // counted without the lock, receiving never takes it otherwise
+    _Atomic uint64_t messagesSent;
+    _Atomic uint64_t bytesSent;
+    _Atomic uint64_t messagesReceived;
+    _Atomic uint64_t bytesReceived;
+    _Atomic uint64_t dropped;
+    // in microseconds, 0 until measured, guarded by peers_lock
+    uint64_t srtt;
+    uint64_t rttvar;
+    // latest answered probes, guarded by peers_lock
+    struct rtc_clock_sample clockSamples[CLOCK_SAMPLES];
+    uint64_t clockSampleCount;
+    uint64_t probedAt;
+};
+
+struct rtc_type {
+    uint16_t id;
+    rtc_lane lane;
+    // whether a hub forwards the type to the other members
+    bool relay;
+    char name[64];
+};
+
+// an object this client replicates to its peers
+struct rtc_state_object {
+    char key[64];
+    // version of the latest state, 0 before the first
+    uint32_t seq;
+    struct rtc_state_history history;
+};
+
+enum rtc_stream_state {
+    STREAM_OPENING,
+    STREAM_OPEN,
+    STREAM_FAILED,
+};
+
+// guarded by the client's peers_lock
+struct rtc_stream {
+    rtc_client *client;
+    // control channel of the receiving peer
+    int dc;
+    rtc_lane lane;
+    uint32_t id;
+    uint64_t size;
+    uint64_t sent;
+    // everything before this is with the peer
+    uint64_t acked;
+    enum rtc_stream_state state;
+};
+
+// fields of a signaling message, parsed once and valid until the handler
+// returns, any of them may be NULL
+struct rtc_signal {
+    const char *type;
+    const char *from;
+    const char *endpoint;
+    const char *room;
+    const char *data;
+    int caps;
+    json_object *root;
+};
+
+typedef void (*rtc_signal_handler)(rtc_client *client,
+                                   const struct rtc_signal *signal);
+
+struct rtc_signal_entry {
+    const char *type;
+    rtc_signal_handler handler;
+};
+
+struct rtc_client {
+    rtcConfiguration config;
+    int ws_id;
+    // only used from the WebSocket's message callback
+    json_tokener *tokener;
+    struct rtc_buffer signalBuffer;
+    // peers with an open data channel, guarded by peers_lock
+    struct rtc_peer_table dataChannels;
+    // 0 or less for no limit
+    int maxPeers;
+
+    // every peer from its first signaling message until it is closed,
+    // guarded by peers_lock
+    struct rtc_peer_map peers;
+    pthread_mutex_t peers_lock;
+
+    // reused by every send, guarded by peers_lock
+    struct rtc_buffer binaryBuffer;
+    struct rtc_buffer jsonBuffer;
+    // JSON envelope with a sender, for peers that need one
+    struct rtc_buffer senderJsonBuffer;
+    // compressed datagram on its way out, guarded by peers_lock
+    struct rtc_buffer compressBuffer;
+    // 0 when compression is off, guarded by peers_lock
+    size_t compressThreshold;
+
+    // context indices of closed peers, guarded by peers_lock
+    int *freeIndices;
+    int freeCount;
+    int indexCount;
+
+    char username[UUID_STR_LEN];
+    char room[256];
+
+    // bytes a channel may buffer before sends are queued, and the most a
+    // queue holds
+    size_t highWater;
+    rtc_drop_policy dropPolicy;
+    // guarded by peers_lock
+    unsigned int laneWeights[LANE_COUNT];
+    struct rtc_lane_stats laneStats[LANE_COUNT];
+    struct rtc_histogram connectStats[RTC_STAGE_COUNT];
+    // when HANDLE_CONNECTION was last sent, 0 before, guarded by peers_lock
+    uint64_t joinedAt;
+    // 0 or less when batching is off, guarded by peers_lock
+    int batchInterval;
+    size_t batchSize;
+
+    // guarded by peers_lock
+    struct rtc_state_object states[MAX_STATES];
+    int stateCount;
+    // 0 or less when keyframes are off
+    int keyframeInterval;
+    // 0 or less signals every candidate on its own, guarded by peers_lock
+    int candidateInterval;
+    // peers with candidates waiting, guarded by peers_lock
+    int pendingCandidates;
+    // 0 or less when peers are not probed, guarded by peers_lock
+    int probeInterval;
+
+    // streams being sent, guarded by peers_lock
+    struct rtc_stream **streams;
+    int streamCount;
+    uint32_t nextStreamId;
+    size_t streamWindow;
+    int streamOpenTimeout;
+    // broadcast whenever a stream may make progress, waited on with
+    // peers_lock
+    pthread_cond_t streamCond;
+    // stream message on its way out, guarded by peers_lock
+    struct rtc_buffer streamBuffer;
+
+    rtc_topology topology;
+    // broadcast whenever a hub peer's delivering count drops to 0, waited on
+    // with peers_lock
+    pthread_cond_t memberCond;
+
+    // positions of placed peers, rebuilt on the first send after one of
+    // them moved, guarded by peers_lock
+    struct rtc_interest_grid interest;
+    bool interestDirty;
+    int placedCount;
+    // peers an update goes to, guarded by peers_lock
+    struct rtc_peer **interestTargets;
+    int interestCapacity;
+    int interestCount;
+
+    // runs periodic work such as flushing batches, started on demand
+    pthread_t serviceThread;
+    bool serviceRunning;
+    // set once the client is being destroyed, callbacks still running then
+    // must not start the thread again
+    bool serviceStopped;
+    // milliseconds between ticks, 0 or less to wait until woken
+    int serviceInterval;
+    pthread_mutex_t serviceLock;
+    pthread_cond_t serviceCond;
+
+    rtc_framing framing;
+    struct rtc_type types[MAX_TYPES];
+    int typeCount;
+
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+    int *ws_joined;
+    int *ws_ret_code;
+
+    void (*message_opened_callback)(int id, void *ptr);
+    void (*message_received_callback)(int id, const char *message, int size,
+                                      void *ptr);
+    void (*message_closed_callback)(int id, void *ptr);
+    void (*payload_received_callback)(int id, const char *type,
+                                      const char *payload, int size,
+                                      void *ptr);
+    int (*stream_opened_callback)(int id, const char *name, uint64_t size,
+                                  rtc_stream_target *target, void *ptr);
+    void (*stream_closed_callback)(int id, const char *name,
+                                   rtc_stream_target *target,
+                                   uint64_t received, bool complete,
+                                   void *ptr);
+
+    // replaces the callbacks when set
+    bool useInbox;
+    struct rtc_inbox inbox;
+    // opened and closed events that found the inbox full, they are never
+    // dropped, message events are while any wait here so none overtakes
+    // the opened event of its peer, guarded by lifecycleLock
+    struct rtc_lifecycle_event *lifecycleHead;
+    struct rtc_lifecycle_event *lifecycleTail;
+    atomic_int lifecycleCount;
+    pthread_mutex_t lifecycleLock;
+    // handed out by the last poll, consumer only
+    struct rtc_lifecycle_event *lifecyclePolled;
+};
+
+static rtc_client *default_client = NULL;
+
+static const char *laneLabels[LANE_COUNT] = {
+    [RTC_LANE_CONTROL] = "sendChannel",
+    [RTC_LANE_REALTIME] = "realtime",
+    [RTC_LANE_BULK] = "bulk",
+};
+
+static struct rtc_signal_entry signalHandlers[SIGNAL_BUCKETS];
+static pthread_once_t signalHandlersOnce = PTHREAD_ONCE_INIT;
+
+static void registerSignalHandler(const char *type, rtc_signal_handler handler);
+static void registerSignalHandlers(void);
+static rtc_signal_handler lookupSignalHandler(const char *type);
+static int parseSignal(rtc_client *client, const char *message, int size,
+                       struct rtc_signal *signal);
+
+static void onHandleConnectionSignal(rtc_client *client,
+                                     const struct rtc_signal *signal);
+static void onOfferSignal(rtc_client *client, const struct rtc_signal *signal);
+static void onAnswerSignal(rtc_client *client,
+                           const struct rtc_signal *signal);
+static void onCandidateSignal(rtc_client *client,
+                              const struct rtc_signal *signal);
+static void onCandidatesSignal(rtc_client *client,
+                               const struct rtc_signal *signal);
+static void onRejectConnectionSignal(rtc_client *client,
+                                     const struct rtc_signal *signal);
+
+static bool shouldRespond(rtc_client *client, const struct rtc_signal *signal);
+static json_object *newSignal(rtc_client *client, const char *protocol,
+                              const char *endpoint, const char *type);
+static void sendSignal(rtc_client *client, json_object *root);
+static void sendNegotiation(rtc_client *client, const char *type,
+                            json_object *data);
+static void queueCandidate(struct rtc_peer *peer, const char *cand);
+static void sendCandidates(rtc_client *client, struct rtc_peer *peer);
+static void flushCandidates(rtc_client *client);
+static void sendOneToOneNegotiation(rtc_client *client, const char *type,
+                                    const char *endpoint, const char *sdp,
+                                    int caps);
+static int inflateSignal(rtc_client *client, struct rtc_signal *signal);
+
+static bool hasPeerCapacity(rtc_client *client);
+static int localCaps(rtc_client *client);
+
+static struct rtc_type *lookupType(rtc_client *client, const char *type);
+static uint16_t lookupTypeId(rtc_client *client, const char *type);
+static const char *lookupTypeName(rtc_client *client, uint16_t type_id);
+static json_object *parseJson(const char *data, int size);
+static int writeBinaryEnvelope(rtc_client *client, uint16_t type_id,
+                               uint16_t sender, const char *data, int size,
+                               bool data_is_json);
+static int writeJsonEnvelope(rtc_client *client, struct rtc_buffer *buf,
+                             const char *type, const char *data, int size,
+                             bool data_is_json, const char *sender);
+static void broadcastEnvelope(rtc_client *client, const char *type,
+                              const char *data, int size, bool data_is_json);
+static void sendEnvelope(rtc_client *client, const char *type,
+                         const char *data, int size, bool data_is_json,
+                         int skip_caps, struct rtc_peer *origin);
+static void sendEnvelopeTo(rtc_client *client, struct rtc_peer **targets,
+                           int count, const char *type, const char *data,
+                           int size, bool data_is_json, int skip_caps,
+                           struct rtc_peer *origin);
+static int selectInterested(rtc_client *client, double x, double y);
+static void sendToPeer(rtc_client *client, struct rtc_peer *peer,
+                       rtc_lane lane, const char *data, int size);
+static void queueMessage(rtc_client *client, struct rtc_peer *peer,
+                         rtc_lane lane, const char *data, int size);
+static size_t lowWater(rtc_client *client);
+static bool hasRoom(rtc_client *client, struct rtc_peer *peer);
+static bool sendNow(rtc_client *client, struct rtc_peer *peer, rtc_lane lane,
+                    const char *data, int size, uint64_t queued_at);
+static void pumpPeer(rtc_client *client, struct rtc_peer *peer);
+static uint64_t nowMicros(void);
+static void sendFramed(rtc_client *client, struct rtc_peer *peer,
+                       const char *data, int size);
+static void sendOnLane(rtc_client *client, struct rtc_peer *peer,
+                       rtc_lane lane, const char *data, int size);
+static void compressMessage(rtc_client *client, struct rtc_peer *peer,
+                            const char **data, int *size);
+static void sendRealtime(rtc_client *client, struct rtc_peer *peer,
+                         const char *data, int size);
+static void flushBatch(rtc_client *client, struct rtc_peer *peer);
+static void flushBatches(rtc_client *client);
+static void receiveMessage(rtc_client *client, struct rtc_peer *peer, int id,
+                           rtc_lane lane, const char *message, int size);
+static void deliverMessage(rtc_client *client, struct rtc_peer *peer, int id,
+                           const char *message, int size, bool allow_batch);
+static void deliverBatch(rtc_client *client, struct rtc_peer *peer, int id,
+                         const struct rtc_envelope *batch);
+
+static int lookupState(rtc_client *client, const char *key);
+static void publishState(rtc_client *client, int index);
+static void sendState(rtc_client *client, struct rtc_peer *peer, int index,
+                      bool keyframe);
+static void refreshStates(rtc_client *client);
+static void receiveState(rtc_client *client, struct rtc_peer *peer, int id,
+                         const char *message, int size);
+static json_object *applyState(rtc_client *client, struct rtc_peer *peer,
+                               const char *key, json_object *delta);
+static void ackState(rtc_client *client, struct rtc_peer *peer,
+                     const char *key, uint32_t seq);
+static void deliverState(rtc_client *client, struct rtc_peer *peer, int id,
+                         const char *key, json_object *state);
+
+static rtc_lane streamLane(struct rtc_peer *peer);
+static int writeStreamMessage(rtc_client *client, uint8_t kind,
+                              uint32_t stream, uint64_t offset,
+                              const char *data, int size);
+static void sendStreamControl(rtc_client *client, struct rtc_peer *peer,
+                              rtc_lane lane, uint8_t kind, uint32_t stream,
+                              uint64_t offset, const char *data, int size);
+static void waitStream(rtc_client *client);
+static void removeStream(rtc_client *client, rtc_stream *stream);
+static void receiveStream(rtc_client *client, struct rtc_peer *peer, int id,
+                          const struct rtc_envelope *env);
+static void openIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                         const struct rtc_stream_header *header,
+                         const char *name, int length);
+static void writeIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                          const struct rtc_stream_header *header,
+                          const char *data, int size);
+static void abortIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                          uint32_t stream);
+static int findIncoming(struct rtc_peer *peer, uint32_t stream);
+static void reportIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                           struct rtc_incoming_stream *incoming);
+static void updateOutgoing(rtc_client *client, struct rtc_peer *peer,
+                           const struct rtc_stream_header *header);
+
+static int updateService(rtc_client *client);
+static int startService(rtc_client *client);
+static void stopService(rtc_client *client);
+static void *serviceMain(void *arg);
+static void deliverBinary(rtc_client *client, struct rtc_peer *peer, int id,
+                          const struct rtc_envelope *env);
+static void deliverPayload(rtc_client *client, rtc_peer_context *context,
+                           int id, const char *type, const char *payload,
+                           int size);
+static void deliverRebuilt(rtc_client *client, rtc_peer_context *context,
+                           int id, json_object *root);
+static int pushEvent(rtc_client *client, rtc_event_kind kind, int id,
+                     rtc_peer_context *context, const char *type,
+                     const char *payload, int size);
+static int acquireIndex(rtc_client *client);
+static void releaseContext(rtc_client *client, rtc_peer_context *context);
+static void releaseSlot(struct rtc_inbox_slot *slot, void *arg);
+static int pushLifecycle(rtc_client *client, rtc_event_kind kind, int id,
+                         rtc_peer_context *context);
+static void releaseLifecycle(rtc_client *client,
+                             struct rtc_lifecycle_event *pending);
+static void deliverJson(rtc_client *client, struct rtc_peer *peer, int id,
+                        const char *message, int size);
+static void deliverJsonObject(rtc_client *client, rtc_peer_context *context,
+                              int id, json_object *root);
+static void reportOpened(rtc_client *client, int id,
+                         rtc_peer_context *context);
+static void reportClosed(rtc_client *client, int id,
+                         rtc_peer_context *context);
+
+static bool relays(rtc_client *client, struct rtc_peer *peer);
+static bool relayedBy(rtc_client *client, struct rtc_peer *peer);
+static bool acceptsPeer(rtc_client *client, int caps);
+static uint16_t relayIndex(struct rtc_peer *peer);
+static void announceMember(rtc_client *client, struct rtc_peer *member,
+                           uint8_t kind);
+static void sendMember(rtc_client *client, struct rtc_peer *to,
+                       struct rtc_peer *member, uint8_t kind);
+static bool relaysType(rtc_client *client, const char *type);
+static void relayBinary(rtc_client *client, struct rtc_peer *origin,
+                        const struct rtc_envelope *env);
+static void relayJson(rtc_client *client, struct rtc_peer *origin,
+                      const char *message, int size);
+static void receiveMember(rtc_client *client, struct rtc_peer *hub,
+                          const struct rtc_envelope *env);
+static rtc_peer_context *holdMember(rtc_client *client, struct rtc_peer *hub,
+                                    uint16_t sender, const char *uuid,
+                                    int *id);
+static void releaseMember(rtc_client *client, struct rtc_peer *hub);
+static void deliverFromHub(rtc_client *client, struct rtc_peer *hub, int id,
+                           const char *message, int size);
+
+static struct rtc_peer *createPeer(rtc_client *client, const char *id,
+                                   enum rtc_peer_state state);
+static int findPeerConnection(rtc_client *client, const char *id);
+static bool detachPeer(struct rtc_peer *peer);
+static void destroyPeer(struct rtc_peer *peer, bool was_open);
+static void closePeer(struct rtc_peer *peer);
+static void recordStage(rtc_client *client, struct rtc_peer *peer,
+                        rtc_connect_stage stage);
+static void sampleRtt(struct rtc_peer *peer, uint64_t sample);
+static void probePeers(rtc_client *client);
+static void sendProbe(rtc_client *client, struct rtc_peer *peer,
+                      struct rtc_probe *probe);
+static void receiveProbe(rtc_client *client, struct rtc_peer *peer,
+                         const struct rtc_envelope *env);
+static void updateClock(struct rtc_peer *peer, const struct rtc_probe *probe,
+                        uint64_t arrived);
+static void countDropped(rtc_client *client, struct rtc_peer *peer,
+                         rtc_lane lane);
+static void connectPeers(rtc_client *client, const struct rtc_signal *signal);
+static void rejectPeers(rtc_client *client, const char *peer_id);
+static void processOffer(rtc_client *client, const char *requestee,
+                         const char *remoteOffer, int caps);
 
 static inline void onOpen(int id, void *ptr);
 static inline void onClosed(int id, void *ptr);
@@ -49,6 +634,15 @@ static inline void onDataChannelOpen(int id, void *ptr);
 static inline void onDataChannelMessage(int id, const char *message, int size,
                                         void *ptr);
 static inline void onDataChannelClose(int id, void *ptr);
+static inline void onBufferedAmountLow(int id, void *ptr);
+static inline void onLaneOpen(int id, void *ptr);
+static inline void onLaneMessage(int id, const char *message, int size,
+                                 void *ptr);
+static inline void onLaneClose(int id, void *ptr);
+static void openLanes(struct rtc_peer *peer);
+static void attachLane(struct rtc_peer *peer, int dc, rtc_lane lane);
+static int findLane(struct rtc_peer *peer, int dc);
+static inline void onPeerStateChange(int pc, rtcState state, void *ptr);
 static inline void candidateConnectPeersCallback(int pc, const char *cand,
                                                  const char *mid, void *ptr);
 static inline void sendAnswerDescriptionCallback(int pc, const char *sdp,
@@ -56,6 +650,9 @@ static inline void sendAnswerDescriptionCallback(int pc, const char *sdp,
 static inline void candidateProcessOfferCallback(int pc, const char *cand,
                                                  const char *mid, void *ptr);
 static inline void processOfferDataChannelCallback(int pc, int dc, void *ptr);
+static inline void onGatheringStateChange(int pc, rtcGatheringState state,
+                                          void *ptr);
+static void freeClient(rtc_client *client);
 
 void generate_uuid(char out[UUID_STR_LEN]) {
     uuid_t b;
@@ -63,321 +660,3376 @@ void generate_uuid(char out[UUID_STR_LEN]) {
     uuid_unparse_lower(b, out);
 }
 
-void rtc_initialize(const char **stun_servers, int stun_servers_count,
-                    const char *ws_url, const char *user, const char *rm,
-                    pthread_mutex_t *lck, pthread_cond_t *cnd, int *joined,
-                    int *ret_code) {
-    config.iceServers = stun_servers;
-    config.iceServersCount = stun_servers_count;
-
-    strcpy(username, user);
-    strcpy(room, rm);
+uint64_t rtc_now_micros(void) { return nowMicros(); }
+
+rtc_client *rtc_client_initialize(const char **stun_servers,
+                                  int stun_servers_count, const char *ws_url,
+                                  const char *user, const char *rm,
+                                  int max_peers, pthread_mutex_t *lck,
+                                  pthread_cond_t *cnd, int *joined,
+                                  int *ret_code) {
+    pthread_once(&signalHandlersOnce, registerSignalHandlers);
+
+    rtc_client *client = calloc(1, sizeof(rtc_client));
+    if (client == NULL)
+        return NULL;
+
+    client->config.iceServers = stun_servers;
+    client->config.iceServersCount = stun_servers_count;
+
+    strncpy(client->username, user, sizeof(client->username) - 1);
+    strncpy(client->room, rm, sizeof(client->room) - 1);
+    client->maxPeers = max_peers;
+    client->highWater = DEFAULT_HIGH_WATER;
+    client->dropPolicy = RTC_DROP_NEWEST;
+    client->laneWeights[RTC_LANE_CONTROL] = 4;
+    client->laneWeights[RTC_LANE_REALTIME] = 1;
+    client->laneWeights[RTC_LANE_BULK] = 1;
+    client->keyframeInterval = DEFAULT_KEYFRAME_INTERVAL;
+    client->candidateInterval = DEFAULT_CANDIDATE_INTERVAL;
+    client->probeInterval = DEFAULT_PROBE_INTERVAL;
+    client->compressThreshold = 0;
+    client->streamWindow = DEFAULT_STREAM_WINDOW;
+    client->streamOpenTimeout = DEFAULT_STREAM_OPEN_TIMEOUT;
+    rtc_interest_init(&client->interest, DEFAULT_INTEREST_CELL);
+
+    pthread_mutex_init(&client->peers_lock, NULL);
+    pthread_mutex_init(&client->serviceLock, NULL);
+    pthread_mutex_init(&client->lifecycleLock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&client->serviceCond, &attr);
+    pthread_cond_init(&client->streamCond, &attr);
+    pthread_cond_init(&client->memberCond, &attr);
+    pthread_condattr_destroy(&attr);
+    client->tokener = json_tokener_new();
+    if (client->tokener == NULL ||
+        rtc_peer_table_init(&client->dataChannels, max_peers) != 0 ||
+        rtc_peer_map_init(&client->peers, max_peers) != 0 ||
+        rtc_buffer_init(&client->binaryBuffer, SEND_BUFFER_SIZE) != 0 ||
+        rtc_buffer_init(&client->jsonBuffer, SEND_BUFFER_SIZE) != 0 ||
+        rtc_buffer_init(&client->senderJsonBuffer, SEND_BUFFER_SIZE) != 0) {
+        freeClient(client);
+        return NULL;
+    }
 
-    lock = lck;
-    cond = cnd;
-    ws_joined = joined;
-    ws_ret_code = ret_code;
+    client->lock = lck;
+    client->cond = cnd;
+    client->ws_joined = joined;
+    client->ws_ret_code = ret_code;
 
     char url[256];
-    snprintf(url, 256, "%s?user=%s&room=%s", ws_url, username, room);
+    snprintf(url, 256, "%s?user=%s&room=%s", ws_url, client->username,
+             client->room);
 
-    ws_id = rtcCreateWebSocket(url);
+    client->ws_id = rtcCreateWebSocket(url);
 
-    rtcSetOpenCallback(ws_id, onOpen);
-    rtcSetClosedCallback(ws_id, onClosed);
-    rtcSetErrorCallback(ws_id, onError);
-    rtcSetMessageCallback(ws_id, onMessage);
+    rtcSetUserPointer(client->ws_id, client);
+    rtcSetOpenCallback(client->ws_id, onOpen);
+    rtcSetClosedCallback(client->ws_id, onClosed);
+    rtcSetErrorCallback(client->ws_id, onError);
+    rtcSetMessageCallback(client->ws_id, onMessage);
+
+    return client;
 }
 
-void rtc_handle_connection() { sendNegotiation("HANDLE_CONNECTION", NULL); }
+void rtc_client_destroy(rtc_client *client) {
+    if (client == NULL)
+        return;
+
+    // callbacks until the deletes below may still schedule work, but can no
+    // longer start a thread that would outlive the client
+    stopService(client);
 
-void rtc_send_message(const char *message) {
-    if (dataChannelCount > 0) {
-        json_object *root = json_object_new_object();
-        json_object_object_add(root, "sender",
-                               json_object_new_string(username));
-        json_object_object_add(root, "payload",
-                               json_object_new_string(message));
-
-        const char *json_str = json_object_to_json_string(root);
-        for (int i = 0; i < dataChannelCount; i++) {
-            rtcSendMessage(dataChannel[i], json_str, strlen(json_str));
+    // deleting blocks until pending callbacks return, so no callback can
+    // observe the client after this point
+    rtcDeleteWebSocket(client->ws_id);
+
+    for (;;) {
+        struct rtc_peer *peer = NULL;
+        bool was_open = false;
+
+        pthread_mutex_lock(&client->peers_lock);
+        for (int i = 0; i <= client->peers.mask && peer == NULL; i++)
+            peer = client->peers.buckets[i].peer;
+        if (peer != NULL)
+            was_open = detachPeer(peer);
+        pthread_mutex_unlock(&client->peers_lock);
+
+        if (peer == NULL)
+            break;
+        destroyPeer(peer, was_open);
+    }
+
+    freeClient(client);
+}
+
+// frees what initialize set up, members it never got to are still zeroed
+// and freeing them is a no op
+static void freeClient(rtc_client *client) {
+    rtc_peer_table_free(&client->dataChannels);
+    rtc_peer_map_free(&client->peers);
+    rtc_buffer_free(&client->binaryBuffer);
+    rtc_buffer_free(&client->jsonBuffer);
+    rtc_buffer_free(&client->senderJsonBuffer);
+    rtc_buffer_free(&client->compressBuffer);
+    rtc_buffer_free(&client->signalBuffer);
+    rtc_buffer_free(&client->streamBuffer);
+    // streams the application left open fail along with their peers
+    free(client->streams);
+    rtc_interest_free(&client->interest);
+    free(client->interestTargets);
+    for (int i = 0; i < client->stateCount; i++)
+        rtc_state_history_free(&client->states[i].history);
+    if (client->tokener != NULL)
+        json_tokener_free(client->tokener);
+    if (client->useInbox) {
+        // contexts of closed events the application never saw
+        rtc_inbox_recycle(&client->inbox, releaseSlot, client);
+        struct rtc_inbox_slot *slot;
+        while ((slot = rtc_inbox_next(&client->inbox)) != NULL)
+            releaseSlot(slot, client);
+        rtc_inbox_free(&client->inbox);
+        releaseLifecycle(client, client->lifecyclePolled);
+        releaseLifecycle(client, client->lifecycleHead);
+    }
+    free(client->freeIndices);
+    pthread_mutex_destroy(&client->peers_lock);
+    pthread_mutex_destroy(&client->serviceLock);
+    pthread_mutex_destroy(&client->lifecycleLock);
+    pthread_cond_destroy(&client->serviceCond);
+    pthread_cond_destroy(&client->streamCond);
+    pthread_cond_destroy(&client->memberCond);
+    free(client);
+}
+
+void rtc_client_handle_connection(rtc_client *client) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->joinedAt = nowMicros();
+    pthread_mutex_unlock(&client->peers_lock);
+    sendNegotiation(client, "HANDLE_CONNECTION", NULL);
+}
+
+void rtc_client_send_message(rtc_client *client, const char *message) {
+    broadcastEnvelope(client, NULL, message, strlen(message), false);
+}
+
+void rtc_client_send_typed_object(rtc_client *client, const char *type,
+                                  json_object *obj) {
+    // json-c serializes into a buffer owned by obj and reuses it on the next
+    // call, the caller keeps its reference
+    size_t size;
+    const char *data =
+        json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &size);
+    broadcastEnvelope(client, type, data, size, true);
+}
+
+void rtc_client_send_typed_object_at(rtc_client *client, const char *type,
+                                     json_object *obj, double x, double y) {
+    size_t size;
+    const char *data =
+        json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &size);
+
+    pthread_mutex_lock(&client->peers_lock);
+    int count = selectInterested(client, x, y);
+    if (count >= 0)
+        sendEnvelopeTo(client, client->interestTargets, count, type, data,
+                       size, true, 0, NULL);
+    else
+        sendEnvelope(client, type, data, size, true, 0, NULL);
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+int rtc_client_set_peer_interest(rtc_client *client, int id, double x,
+                                 double y, double radius) {
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_table_get(&client->dataChannels, id);
+    if (peer != NULL) {
+        bool placed = radius >= 0;
+        client->placedCount += placed - peer->placed;
+        peer->placed = placed;
+        peer->x = x;
+        peer->y = y;
+        peer->radius = radius;
+        client->interestDirty = true;
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+    return peer != NULL ? 0 : -1;
+}
+
+void rtc_client_set_interest_cell(rtc_client *client, double size) {
+    if (size <= 0)
+        size = DEFAULT_INTEREST_CELL;
+    pthread_mutex_lock(&client->peers_lock);
+    client->interest.cellSize = size;
+    client->interestDirty = true;
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+void rtc_client_send_typed(rtc_client *client, const char *type,
+                           const char *payload, int size) {
+    broadcastEnvelope(client, type, payload, size, false);
+}
+
+void rtc_client_set_framing(rtc_client *client, rtc_framing framing) {
+    client->framing = framing;
+}
+
+void rtc_client_set_topology(rtc_client *client, rtc_topology topology) {
+    client->topology = topology;
+}
+
+void rtc_client_set_compression(rtc_client *client, size_t threshold) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->compressThreshold = threshold;
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+int rtc_client_register_type(rtc_client *client, uint16_t type_id,
+                             const char *type) {
+    if (type_id == RTC_ENVELOPE_UNTYPED || client->typeCount >= MAX_TYPES ||
+        strlen(type) >= sizeof(client->types[0].name))
+        return -1;
+    if (lookupTypeId(client, type) != RTC_ENVELOPE_UNTYPED ||
+        lookupTypeName(client, type_id) != NULL)
+        return -1;
+
+    struct rtc_type *entry = &client->types[client->typeCount++];
+    entry->id = type_id;
+    entry->lane = RTC_LANE_CONTROL;
+    entry->relay = true;
+    strcpy(entry->name, type);
+    return 0;
+}
+
+int rtc_client_set_type_lane(rtc_client *client, const char *type,
+                             rtc_lane lane) {
+    struct rtc_type *entry = lookupType(client, type);
+    if (entry == NULL || lane < 0 || lane >= LANE_COUNT)
+        return -1;
+    entry->lane = lane;
+    return 0;
+}
+
+int rtc_client_set_type_relay(rtc_client *client, const char *type,
+                              bool relay) {
+    struct rtc_type *entry = lookupType(client, type);
+    if (entry == NULL)
+        return -1;
+    entry->relay = relay;
+    return 0;
+}
+
+int rtc_client_set_lane_weight(rtc_client *client, rtc_lane lane,
+                               unsigned int weight) {
+    if (lane < 0 || lane >= LANE_COUNT ||
+        (lane == RTC_LANE_CONTROL && weight == 0))
+        return -1;
+
+    pthread_mutex_lock(&client->peers_lock);
+    client->laneWeights[lane] = weight;
+    pthread_mutex_unlock(&client->peers_lock);
+    return 0;
+}
+
+int rtc_client_get_lane_stats(rtc_client *client, rtc_lane lane,
+                              struct rtc_lane_stats *stats) {
+    if (lane < 0 || lane >= LANE_COUNT)
+        return -1;
+
+    pthread_mutex_lock(&client->peers_lock);
+    *stats = client->laneStats[lane];
+    pthread_mutex_unlock(&client->peers_lock);
+    return 0;
+}
+
+int rtc_client_get_peer_stats(rtc_client *client, int id,
+                              struct rtc_peer_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_table_get(&client->dataChannels, id);
+    int pc = -1;
+    if (peer != NULL) {
+        pc = peer->pc;
+        stats->messages_sent = atomic_load_explicit(&peer->messagesSent,
+                                                    memory_order_relaxed);
+        stats->bytes_sent =
+            atomic_load_explicit(&peer->bytesSent, memory_order_relaxed);
+        stats->messages_received = atomic_load_explicit(
+            &peer->messagesReceived, memory_order_relaxed);
+        stats->bytes_received =
+            atomic_load_explicit(&peer->bytesReceived, memory_order_relaxed);
+        stats->dropped =
+            atomic_load_explicit(&peer->dropped, memory_order_relaxed);
+        for (int lane = 0; lane < LANE_COUNT; lane++) {
+            stats->queue_depth += peer->queues[lane].count;
+            stats->queue_bytes += peer->queues[lane].bytes;
+            int buffered = (peer->openLanes & (1u << lane))
+                               ? rtcGetBufferedAmount(peer->lanes[lane])
+                               : -1;
+            if (buffered > 0)
+                stats->buffered += buffered;
         }
+        stats->srtt = peer->srtt;
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (peer == NULL)
+        return -1;
+    // a connection deleted meanwhile just has no pair
+    if (rtcGetSelectedCandidatePair(pc, stats->local_candidate,
+                                    RTC_CANDIDATE_SIZE, stats->remote_candidate,
+                                    RTC_CANDIDATE_SIZE) < 0) {
+        stats->local_candidate[0] = '\0';
+        stats->remote_candidate[0] = '\0';
     }
+    return 0;
 }
 
-void rtc_send_typed_object(const char *type, json_object *obj) {
-    if (dataChannelCount > 0) {
-        json_object *root = json_object_new_object();
-        json_object_object_add(root, "sender",
-                               json_object_new_string(username));
-        json_object_object_add(root, "type", json_object_new_string(type));
-        json_object_object_add(root, "payload", obj);
-
-        const char *json_str = json_object_to_json_string(root);
-        for (int i = 0; i < dataChannelCount; i++) {
-            rtcSendMessage(dataChannel[i], json_str, strlen(json_str));
+int rtc_client_set_clock_probes(rtc_client *client, int interval_ms) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->probeInterval = interval_ms;
+    pthread_mutex_unlock(&client->peers_lock);
+
+    return updateService(client);
+}
+
+int rtc_client_get_clock(rtc_client *client, int id,
+                         struct rtc_clock_estimate *estimate) {
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_table_get(&client->dataChannels, id);
+    int ret = -1;
+    if (peer != NULL && peer->clockSampleCount > 0) {
+        uint64_t count = peer->clockSampleCount < CLOCK_SAMPLES
+                             ? peer->clockSampleCount
+                             : CLOCK_SAMPLES;
+        const struct rtc_clock_sample *best = &peer->clockSamples[0];
+        for (uint64_t i = 1; i < count; i++) {
+            if (peer->clockSamples[i].rtt < best->rtt)
+                best = &peer->clockSamples[i];
+        }
+        estimate->offset = best->offset;
+        estimate->rtt = peer->srtt;
+        estimate->jitter = peer->rttvar;
+        estimate->samples = peer->clockSampleCount;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+    return ret;
+}
+
+int rtc_client_get_connect_stats(rtc_client *client, rtc_connect_stage stage,
+                                 struct rtc_histogram *stats) {
+    if (stage < 0 || stage >= RTC_STAGE_COUNT)
+        return -1;
+
+    pthread_mutex_lock(&client->peers_lock);
+    *stats = client->connectStats[stage];
+    pthread_mutex_unlock(&client->peers_lock);
+    return 0;
+}
+
+void rtc_client_set_send_queue(rtc_client *client, size_t high_water,
+                               rtc_drop_policy policy) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->highWater = high_water;
+    client->dropPolicy = policy;
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+int rtc_client_set_drop_policy(rtc_client *client, int id,
+                               rtc_drop_policy policy) {
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_table_get(&client->dataChannels, id);
+    if (peer != NULL)
+        peer->dropPolicy = policy;
+    pthread_mutex_unlock(&client->peers_lock);
+    return peer != NULL ? 0 : -1;
+}
+
+int rtc_client_set_batching(rtc_client *client, int interval_ms,
+                            size_t max_bytes) {
+    pthread_mutex_lock(&client->peers_lock);
+    // whatever was batched under the old settings goes out now
+    flushBatches(client);
+    client->batchInterval = interval_ms;
+    client->batchSize = max_bytes;
+    pthread_mutex_unlock(&client->peers_lock);
+
+    return updateService(client);
+}
+
+int rtc_client_set_state(rtc_client *client, const char *key,
+                         json_object *state) {
+    if (key == NULL || strlen(key) >= sizeof(client->states[0].key) ||
+        !json_object_is_type(state, json_type_object))
+        return -1;
+
+    pthread_mutex_lock(&client->peers_lock);
+    int index = lookupState(client, key);
+    bool first = false;
+    if (index < 0) {
+        if (client->stateCount >= MAX_STATES) {
+            pthread_mutex_unlock(&client->peers_lock);
+            return -1;
+        }
+        index = client->stateCount++;
+        strcpy(client->states[index].key, key);
+        first = index == 0;
+    }
+
+    int ret = 0;
+    struct rtc_state_object *object = &client->states[index];
+    json_object *latest = rtc_state_history_get(&object->history, object->seq);
+    // an unchanged state costs nothing
+    if (latest == NULL || !json_object_equal(latest, state)) {
+        json_object *copy = NULL;
+        if (json_object_deep_copy(state, &copy, NULL) == 0) {
+            rtc_state_history_put(&object->history, ++object->seq, copy);
+            publishState(client, index);
+        } else {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    // keyframes are sent by the service thread
+    if (first)
+        updateService(client);
+    return ret;
+}
+
+int rtc_client_set_state_keyframes(rtc_client *client, int interval_ms) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->keyframeInterval = interval_ms;
+    pthread_mutex_unlock(&client->peers_lock);
+
+    return updateService(client);
+}
+
+rtc_stream *rtc_stream_open(rtc_client *client, int id, const char *name,
+                            uint64_t size) {
+    size_t length = strlen(name);
+    if (length >= STREAM_NAME_SIZE)
+        return NULL;
+    rtc_stream *stream = calloc(1, sizeof(rtc_stream));
+    if (stream == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_table_get(&client->dataChannels, id);
+    rtc_stream **streams = NULL;
+    if (peer != NULL && (peer->caps & CAP_STREAMS))
+        streams = realloc(client->streams, (client->streamCount + 1) *
+                                               sizeof(rtc_stream *));
+    if (streams == NULL) {
+        pthread_mutex_unlock(&client->peers_lock);
+        free(stream);
+        return NULL;
+    }
+    client->streams = streams;
+    client->streams[client->streamCount++] = stream;
+
+    stream->client = client;
+    stream->dc = id;
+    // pinned to one lane, so chunks arrive in order
+    stream->lane = streamLane(peer);
+    stream->id = ++client->nextStreamId;
+    stream->size = size;
+    stream->state = STREAM_OPENING;
+    sendStreamControl(client, peer, stream->lane, RTC_STREAM_OPEN, stream->id,
+                      size, name, length);
+
+    // a peer that stays connected but never answers gets the open aborted
+    uint64_t deadline =
+        nowMicros() + (uint64_t)client->streamOpenTimeout * 1000;
+    while (stream->state == STREAM_OPENING && nowMicros() < deadline)
+        waitStream(client);
+    if (stream->state == STREAM_OPENING) {
+        DEBUG_PRINT("Stream %u to %d was not answered\n", stream->id, id);
+        peer = rtc_peer_table_get(&client->dataChannels, id);
+        if (peer != NULL)
+            sendStreamControl(client, peer, stream->lane, RTC_STREAM_ABORT,
+                              stream->id, 0, NULL, 0);
+        stream->state = STREAM_FAILED;
+    }
+    bool accepted = stream->state == STREAM_OPEN;
+    if (!accepted)
+        removeStream(client, stream);
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (!accepted) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+uint64_t rtc_stream_offset(rtc_stream *stream) {
+    rtc_client *client = stream->client;
+    pthread_mutex_lock(&client->peers_lock);
+    uint64_t offset = stream->sent;
+    pthread_mutex_unlock(&client->peers_lock);
+    return offset;
+}
+
+int rtc_stream_write(rtc_stream *stream, const void *data, size_t size) {
+    rtc_client *client = stream->client;
+    const char *bytes = data;
+    int ret = 0;
+
+    pthread_mutex_lock(&client->peers_lock);
+    while (size > 0) {
+        struct rtc_peer *peer =
+            rtc_peer_table_get(&client->dataChannels, stream->dc);
+        if (stream->state != STREAM_OPEN || peer == NULL ||
+            size > stream->size - stream->sent) {
+            ret = -1;
+            break;
+        }
+
+        // chunks go out only once the lane drained, so they are never
+        // queued behind other messages or dropped by the queue's policy
+        uint64_t inflight = stream->sent - stream->acked;
+        if (inflight >= client->streamWindow ||
+            peer->queues[stream->lane].count > 0 || !hasRoom(client, peer)) {
+            waitStream(client);
+            continue;
+        }
+
+        size_t chunk = size < STREAM_CHUNK_SIZE ? size : STREAM_CHUNK_SIZE;
+        if (chunk > client->streamWindow - inflight)
+            chunk = client->streamWindow - inflight;
+        if (writeStreamMessage(client, RTC_STREAM_DATA, stream->id,
+                               stream->sent, bytes, chunk) != 0) {
+            ret = -1;
+            break;
+        }
+        const char *message = client->streamBuffer.data;
+        int length = client->streamBuffer.size;
+        compressMessage(client, peer, &message, &length);
+        if (!sendNow(client, peer, stream->lane, message, length, 0)) {
+            stream->state = STREAM_FAILED;
+            ret = -1;
+            break;
+        }
+
+        stream->sent += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+    return ret;
+}
+
+int rtc_stream_close(rtc_stream *stream) {
+    rtc_client *client = stream->client;
+
+    pthread_mutex_lock(&client->peers_lock);
+    if (stream->state == STREAM_OPEN && stream->sent < stream->size) {
+        struct rtc_peer *peer =
+            rtc_peer_table_get(&client->dataChannels, stream->dc);
+        if (peer != NULL)
+            sendStreamControl(client, peer, stream->lane, RTC_STREAM_ABORT,
+                              stream->id, stream->sent, NULL, 0);
+        stream->state = STREAM_FAILED;
+    }
+    while (stream->state == STREAM_OPEN && stream->acked < stream->size)
+        waitStream(client);
+    int ret = stream->state == STREAM_OPEN ? 0 : -1;
+    removeStream(client, stream);
+    pthread_mutex_unlock(&client->peers_lock);
+
+    free(stream);
+    return ret;
+}
+
+void rtc_client_set_stream_window(rtc_client *client, size_t bytes) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->streamWindow = bytes > 0 ? bytes : 1;
+    pthread_cond_broadcast(&client->streamCond);
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+void rtc_client_set_stream_open_timeout(rtc_client *client, int timeout_ms) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->streamOpenTimeout = timeout_ms > 0 ? timeout_ms : 1;
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+void rtc_client_set_stream_opened_callback(
+    rtc_client *client,
+    int (*on_stream_opened)(int id, const char *name, uint64_t size,
+                            rtc_stream_target *target, void *ptr)) {
+    client->stream_opened_callback = on_stream_opened;
+}
+
+void rtc_client_set_stream_closed_callback(
+    rtc_client *client,
+    void (*on_stream_closed)(int id, const char *name,
+                             rtc_stream_target *target, uint64_t received,
+                             bool complete, void *ptr)) {
+    client->stream_closed_callback = on_stream_closed;
+}
+
+char *rtc_stream_map_file(const char *path, uint64_t size) {
+    if (size == 0 || size > SIZE_MAX)
+        return NULL;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+
+    // a shorter file only grows, so what an earlier attempt wrote is kept
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        ((uint64_t)st.st_size < size && ftruncate(fd, size) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return buffer != MAP_FAILED ? buffer : NULL;
+}
+
+int rtc_stream_unmap_file(char *buffer, uint64_t size) {
+    return munmap(buffer, size);
+}
+
+int rtc_client_set_candidate_batching(rtc_client *client, int interval_ms) {
+    pthread_mutex_lock(&client->peers_lock);
+    client->candidateInterval = interval_ms;
+    pthread_mutex_unlock(&client->peers_lock);
+
+    return updateService(client);
+}
+
+int rtc_client_get_queue_depth(rtc_client *client, int id, size_t *bytes) {
+    int depth = -1;
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_table_get(&client->dataChannels, id);
+    if (peer != NULL) {
+        depth = 0;
+        if (bytes != NULL)
+            *bytes = 0;
+        for (int lane = 0; lane < LANE_COUNT; lane++) {
+            depth += peer->queues[lane].count;
+            if (bytes != NULL)
+                *bytes += peer->queues[lane].bytes;
+        }
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+    return depth;
+}
+
+void rtc_client_set_message_opened_callback(
+    rtc_client *client, void (*on_message_opened)(int id, void *ptr)) {
+    client->message_opened_callback = on_message_opened;
+}
+
+void rtc_client_set_message_received_callback(
+    rtc_client *client,
+    void (*on_message_received)(int id, const char *message, int size,
+                                void *ptr)) {
+    client->message_received_callback = on_message_received;
+}
+
+void rtc_client_set_message_closed_callback(
+    rtc_client *client, void (*on_message_closed)(int id, void *ptr)) {
+    client->message_closed_callback = on_message_closed;
+}
+
+int rtc_client_set_inbox(rtc_client *client, int capacity) {
+    if (client->useInbox || capacity <= 0 ||
+        rtc_inbox_init(&client->inbox, capacity) != 0)
+        return -1;
+    client->useInbox = true;
+    return 0;
+}
+
+int rtc_client_poll(rtc_client *client, rtc_event *events, int max) {
+    if (!client->useInbox)
+        return 0;
+
+    // the previous batch of events is done with now
+    rtc_inbox_recycle(&client->inbox, releaseSlot, client);
+    releaseLifecycle(client, client->lifecyclePolled);
+    client->lifecyclePolled = NULL;
+
+    int count = 0;
+    struct rtc_inbox_slot *slot;
+    while (count < max && (slot = rtc_inbox_next(&client->inbox)) != NULL) {
+        // events that could not be stored are skipped
+        if (slot->kind < 0)
+            continue;
+
+        rtc_event *event = &events[count++];
+        event->kind = slot->kind;
+        event->id = slot->id;
+        event->peer = slot->peer;
+        event->context = slot->context;
+        event->type =
+            slot->typeOffset >= 0 ? slot->data.data + slot->typeOffset : NULL;
+        event->payload = slot->data.data;
+        event->size = slot->size;
+    }
+
+    // everything in the inbox came before the events waiting outside of it
+    if (count < max &&
+        atomic_load_explicit(&client->lifecycleCount, memory_order_acquire) >
+            0) {
+        pthread_mutex_lock(&client->lifecycleLock);
+        struct rtc_lifecycle_event **polled = &client->lifecyclePolled;
+        while (count < max && client->lifecycleHead != NULL) {
+            struct rtc_lifecycle_event *pending = client->lifecycleHead;
+            client->lifecycleHead = pending->next;
+            pending->next = NULL;
+            *polled = pending;
+            polled = &pending->next;
+
+            rtc_event *event = &events[count++];
+            *event = (rtc_event){
+                .kind = pending->kind,
+                .id = pending->id,
+                .peer = pending->peer,
+                .context = pending->context,
+                .payload = "",
+            };
+            atomic_fetch_sub_explicit(&client->lifecycleCount, 1,
+                                      memory_order_release);
         }
+        if (client->lifecycleHead == NULL)
+            client->lifecycleTail = NULL;
+        pthread_mutex_unlock(&client->lifecycleLock);
     }
+    return count;
+}
+
+void rtc_client_set_payload_received_callback(
+    rtc_client *client,
+    void (*on_payload_received)(int id, const char *type, const char *payload,
+                                int size, void *ptr)) {
+    client->payload_received_callback = on_payload_received;
+}
+
+void rtc_initialize(const char **stun_servers, int stun_servers_count,
+                    const char *ws_url, const char *user, const char *rm,
+                    int max_peers, pthread_mutex_t *lck, pthread_cond_t *cnd,
+                    int *joined, int *ret_code) {
+    rtc_client_destroy(default_client);
+    default_client =
+        rtc_client_initialize(stun_servers, stun_servers_count, ws_url, user,
+                              rm, max_peers, lck, cnd, joined, ret_code);
+}
+
+void rtc_handle_connection() { rtc_client_handle_connection(default_client); }
+
+void rtc_send_message(const char *message) {
+    rtc_client_send_message(default_client, message);
+}
+
+void rtc_send_typed_object(const char *type, json_object *obj) {
+    rtc_client_send_typed_object(default_client, type, obj);
+}
+
+void rtc_send_typed_object_at(const char *type, json_object *obj, double x,
+                              double y) {
+    rtc_client_send_typed_object_at(default_client, type, obj, x, y);
+}
+
+int rtc_set_peer_interest(int id, double x, double y, double radius) {
+    return rtc_client_set_peer_interest(default_client, id, x, y, radius);
+}
+
+int rtc_set_inbox(int capacity) {
+    return rtc_client_set_inbox(default_client, capacity);
+}
+
+int rtc_poll(rtc_event *events, int max) {
+    return rtc_client_poll(default_client, events, max);
+}
+
+int rtc_get_peer_stats(int id, struct rtc_peer_stats *stats) {
+    return rtc_client_get_peer_stats(default_client, id, stats);
 }
 
 void rtc_set_message_opened_callback(void (*on_message_opened)(int id,
                                                                void *ptr)) {
-    message_opened_callback = on_message_opened;
+    rtc_client_set_message_opened_callback(default_client, on_message_opened);
 }
 
 void rtc_set_message_received_callback(void (*on_message_received)(
     int id, const char *message, int size, void *ptr)) {
-    message_received_callback = on_message_received;
+    rtc_client_set_message_received_callback(default_client,
+                                             on_message_received);
 }
 
-inline void
-rtc_set_message_closed_callback(void (*on_message_closed)(int id, void *ptr)) {
-    message_closed_callback = on_message_closed;
+void rtc_set_message_closed_callback(void (*on_message_closed)(int id,
+                                                               void *ptr)) {
+    rtc_client_set_message_closed_callback(default_client, on_message_closed);
 }
 
 static inline void onOpen(int id, void *ptr) {
+    rtc_client *client = (rtc_client *)ptr;
     DEBUG_PRINT("\nWebSocket connection opened (id: %d)\n", id);
-    pthread_mutex_lock(lock);
-    *ws_joined = 1;
-    pthread_cond_signal(cond);
-    pthread_mutex_unlock(lock);
+    pthread_mutex_lock(client->lock);
+    *client->ws_joined = 1;
+    pthread_cond_signal(client->cond);
+    pthread_mutex_unlock(client->lock);
 }
 
 static inline void onClosed(int id, void *ptr) {
+    rtc_client *client = (rtc_client *)ptr;
     DEBUG_PRINT("\nWebSocket connection closed (id: %d)\n", id);
-    pthread_mutex_lock(lock);
-    *ws_joined = 1;
-    *ws_ret_code = 0;
-    pthread_cond_signal(cond);
-    pthread_mutex_unlock(lock);
+    pthread_mutex_lock(client->lock);
+    *client->ws_joined = 1;
+    *client->ws_ret_code = 0;
+    pthread_cond_signal(client->cond);
+    pthread_mutex_unlock(client->lock);
 }
 
 static inline void onError(int id, const char *error, void *ptr) {
+    rtc_client *client = (rtc_client *)ptr;
     DEBUG_PRINT("\nWebSocket connection error (id: %d)\n", id);
-    pthread_mutex_lock(lock);
-    *ws_joined = 1;
-    *ws_ret_code = 1;
-    pthread_cond_signal(cond);
-    pthread_mutex_unlock(lock);
+    pthread_mutex_lock(client->lock);
+    *client->ws_joined = 1;
+    *client->ws_ret_code = 1;
+    pthread_cond_signal(client->cond);
+    pthread_mutex_unlock(client->lock);
 }
 
 static inline void onMessage(int id, const char *message, int size, void *ptr) {
+    rtc_client *client = (rtc_client *)ptr;
     DEBUG_PRINT("(id: %d) message: %s\n", id, message);
 
-    json_object *root = json_tokener_parse(message);
+    struct rtc_signal signal;
+    if (parseSignal(client, message, size, &signal) != 0) {
+        DEBUG_PRINT("Dropped malformed signaling message\n");
+        return;
+    }
 
-    json_object *type = json_object_object_get(root, "type");
-    const char *type_str = json_object_get_string(type);
-
-    if (shouldRespond(root)) {
-        json_object *type = json_object_object_get(root, "type");
-        const char *type_str = json_object_get_string(type);
-
-        if (strcmp(type_str, "HANDLE_CONNECTION") == 0) {
-            DEBUG_PRINT("New peer wants to connect\n");
-            if (dataChannelCount < MAX_PEERS) {
-                connectPeers(root);
-            } else {
-                DEBUG_PRINT("Max peers connected\n");
-                rejectPeers(root);
-            }
-        } else if (strcmp(type_str, "offer") == 0) {
-            json_object *from = json_object_object_get(root, "from");
-            json_object *data = json_object_object_get(root, "data");
-            DEBUG_PRINT("GOT OFFER FROM A NODE WE WANT TO CONNECT TO\n");
-            DEBUG_PRINT("THE NODE IS %s\n", json_object_get_string(from));
-            processOffer(json_object_get_string(from),
-                         json_object_get_string(data));
-        } else if (strcmp(type_str, "REJECT_CONNECTION") == 0) {
-            json_object *data = json_object_object_get(root, "data");
-            DEBUG_PRINT("Connection offer rejected: %s\n",
-                        json_object_get_string(data));
-        }
+    if (shouldRespond(client, &signal)) {
+        rtc_signal_handler handler = lookupSignalHandler(signal.type);
+        if (handler != NULL)
+            handler(client, &signal);
     }
 
-    if (messageListener) {
-        if (strcmp(type_str, "answer") == 0) {
-            json_object *data = json_object_object_get(root, "data");
-            DEBUG_PRINT("--- GOT ANSWER IN CONNECT ---\n");
-            rtcSetRemoteDescription(messageListener,
-                                    json_object_get_string(data), "answer");
-        } else if (strcmp(type_str, "candidate") == 0) {
-            json_object *data = json_object_object_get(root, "data");
-            rtcAddRemoteCandidate(messageListener, json_object_get_string(data),
-                                  NULL);
-        }
+    json_object_put(signal.root);
+}
+
+static void onHandleConnectionSignal(rtc_client *client,
+                                     const struct rtc_signal *signal) {
+    DEBUG_PRINT("New peer wants to connect\n");
+    if (!acceptsPeer(client, signal->caps))
+        return;
+    if (hasPeerCapacity(client)) {
+        connectPeers(client, signal);
+    } else {
+        DEBUG_PRINT("Max peers connected\n");
+        rejectPeers(client, signal->from);
+    }
+}
+
+static void onOfferSignal(rtc_client *client, const struct rtc_signal *signal) {
+    DEBUG_PRINT("GOT OFFER FROM A NODE WE WANT TO CONNECT TO\n");
+    DEBUG_PRINT("THE NODE IS %s\n", signal->from);
+    if (signal->data != NULL && acceptsPeer(client, signal->caps))
+        processOffer(client, signal->from, signal->data, signal->caps);
+}
+
+static void onAnswerSignal(rtc_client *client,
+                           const struct rtc_signal *signal) {
+    DEBUG_PRINT("--- GOT ANSWER IN CONNECT ---\n");
+    if (signal->from == NULL || signal->data == NULL)
+        return;
+
+    // only the peer that is waiting for this answer takes it
+    int pc = -1;
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_map_get(&client->peers, signal->from);
+    if (peer != NULL && peer->state == PEER_OFFERING) {
+        peer->state = PEER_CONNECTING;
+        pc = peer->pc;
+        recordStage(client, peer, RTC_STAGE_REMOTE_DESCRIPTION);
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (pc >= 0)
+        rtcSetRemoteDescription(pc, signal->data, "answer");
+}
+
+static void onCandidateSignal(rtc_client *client,
+                              const struct rtc_signal *signal) {
+    if (signal->data == NULL)
+        return;
+
+    int pc = findPeerConnection(client, signal->from);
+    if (pc >= 0)
+        rtcAddRemoteCandidate(pc, signal->data, NULL);
+}
+
+static void onCandidatesSignal(rtc_client *client,
+                               const struct rtc_signal *signal) {
+    json_object *candidates;
+    if (!json_object_object_get_ex(signal->root, "data", &candidates) ||
+        !json_object_is_type(candidates, json_type_array))
+        return;
+
+    int pc = findPeerConnection(client, signal->from);
+    if (pc < 0)
+        return;
+    size_t count = json_object_array_length(candidates);
+    for (size_t i = 0; i < count; i++) {
+        json_object *cand = json_object_array_get_idx(candidates, i);
+        if (json_object_is_type(cand, json_type_string))
+            rtcAddRemoteCandidate(pc, json_object_get_string(cand), NULL);
     }
 }
 
+static void onRejectConnectionSignal(rtc_client *client,
+                                     const struct rtc_signal *signal) {
+    DEBUG_PRINT("Connection offer rejected: %s\n", signal->data);
+    if (signal->from == NULL)
+        return;
+
+    // the offer went out to a peer that is full, nothing will answer it
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_map_get(&client->peers, signal->from);
+    bool was_open = false;
+    if (peer != NULL && peer->state == PEER_OFFERING)
+        was_open = detachPeer(peer);
+    else
+        peer = NULL;
+    pthread_mutex_unlock(&client->peers_lock);
+    if (peer != NULL)
+        destroyPeer(peer, was_open);
+}
+
 static inline void sendOfferDescriptionCallback(int pc, const char *sdp,
                                                 const char *type, void *ptr) {
-    const char *requestee = (const char *)ptr;
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    pthread_mutex_lock(&peer->client->peers_lock);
+    recordStage(peer->client, peer, RTC_STAGE_LOCAL_DESCRIPTION);
+    pthread_mutex_unlock(&peer->client->peers_lock);
     rtcSetLocalDescription(pc, sdp);
-    sendOneToOneNegotiation("offer", requestee, sdp);
+    sendOneToOneNegotiation(peer->client, "offer", peer->id, sdp, peer->caps);
     DEBUG_PRINT("------ SEND OFFER ------\n");
 }
 
 static inline void onDataChannelOpen(int id, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    rtc_client *client = peer->client;
     DEBUG_PRINT("\nData channel opened\n");
-    dataChannel[dataChannelCount++] = id;
-    messageListener = 0;
 
-    if (message_opened_callback) {
-        message_opened_callback(id, ptr);
+    pthread_mutex_lock(&client->peers_lock);
+    int ret = -1;
+    if (peer->state != PEER_CLOSED) {
+        recordStage(client, peer, RTC_STAGE_OPEN);
+        peer->context->index = acquireIndex(client);
+        peer->state = PEER_OPEN;
+        peer->openLanes |= 1u << RTC_LANE_CONTROL;
+        peer->dropPolicy = client->dropPolicy;
+        rtcSetBufferedAmountLowThreshold(id, lowWater(client));
+        ret = rtc_peer_table_add(&client->dataChannels, id, peer);
+        if (ret == 0 && relays(client, peer))
+            announceMember(client, peer, RTC_MEMBER_JOINED);
     }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (ret != 0) {
+        DEBUG_PRINT("Could not track data channel %d\n", id);
+        return;
+    }
+    // probing starts with the first peer
+    updateService(client);
+
+    reportOpened(client, id, peer->context);
 }
 
 static inline void onDataChannelMessage(int id, const char *message, int size,
                                         void *ptr) {
-    if (message_received_callback) {
-        message_received_callback(id, message, size, ptr);
-    }
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    receiveMessage(peer->client, peer, id, RTC_LANE_CONTROL, message, size);
 }
 
 static inline void onDataChannelClose(int id, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
     DEBUG_PRINT("\nData channel closed\n");
-    int found = 0;
-    for (int i = 0; i < dataChannelCount - 1; i++) {
-        if (dataChannel[i] == id)
-            found = 1;
-        if (found)
-            dataChannel[i] = dataChannel[i + 1];
+    closePeer(peer);
+}
+
+static inline void onLaneOpen(int id, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+
+    pthread_mutex_lock(&peer->client->peers_lock);
+    int lane = findLane(peer, id);
+    if (lane >= 0) {
+        peer->openLanes |= 1u << lane;
+        rtcSetBufferedAmountLowThreshold(id, lowWater(peer->client));
     }
-    dataChannelCount--;
-    messageListener = 0;
+    pthread_mutex_unlock(&peer->client->peers_lock);
+}
+
+static inline void onLaneMessage(int id, const char *message, int size,
+                                 void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    // the application only knows the peer by its control channel
+    pthread_mutex_lock(&peer->client->peers_lock);
+    int lane = findLane(peer, id);
+    pthread_mutex_unlock(&peer->client->peers_lock);
+    if (lane > RTC_LANE_CONTROL)
+        receiveMessage(peer->client, peer, peer->dc, lane, message, size);
+}
+
+static inline void onLaneClose(int id, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
 
-    if (message_closed_callback) {
-        message_closed_callback(id, ptr);
+    // the peer itself lives on as long as its control channel
+    pthread_mutex_lock(&peer->client->peers_lock);
+    int lane = findLane(peer, id);
+    if (lane >= 0)
+        peer->openLanes &= ~(1u << lane);
+    pthread_mutex_unlock(&peer->client->peers_lock);
+}
+
+static inline void onBufferedAmountLow(int id, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    rtc_client *client = peer->client;
+
+    pthread_mutex_lock(&client->peers_lock);
+    if (peer->state == PEER_OPEN)
+        pumpPeer(client, peer);
+    pthread_cond_broadcast(&client->streamCond);
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+static inline void onPeerStateChange(int pc, rtcState state, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    if (state == RTC_CONNECTED) {
+        pthread_mutex_lock(&peer->client->peers_lock);
+        recordStage(peer->client, peer, RTC_STAGE_CONNECTED);
+        pthread_mutex_unlock(&peer->client->peers_lock);
     }
+    // handshakes that never open a channel would otherwise linger forever
+    if (state == RTC_FAILED || state == RTC_CLOSED)
+        closePeer(peer);
 }
 
 static inline void candidateConnectPeersCallback(int pc, const char *cand,
                                                  const char *mid, void *ptr) {
-    const char *requestee = (const char *)ptr;
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
     if (cand != NULL) {
         DEBUG_PRINT("sent negotiations\n");
-        sendOneToOneNegotiation("candidate", requestee, cand);
+        queueCandidate(peer, cand);
     }
 }
 
-static void connectPeers(json_object *root) {
-    DEBUG_PRINT("CONNECTING PEERS\n");
-
-    json_object *data = json_object_object_get(root, "data");
-
-    int pc = rtcCreatePeerConnection(&config);
-    rtcSetUserPointer(pc, (void *)json_object_get_string(data));
-    rtcSetLocalDescriptionCallback(pc, sendOfferDescriptionCallback);
-
-    int dc = rtcCreateDataChannel(pc, "sendChannel");
+static inline void onGatheringStateChange(int pc, rtcGatheringState state,
+                                          void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    rtc_client *client = peer->client;
+    if (state != RTC_GATHERING_COMPLETE)
+        return;
 
-    DEBUG_PRINT("created data channel\n");
+    // nothing more is coming, so there is no point in waiting
+    pthread_mutex_lock(&client->peers_lock);
+    recordStage(client, peer, RTC_STAGE_GATHERED);
+    sendCandidates(client, peer);
+    pthread_mutex_unlock(&client->peers_lock);
+}
 
-    messageListener = pc;
+static struct rtc_peer *createPeer(rtc_client *client, const char *id,
+                                   enum rtc_peer_state state) {
+    if (id == NULL || id[0] == '\0')
+        return NULL;
+
+    struct rtc_peer *peer = calloc(1, sizeof(struct rtc_peer));
+    if (peer == NULL)
+        return NULL;
+    peer->context = calloc(1, sizeof(rtc_peer_context));
+    if (peer->context == NULL) {
+        free(peer);
+        return NULL;
+    }
+    strncpy(peer->context->uuid, id, sizeof(peer->context->uuid) - 1);
+    peer->context->index = -1;
+
+    peer->client = client;
+    strncpy(peer->id, id, sizeof(peer->id) - 1);
+    peer->state = state;
+    for (int lane = 0; lane < LANE_COUNT; lane++)
+        rtc_send_queue_init(&peer->queues[lane]);
+
+    pthread_mutex_lock(&client->peers_lock);
+    peer->startedAt = nowMicros();
+    int ret = rtc_peer_map_put(&client->peers, peer->id, peer);
+    pthread_mutex_unlock(&client->peers_lock);
+    if (ret != 0) {
+        free(peer->context);
+        free(peer);
+        return NULL;
+    }
 
-    rtcSetLocalCandidateCallback(pc, candidateConnectPeersCallback);
+    peer->pc = rtcCreatePeerConnection(&client->config);
+    rtcSetUserPointer(peer->pc, peer);
+    rtcSetStateChangeCallback(peer->pc, onPeerStateChange);
+    rtcSetGatheringStateChangeCallback(peer->pc, onGatheringStateChange);
 
-    rtcSetOpenCallback(dc, onDataChannelOpen);
-    rtcSetMessageCallback(dc, onDataChannelMessage);
-    rtcSetClosedCallback(dc, onDataChannelClose);
+    return peer;
 }
 
-static inline void sendAnswerDescriptionCallback(int pc, const char *sdp,
-                                                 const char *type, void *ptr) {
-    const char *requestee = (const char *)ptr;
-    rtcSetLocalDescription(pc, sdp);
-    sendOneToOneNegotiation("answer", requestee, sdp);
-    DEBUG_PRINT("------ SEND ANSWER ------\n");
-}
+// peers may be freed by any libdatachannel thread, so only ids leave the lock
+static int findPeerConnection(rtc_client *client, const char *id) {
+    if (id == NULL)
+        return -1;
 
-static inline void candidateProcessOfferCallback(int pc, const char *cand,
-                                                 const char *mid, void *ptr) {
-    const char *requestee = (const char *)ptr;
-    sendOneToOneNegotiation("candidate", requestee, cand);
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *peer = rtc_peer_map_get(&client->peers, id);
+    int pc = peer != NULL ? peer->pc : -1;
+    pthread_mutex_unlock(&client->peers_lock);
+    return pc;
 }
 
-static inline void processOfferDataChannelCallback(int pc, int dc, void *ptr) {
-    rtcSetOpenCallback(dc, onDataChannelOpen);
-    rtcSetMessageCallback(dc, onDataChannelMessage);
-    rtcSetClosedCallback(dc, onDataChannelClose);
+// unlinks the peer from the client, must be called with peers_lock held and
+// returns whether its channel was open, the caller then owns the peer
+static bool detachPeer(struct rtc_peer *peer) {
+    rtc_client *client = peer->client;
+    peer->state = PEER_CLOSED;
+    rtc_peer_map_remove(&client->peers, peer->id);
+    if (peer->candidates != NULL) {
+        json_object_put(peer->candidates);
+        peer->candidates = NULL;
+        client->pendingCandidates--;
+    }
+    if (peer->dc > 0) {
+        // writers blocked on the peer give up
+        for (int i = 0; i < client->streamCount; i++) {
+            if (client->streams[i]->dc == peer->dc)
+                client->streams[i]->state = STREAM_FAILED;
+        }
+        pthread_cond_broadcast(&client->streamCond);
+    }
+    bool was_open =
+        peer->dc > 0 &&
+        rtc_peer_table_remove(&client->dataChannels, peer->dc) != NULL;
+    if (peer->placed) {
+        // the grid must not hand out the peer anymore
+        peer->placed = false;
+        client->placedCount--;
+        client->interestDirty = true;
+    }
+    if (was_open && relays(client, peer))
+        announceMember(client, peer, RTC_MEMBER_LEFT);
+    return was_open;
 }
 
-static void processOffer(const char *requestee, const char *remoteOffer) {
-    DEBUG_PRINT("RUNNING PROCESS OFFER\n");
-
-    int pc = rtcCreatePeerConnection(&config);
-    rtcSetUserPointer(pc, (void *)requestee);
+static void destroyPeer(struct rtc_peer *peer, bool was_open) {
+    rtc_client *client = peer->client;
 
-    rtcSetLocalDescriptionCallback(pc, sendAnswerDescriptionCallback);
+    // deleting blocks until the other callbacks of these ids have returned,
+    // so nothing can reach the peer once it is freed and no message is
+    // reported after the close, the lock must not be held here since those
+    // callbacks may be waiting on it
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        if (lane != RTC_LANE_CONTROL && peer->lanes[lane] > 0)
+            rtcDeleteDataChannel(peer->lanes[lane]);
+    }
+    if (peer->dc > 0)
+        rtcDeleteDataChannel(peer->dc);
+    rtcDeletePeerConnection(peer->pc);
+
+    // incoming streams end with the peer, what arrived stays in their
+    // buffers for a later attempt to resume from
+    for (int i = 0; i < peer->incomingCount; i++)
+        reportIncoming(client, peer, peer->dc, &peer->incoming[i]);
+
+    // members reached through a hub are gone with it
+    for (int i = 0; i < peer->memberCount; i++)
+        reportClosed(client, -peer->members[i].sender,
+                     peer->members[i].context);
+
+    // channels that never opened were never reported to the application
+    if (was_open)
+        reportClosed(client, peer->dc, peer->context);
+    else
+        releaseContext(client, peer->context);
+
+    for (int lane = 0; lane < LANE_COUNT; lane++)
+        rtc_send_queue_free(&peer->queues[lane]);
+    rtc_buffer_free(&peer->batch);
+    rtc_buffer_free(&peer->recvBuffer);
+    for (int lane = 0; lane < LANE_COUNT; lane++)
+        rtc_buffer_free(&peer->inflateBuffers[lane]);
+    for (int i = 0; i < peer->replicaCount; i++)
+        rtc_state_history_free(&peer->replicas[i].history);
+    free(peer->replicas);
+    free(peer->incoming);
+    free(peer->members);
+    free(peer);
+}
 
-    rtcSetLocalCandidateCallback(pc, candidateProcessOfferCallback);
+// tears the peer down exactly once, whichever of channel close, connection
+// failure or client destruction gets here first, only safe from callbacks of
+// the peer itself since those keep it alive until they return
+static void closePeer(struct rtc_peer *peer) {
+    rtc_client *client = peer->client;
 
-    rtcSetDataChannelCallback(pc, processOfferDataChannelCallback);
+    pthread_mutex_lock(&client->peers_lock);
+    bool detached = peer->state != PEER_CLOSED;
+    bool was_open = detached && detachPeer(peer);
+    pthread_mutex_unlock(&client->peers_lock);
 
-    rtcSetRemoteDescription(pc, remoteOffer, "offer");
+    if (detached)
+        destroyPeer(peer, was_open);
 }
 
-static bool shouldRespond(json_object *root) {
-    json_object *from = json_object_object_get(root, "from");
-    const char *from_str = json_object_get_string(from);
+// counts the first time the peer reaches a stage, and every candidate, must
+// be called with peers_lock held
+static void recordStage(rtc_client *client, struct rtc_peer *peer,
+                        rtc_connect_stage stage) {
+    if (stage != RTC_STAGE_CANDIDATE && (peer->stages & (1u << stage)))
+        return;
+    peer->stages |= 1u << stage;
+    rtc_histogram_record(&client->connectStats[stage],
+                         nowMicros() - peer->startedAt);
+}
 
-    json_object *endpoint = json_object_object_get(root, "endpoint");
-    const char *endpoint_str = json_object_get_string(endpoint);
+// smooths like TCP does, must be called with peers_lock held
+static void sampleRtt(struct rtc_peer *peer, uint64_t sample) {
+    if (sample == 0)
+        sample = 1;
+    if (peer->srtt == 0) {
+        peer->srtt = sample;
+        peer->rttvar = sample / 2;
+        return;
+    }
+    uint64_t deviation =
+        sample > peer->srtt ? sample - peer->srtt : peer->srtt - sample;
+    peer->rttvar = peer->rttvar - peer->rttvar / 4 + deviation / 4;
+    peer->srtt = peer->srtt - peer->srtt / 8 + sample / 8;
+}
 
-    json_object *room_obj = json_object_object_get(root, "room");
-    const char *room_str = json_object_get_string(room_obj);
+// pings the peers whose last probe is an interval old, must be called with
+// peers_lock held
+static void probePeers(rtc_client *client) {
+    if (client->probeInterval <= 0)
+        return;
 
-    return strcmp(from_str, username) != 0 &&
-           (strcmp(endpoint_str, username) == 0 || strcmp(room_str, room) == 0);
+    uint64_t now = nowMicros();
+    uint64_t interval = (uint64_t)client->probeInterval * 1000;
+    for (int i = 0; i < client->dataChannels.count; i++) {
+        struct rtc_peer *peer = client->dataChannels.peers[i];
+        if (!(peer->caps & CAP_CLOCK_PROBES) || now - peer->probedAt < interval)
+            continue;
+        struct rtc_probe probe = {.kind = RTC_PROBE_PING};
+        sendProbe(client, peer, &probe);
+        peer->probedAt = now;
+    }
 }
 
-static void rejectPeers(json_object *root) {
-    json_object *from = json_object_object_get(root, "from");
-    sendOneToOneNegotiation("REJECT_CONNECTION", json_object_get_string(from),
-                            "Max peers connected");
+// stamps the probe as it leaves, probes are never batched and take the
+// realtime lane where there is one, so they wait behind as little as
+// possible, must be called with peers_lock held
+static void sendProbe(rtc_client *client, struct rtc_peer *peer,
+                      struct rtc_probe *probe) {
+    char msg[RTC_ENVELOPE_HEADER_SIZE + RTC_ENVELOPE_PROBE_SIZE];
+    struct rtc_envelope env = {
+        .flags = RTC_ENVELOPE_PROBE,
+        .type = RTC_ENVELOPE_UNTYPED,
+        .sender = RTC_ENVELOPE_DIRECT,
+        .length = RTC_ENVELOPE_PROBE_SIZE,
+    };
+    rtc_envelope_write_header(msg, &env);
+
+    uint64_t now = nowMicros();
+    if (probe->kind == RTC_PROBE_PING)
+        probe->origin = now;
+    else
+        probe->transmitted = now;
+    rtc_envelope_write_probe(msg + RTC_ENVELOPE_HEADER_SIZE, probe);
+
+    if (peer->openLanes & (1u << RTC_LANE_REALTIME))
+        sendRealtime(client, peer, msg, sizeof(msg));
+    else
+        sendToPeer(client, peer, RTC_LANE_CONTROL, msg, sizeof(msg));
 }
 
-static void sendNegotiation(const char *type, json_object *data) {
-    if (room[0] == '\0') {
-        DEBUG_PRINT("Please provide a room code\n");
+static void receiveProbe(rtc_client *client, struct rtc_peer *peer,
+                         const struct rtc_envelope *env) {
+    uint64_t arrived = nowMicros();
+    struct rtc_probe probe;
+    if (!(peer->caps & CAP_CLOCK_PROBES) ||
+        rtc_envelope_read_probe(env, &probe) != 0) {
+        DEBUG_PRINT("Dropped malformed probe from %s\n", peer->id);
         return;
     }
 
-    json_object *root = json_object_new_object();
-    json_object_object_add(root, "protocol",
-                           json_object_new_string("one-to-room"));
-    json_object_object_add(root, "room", json_object_new_string(room));
-    json_object_object_add(root, "from", json_object_new_string(username));
-    json_object_object_add(root, "endpoint", json_object_new_string("any"));
-    json_object_object_add(root, "type", json_object_new_string(type));
-    if (data != NULL)
-        json_object_object_add(root, "data", data);
+    pthread_mutex_lock(&client->peers_lock);
+    if (probe.kind == RTC_PROBE_PING) {
+        struct rtc_probe pong = {
+            .kind = RTC_PROBE_PONG,
+            .origin = probe.origin,
+            .received = arrived,
+        };
+        if (peer->state == PEER_OPEN)
+            sendProbe(client, peer, &pong);
+    } else if (probe.kind == RTC_PROBE_PONG) {
+        updateClock(peer, &probe, arrived);
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+// NTP's on-wire calculation, the time the peer held the probe is no part of
+// the round trip, and the offset assumes both directions took equally long,
+// must be called with peers_lock held
+static void updateClock(struct rtc_peer *peer, const struct rtc_probe *probe,
+                        uint64_t arrived) {
+    if (arrived < probe->origin || probe->transmitted < probe->received)
+        return;
+
+    uint64_t elapsed = arrived - probe->origin;
+    uint64_t held = probe->transmitted - probe->received;
+    uint64_t rtt = elapsed > held ? elapsed - held : 0;
+    int64_t offset = ((int64_t)(probe->received - probe->origin) +
+                      (int64_t)(probe->transmitted - arrived)) /
+                     2;
+
+    struct rtc_clock_sample *sample =
+        &peer->clockSamples[peer->clockSampleCount % CLOCK_SAMPLES];
+    sample->offset = offset;
+    sample->rtt = rtt;
+    peer->clockSampleCount++;
+    sampleRtt(peer, rtt);
+}
+
+static void connectPeers(rtc_client *client, const struct rtc_signal *signal) {
+    DEBUG_PRINT("CONNECTING PEERS\n");
+
+    const char *requestee = signal->data;
+
+    // a second HANDLE_CONNECTION means the peer started over
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *old =
+        requestee != NULL ? rtc_peer_map_get(&client->peers, requestee) : NULL;
+    bool was_open = old != NULL && detachPeer(old);
+    pthread_mutex_unlock(&client->peers_lock);
+    if (old != NULL)
+        destroyPeer(old, was_open);
+
+    struct rtc_peer *peer = createPeer(client, requestee, PEER_OFFERING);
+    if (peer == NULL)
+        return;
+    peer->caps = localCaps(client) & signal->caps;
+    peer->hub = (signal->caps & CAP_HUB) != 0;
+    int pc = peer->pc;
+    rtcSetLocalDescriptionCallback(pc, sendOfferDescriptionCallback);
+    rtcSetLocalCandidateCallback(pc, candidateConnectPeersCallback);
+
+    int dc = rtcCreateDataChannel(pc, laneLabels[RTC_LANE_CONTROL]);
+    attachLane(peer, dc, RTC_LANE_CONTROL);
+
+    DEBUG_PRINT("created data channel\n");
+
+    openLanes(peer);
+}
+
+// the offering side opens the extra lanes both peers support
+static void openLanes(struct rtc_peer *peer) {
+    if (peer->caps & CAP_REALTIME_LANE) {
+        rtcDataChannelInit init = {0};
+        init.reliability.unordered = true;
+        init.reliability.unreliable = true;
+        init.reliability.maxRetransmits = 0;
+        int dc = rtcCreateDataChannelEx(
+            peer->pc, laneLabels[RTC_LANE_REALTIME], &init);
+        if (dc >= 0)
+            attachLane(peer, dc, RTC_LANE_REALTIME);
+    }
+    if (peer->caps & CAP_BULK_LANE) {
+        int dc = rtcCreateDataChannel(peer->pc, laneLabels[RTC_LANE_BULK]);
+        if (dc >= 0)
+            attachLane(peer, dc, RTC_LANE_BULK);
+    }
+}
+
+static void attachLane(struct rtc_peer *peer, int dc, rtc_lane lane) {
+    pthread_mutex_lock(&peer->client->peers_lock);
+    peer->lanes[lane] = dc;
+    if (lane == RTC_LANE_CONTROL)
+        peer->dc = dc;
+    pthread_mutex_unlock(&peer->client->peers_lock);
+
+    if (lane == RTC_LANE_CONTROL) {
+        rtcSetOpenCallback(dc, onDataChannelOpen);
+        rtcSetMessageCallback(dc, onDataChannelMessage);
+        rtcSetClosedCallback(dc, onDataChannelClose);
+        rtcSetBufferedAmountLowCallback(dc, onBufferedAmountLow);
+    } else {
+        rtcSetOpenCallback(dc, onLaneOpen);
+        rtcSetMessageCallback(dc, onLaneMessage);
+        rtcSetClosedCallback(dc, onLaneClose);
+        // realtime sends count towards the room of the queued lanes, so its
+        // draining has to resume them too
+        rtcSetBufferedAmountLowCallback(dc, onBufferedAmountLow);
+    }
+}
+
+// must be called with peers_lock held
+static int findLane(struct rtc_peer *peer, int dc) {
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        if (peer->lanes[lane] == dc)
+            return lane;
+    }
+    return -1;
+}
+
+static inline void sendAnswerDescriptionCallback(int pc, const char *sdp,
+                                                 const char *type, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    pthread_mutex_lock(&peer->client->peers_lock);
+    recordStage(peer->client, peer, RTC_STAGE_LOCAL_DESCRIPTION);
+    pthread_mutex_unlock(&peer->client->peers_lock);
+    rtcSetLocalDescription(pc, sdp);
+    sendOneToOneNegotiation(peer->client, "answer", peer->id, sdp,
+                            peer->caps);
+    DEBUG_PRINT("------ SEND ANSWER ------\n");
+}
+
+static inline void candidateProcessOfferCallback(int pc, const char *cand,
+                                                 const char *mid, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+    if (cand != NULL)
+        queueCandidate(peer, cand);
+}
+
+static inline void processOfferDataChannelCallback(int pc, int dc, void *ptr) {
+    struct rtc_peer *peer = (struct rtc_peer *)ptr;
+
+    // lanes are told apart by label, anything unknown is the main channel
+    // like it was before lanes existed
+    char label[32];
+    rtc_lane lane = RTC_LANE_CONTROL;
+    if (rtcGetDataChannelLabel(dc, label, sizeof(label)) >= 0) {
+        for (int i = 0; i < LANE_COUNT; i++) {
+            if (strcmp(label, laneLabels[i]) == 0)
+                lane = i;
+        }
+    }
+    attachLane(peer, dc, lane);
+}
+
+static void processOffer(rtc_client *client, const char *requestee,
+                         const char *remoteOffer, int caps) {
+    DEBUG_PRINT("RUNNING PROCESS OFFER\n");
+
+    if (requestee == NULL)
+        return;
+
+    pthread_mutex_lock(&client->peers_lock);
+    struct rtc_peer *old = rtc_peer_map_get(&client->peers, requestee);
+    bool was_open = false;
+    if (old != NULL) {
+        // both sides offered at once, the greater UUID keeps its offer and
+        // the other side answers, any other state means the peer restarted
+        if (old->state == PEER_OFFERING &&
+            strcmp(client->username, requestee) > 0) {
+            pthread_mutex_unlock(&client->peers_lock);
+            return;
+        }
+        was_open = detachPeer(old);
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+    if (old != NULL)
+        destroyPeer(old, was_open);
+
+    // tell the offering side instead of leaving its offer unanswered
+    if (!hasPeerCapacity(client)) {
+        DEBUG_PRINT("Max peers connected\n");
+        rejectPeers(client, requestee);
+        return;
+    }
+
+    struct rtc_peer *peer = createPeer(client, requestee, PEER_ANSWERING);
+    if (peer == NULL)
+        return;
+    peer->caps = localCaps(client) & caps;
+    peer->hub = (caps & CAP_HUB) != 0;
+    pthread_mutex_lock(&client->peers_lock);
+    if (client->joinedAt != 0 && peer->startedAt >= client->joinedAt)
+        rtc_histogram_record(&client->connectStats[RTC_STAGE_OFFER_RECEIVED],
+                             peer->startedAt - client->joinedAt);
+    pthread_mutex_unlock(&client->peers_lock);
+    int pc = peer->pc;
+
+    rtcSetLocalDescriptionCallback(pc, sendAnswerDescriptionCallback);
+
+    rtcSetLocalCandidateCallback(pc, candidateProcessOfferCallback);
+
+    rtcSetDataChannelCallback(pc, processOfferDataChannelCallback);
+
+    rtcSetRemoteDescription(pc, remoteOffer, "offer");
+}
+
+static bool hasPeerCapacity(rtc_client *client) {
+    if (client->maxPeers <= 0)
+        return true;
+
+    // peers still negotiating count as well, otherwise a burst of joiners
+    // could overshoot the limit
+    pthread_mutex_lock(&client->peers_lock);
+    bool ret = client->peers.count < client->maxPeers;
+    pthread_mutex_unlock(&client->peers_lock);
+    return ret;
+}
+
+static int localCaps(rtc_client *client) {
+    int caps = 0;
+    if (client->framing == RTC_FRAMING_BINARY)
+        caps |= CAP_BINARY_FRAMING;
+    // splitting batches costs nothing, so it is offered even when this side
+    // sends unbatched
+    caps |= CAP_BATCHING | CAP_IMPLICIT_SENDER | CAP_STATE_SYNC |
+            CAP_COMPRESSION | CAP_STREAMS | CAP_CANDIDATE_BATCH |
+            CAP_CLOCK_PROBES;
+    if (client->laneWeights[RTC_LANE_REALTIME] > 0)
+        caps |= CAP_REALTIME_LANE;
+    if (client->laneWeights[RTC_LANE_BULK] > 0)
+        caps |= CAP_BULK_LANE;
+    if (client->topology != RTC_TOPOLOGY_MESH)
+        caps |= CAP_RELAY;
+    if (client->topology == RTC_TOPOLOGY_HUB)
+        caps |= CAP_HUB;
+    return caps;
+}
+
+static void registerSignalHandler(const char *type,
+                                  rtc_signal_handler handler) {
+    unsigned int i = rtc_peer_map_hash(type) & (SIGNAL_BUCKETS - 1);
+    while (signalHandlers[i].type != NULL)
+        i = (i + 1) & (SIGNAL_BUCKETS - 1);
+    signalHandlers[i].type = type;
+    signalHandlers[i].handler = handler;
+}
+
+static void registerSignalHandlers(void) {
+    registerSignalHandler("HANDLE_CONNECTION", onHandleConnectionSignal);
+    registerSignalHandler("offer", onOfferSignal);
+    registerSignalHandler("answer", onAnswerSignal);
+    registerSignalHandler("candidate", onCandidateSignal);
+    registerSignalHandler("candidates", onCandidatesSignal);
+    registerSignalHandler("REJECT_CONNECTION", onRejectConnectionSignal);
+}
+
+// one hash and, for known types, a single strcmp
+static rtc_signal_handler lookupSignalHandler(const char *type) {
+    if (type == NULL)
+        return NULL;
+
+    unsigned int i = rtc_peer_map_hash(type) & (SIGNAL_BUCKETS - 1);
+    while (signalHandlers[i].type != NULL) {
+        if (strcmp(signalHandlers[i].type, type) == 0)
+            return signalHandlers[i].handler;
+        i = (i + 1) & (SIGNAL_BUCKETS - 1);
+    }
+    return NULL;
+}
+
+static const char *getString(json_object *root, const char *key) {
+    json_object *value;
+    if (!json_object_object_get_ex(root, key, &value) ||
+        !json_object_is_type(value, json_type_string))
+        return NULL;
+    return json_object_get_string(value);
+}
+
+// parses with the client's tokener, on success the caller releases
+// signal->root once the handler is done with it
+static int parseSignal(rtc_client *client, const char *message, int size,
+                       struct rtc_signal *signal) {
+    // libdatachannel reports text messages with a negative size
+    int length = size < 0 ? -size - 1 : size;
+
+    json_tokener_reset(client->tokener);
+    json_object *root = json_tokener_parse_ex(client->tokener, message, length);
+    if (root == NULL)
+        return -1;
+    if (!json_object_is_type(root, json_type_object)) {
+        json_object_put(root);
+        return -1;
+    }
+
+    signal->root = root;
+    signal->type = getString(root, "type");
+    signal->from = getString(root, "from");
+    signal->endpoint = getString(root, "endpoint");
+    signal->room = getString(root, "room");
+    signal->data = getString(root, "data");
+
+    json_object *caps;
+    signal->caps = json_object_object_get_ex(root, "caps", &caps)
+                       ? json_object_get_int(caps)
+                       : 0;
+
+    const char *encoding = getString(root, "encoding");
+    if (encoding != NULL && inflateSignal(client, signal) != 0) {
+        json_object_put(root);
+        return -1;
+    }
+    return 0;
+}
+
+// replaces data by what it was compressed from, the result lives in the
+// client's signal buffer until the next signaling message
+static int inflateSignal(rtc_client *client, struct rtc_signal *signal) {
+    const char *encoding = getString(signal->root, "encoding");
+    if (strcmp(encoding, "lz") != 0 || signal->data == NULL)
+        return -1;
+
+    struct rtc_buffer packed = {0};
+    struct rtc_buffer *buf = &client->signalBuffer;
+    rtc_buffer_reset(buf);
+    int ret = rtc_buffer_append_base64_decoded(&packed, signal->data,
+                                               strlen(signal->data));
+    if (ret == 0)
+        ret = rtc_lz_unpack(packed.data, packed.size, buf, MAX_INFLATED_SIZE);
+    if (ret == 0)
+        ret = rtc_buffer_append(buf, "", 1);
+    rtc_buffer_free(&packed);
+    if (ret != 0)
+        return -1;
+
+    signal->data = buf->data;
+    return 0;
+}
+
+static struct rtc_type *lookupType(rtc_client *client, const char *type) {
+    if (type == NULL)
+        return NULL;
+    for (int i = 0; i < client->typeCount; i++) {
+        if (strcmp(client->types[i].name, type) == 0)
+            return &client->types[i];
+    }
+    return NULL;
+}
+
+static uint16_t lookupTypeId(rtc_client *client, const char *type) {
+    struct rtc_type *entry = lookupType(client, type);
+    return entry != NULL ? entry->id : RTC_ENVELOPE_UNTYPED;
+}
+
+static const char *lookupTypeName(rtc_client *client, uint16_t type_id) {
+    for (int i = 0; i < client->typeCount; i++) {
+        if (client->types[i].id == type_id)
+            return client->types[i].name;
+    }
+    return NULL;
+}
+
+static json_object *parseJson(const char *data, int size) {
+    json_tokener *tok = json_tokener_new();
+    json_object *obj = json_tokener_parse_ex(tok, data, size);
+    json_tokener_free(tok);
+    return obj;
+}
+
+static int writeBinaryEnvelope(rtc_client *client, uint16_t type_id,
+                               uint16_t sender, const char *data, int size,
+                               bool data_is_json) {
+    struct rtc_buffer *buf = &client->binaryBuffer;
+    rtc_buffer_reset(buf);
+    if (rtc_buffer_reserve(buf, RTC_ENVELOPE_HEADER_SIZE + size) != 0)
+        return -1;
+
+    struct rtc_envelope env = {
+        .flags = data_is_json ? RTC_ENVELOPE_JSON : 0,
+        .type = type_id,
+        .sender = sender,
+        .length = size,
+    };
+    rtc_envelope_write_header(buf->data, &env);
+    buf->size = RTC_ENVELOPE_HEADER_SIZE;
+    return rtc_buffer_append(buf, data, size);
+}
+
+// writes {"sender":...,"type":...,"payload":...} without building a json-c
+// tree, data is embedded as is when it already is JSON text, the sender is
+// left out when NULL
+static int writeJsonEnvelope(rtc_client *client, struct rtc_buffer *buf,
+                             const char *type, const char *data, int size,
+                             bool data_is_json, const char *sender) {
+    rtc_buffer_reset(buf);
+
+    static const char sender_key[] = "\"sender\":\"";
+    static const char type_key[] = "\"type\":";
+    static const char payload_key[] = "\"payload\":";
+    if (rtc_buffer_append(buf, "{", 1) != 0)
+        return -1;
+
+    if (sender != NULL &&
+        (rtc_buffer_append(buf, sender_key, sizeof(sender_key) - 1) != 0 ||
+         rtc_buffer_append(buf, sender, strlen(sender)) != 0 ||
+         rtc_buffer_append(buf, "\",", 2) != 0))
+        return -1;
+
+    if (type != NULL &&
+        (rtc_buffer_append(buf, type_key, sizeof(type_key) - 1) != 0 ||
+         rtc_buffer_append_json_string(buf, type, strlen(type)) != 0 ||
+         rtc_buffer_append(buf, ",", 1) != 0))
+        return -1;
+
+    if (rtc_buffer_append(buf, payload_key, sizeof(payload_key) - 1) != 0)
+        return -1;
+    int ret = data_is_json ? rtc_buffer_append(buf, data, size)
+                           : rtc_buffer_append_json_string(buf, data, size);
+    if (ret != 0)
+        return -1;
+    return rtc_buffer_append(buf, "}", 1);
+}
+
+static void broadcastEnvelope(rtc_client *client, const char *type,
+                              const char *data, int size, bool data_is_json) {
+    pthread_mutex_lock(&client->peers_lock);
+    sendEnvelope(client, type, data, size, data_is_json, 0, NULL);
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+// sends to every open channel without any of skip_caps, a message a hub
+// forwards for origin goes to every other member marked with its sender,
+// only to those interested in origin's position once it is placed, must be
+// called with peers_lock held
+static void sendEnvelope(rtc_client *client, const char *type,
+                         const char *data, int size, bool data_is_json,
+                         int skip_caps, struct rtc_peer *origin) {
+    int count = -1;
+    if (origin != NULL && origin->placed)
+        count = selectInterested(client, origin->x, origin->y);
+    if (count >= 0)
+        sendEnvelopeTo(client, client->interestTargets, count, type, data,
+                       size, data_is_json, skip_caps, origin);
     else
-        json_object_object_add(root, "data", json_object_new_string(username));
+        sendEnvelopeTo(client, client->dataChannels.peers,
+                       client->dataChannels.count, type, data, size,
+                       data_is_json, skip_caps, origin);
+}
 
-    const char *json_string = json_object_to_json_string(root);
+// serializes each framing at most once into the client's send buffers and
+// sends it to the targets, must be called with peers_lock held
+static void sendEnvelopeTo(rtc_client *client, struct rtc_peer **targets,
+                           int count, const char *type, const char *data,
+                           int size, bool data_is_json, int skip_caps,
+                           struct rtc_peer *origin) {
+    struct rtc_type *entry = lookupType(client, type);
+    uint16_t type_id = entry != NULL ? entry->id : RTC_ENVELOPE_UNTYPED;
+    rtc_lane lane = entry != NULL ? entry->lane : RTC_LANE_CONTROL;
+    bool binary_ok = type == NULL || type_id != RTC_ENVELOPE_UNTYPED;
+    // -1 not written yet, 0 ready, 1 failed
+    int binary_state = -1;
+    int json_state = -1;
+    int sender_json_state = -1;
+    uint16_t sender = origin != NULL ? relayIndex(origin) : RTC_ENVELOPE_DIRECT;
+    const char *sender_id = origin != NULL ? origin->id : client->username;
+
+    for (int i = 0; i < count; i++) {
+        struct rtc_peer *peer = targets[i];
+        struct rtc_buffer *msg = NULL;
+        if (peer->caps & skip_caps)
+            continue;
+        if (origin != NULL && (peer == origin || !(peer->caps & CAP_RELAY)))
+            continue;
+
+        if (binary_ok && (peer->caps & CAP_BINARY_FRAMING)) {
+            if (binary_state < 0)
+                binary_state = writeBinaryEnvelope(client, type_id, sender,
+                                                   data, size,
+                                                   data_is_json) != 0;
+            if (binary_state == 0)
+                msg = &client->binaryBuffer;
+        } else if (origin == NULL && (peer->caps & CAP_IMPLICIT_SENDER)) {
+            if (json_state < 0)
+                json_state =
+                    writeJsonEnvelope(client, &client->jsonBuffer, type, data,
+                                      size, data_is_json, NULL) != 0;
+            if (json_state == 0)
+                msg = &client->jsonBuffer;
+        } else {
+            if (sender_json_state < 0)
+                sender_json_state =
+                    writeJsonEnvelope(client, &client->senderJsonBuffer, type,
+                                      data, size, data_is_json,
+                                      sender_id) != 0;
+            if (sender_json_state == 0)
+                msg = &client->senderJsonBuffer;
+        }
 
-    rtcSendMessage(ws_id, json_string, strlen(json_string));
+        if (msg != NULL)
+            sendOnLane(client, peer, lane, msg->data, msg->size);
+    }
 }
 
-static void sendOneToOneNegotiation(const char *type, const char *endpoint,
-                                    const char *sdp) {
-    if (room[0] == '\0') {
-        DEBUG_PRINT("Please provide a room code\n");
+static void addTarget(void *item, void *arg) {
+    rtc_client *client = arg;
+    // the grid holds each peer once, so there is room for all of them
+    client->interestTargets[client->interestCount++] = item;
+}
+
+// collects the peers whose interest covers (x, y) and those without a
+// position into interestTargets, -1 if that failed and everyone should get
+// the update, must be called with peers_lock held
+static int selectInterested(rtc_client *client, double x, double y) {
+    int needed = client->dataChannels.count;
+    if (needed > client->interestCapacity) {
+        struct rtc_peer **targets =
+            realloc(client->interestTargets, needed * sizeof(*targets));
+        if (targets == NULL)
+            return -1;
+        client->interestTargets = targets;
+        client->interestCapacity = needed;
+    }
+
+    if (client->interestDirty) {
+        rtc_interest_reset(&client->interest);
+        for (int i = 0; i < client->dataChannels.count; i++) {
+            struct rtc_peer *peer = client->dataChannels.peers[i];
+            if (peer->placed && rtc_interest_add(&client->interest, peer->x,
+                                                 peer->y, peer->radius,
+                                                 peer) != 0)
+                return -1;
+        }
+        client->interestDirty = false;
+    }
+
+    client->interestCount = 0;
+    if (rtc_interest_query(&client->interest, x, y, addTarget, client) != 0)
+        return -1;
+    // the common case of every peer being placed skips the scan
+    for (int i = 0; client->placedCount < client->dataChannels.count &&
+                    i < client->dataChannels.count;
+         i++) {
+        struct rtc_peer *peer = client->dataChannels.peers[i];
+        if (!peer->placed)
+            client->interestTargets[client->interestCount++] = peer;
+    }
+    return client->interestCount;
+}
+
+// adds a framed message to the peer's batch when both sides batch, must be
+// called with peers_lock held
+static void sendFramed(rtc_client *client, struct rtc_peer *peer,
+                       const char *data, int size) {
+    if (client->batchInterval <= 0 || !(peer->caps & CAP_BATCHING)) {
+        sendToPeer(client, peer, RTC_LANE_CONTROL, data, size);
+        return;
+    }
+
+    size_t record = RTC_ENVELOPE_RECORD_HEADER_SIZE + size;
+    if (peer->batch.size + record > client->batchSize)
+        flushBatch(client, peer);
+    if (RTC_ENVELOPE_HEADER_SIZE + record > client->batchSize) {
+        // would not share a datagram with anything anyway
+        sendToPeer(client, peer, RTC_LANE_CONTROL, data, size);
+        return;
+    }
+
+    struct rtc_buffer *batch = &peer->batch;
+    if (batch->size == 0)
+        batch->size = RTC_ENVELOPE_HEADER_SIZE;
+    if (rtc_buffer_reserve(batch, batch->size + record) != 0) {
+        DEBUG_PRINT("Dropped message to %s\n", peer->id);
+        return;
+    }
+    rtc_envelope_write_record_header(batch->data + batch->size, size);
+    batch->size += RTC_ENVELOPE_RECORD_HEADER_SIZE;
+    rtc_buffer_append(batch, data, size);
+    peer->batchCount++;
+}
+
+// must be called with peers_lock held
+static void flushBatch(rtc_client *client, struct rtc_peer *peer) {
+    struct rtc_buffer *batch = &peer->batch;
+    if (peer->batchCount == 1) {
+        // a lone message is cheaper without the batch framing
+        int offset = RTC_ENVELOPE_HEADER_SIZE + RTC_ENVELOPE_RECORD_HEADER_SIZE;
+        sendToPeer(client, peer, RTC_LANE_CONTROL, batch->data + offset,
+                   batch->size - offset);
+    } else if (peer->batchCount > 1) {
+        struct rtc_envelope env = {
+            .flags = RTC_ENVELOPE_BATCH,
+            .type = RTC_ENVELOPE_UNTYPED,
+            .sender = RTC_ENVELOPE_DIRECT,
+            .length = batch->size - RTC_ENVELOPE_HEADER_SIZE,
+        };
+        rtc_envelope_write_header(batch->data, &env);
+        sendToPeer(client, peer, RTC_LANE_CONTROL, batch->data, batch->size);
+    }
+    rtc_buffer_reset(batch);
+    peer->batchCount = 0;
+}
+
+// must be called with peers_lock held
+static void flushBatches(rtc_client *client) {
+    for (int i = 0; i < client->dataChannels.count; i++)
+        flushBatch(client, client->dataChannels.peers[i]);
+}
+
+// falls back to the control lane where the peer lacks the requested one,
+// must be called with peers_lock held
+static void sendOnLane(rtc_client *client, struct rtc_peer *peer,
+                       rtc_lane lane, const char *data, int size) {
+    if (!(peer->openLanes & (1u << lane)))
+        lane = RTC_LANE_CONTROL;
+
+    if (lane == RTC_LANE_REALTIME)
+        sendRealtime(client, peer, data, size);
+    else if (lane == RTC_LANE_BULK)
+        sendToPeer(client, peer, RTC_LANE_BULK, data, size);
+    else
+        sendFramed(client, peer, data, size);
+}
+
+// points data at a compressed envelope of it when the peer takes those and
+// that saves anything, must be called with peers_lock held
+static void compressMessage(rtc_client *client, struct rtc_peer *peer,
+                            const char **data, int *size) {
+    if (client->compressThreshold == 0 || !(peer->caps & CAP_COMPRESSION) ||
+        (size_t)*size < client->compressThreshold)
+        return;
+
+    struct rtc_buffer *buf = &client->compressBuffer;
+    rtc_buffer_reset(buf);
+    if (rtc_buffer_reserve(buf, RTC_ENVELOPE_HEADER_SIZE) != 0)
+        return;
+    buf->size = RTC_ENVELOPE_HEADER_SIZE;
+    if (rtc_lz_pack(*data, *size, buf) != 0 || buf->size >= (size_t)*size)
+        return;
+
+    struct rtc_envelope env = {
+        .flags = RTC_ENVELOPE_COMPRESSED,
+        .type = RTC_ENVELOPE_UNTYPED,
+        .sender = RTC_ENVELOPE_DIRECT,
+        .length = buf->size - RTC_ENVELOPE_HEADER_SIZE,
+    };
+    rtc_envelope_write_header(buf->data, &env);
+    *data = buf->data;
+    *size = buf->size;
+}
+
+// queuing stale state would only delay the fresh one, so messages are
+// dropped instead while the lane is backed up, must be called with
+// peers_lock held
+static void sendRealtime(rtc_client *client, struct rtc_peer *peer,
+                         const char *data, int size) {
+    compressMessage(client, peer, &data, &size);
+    int buffered = rtcGetBufferedAmount(peer->lanes[RTC_LANE_REALTIME]);
+    if (buffered < 0 || (size_t)buffered >= client->highWater ||
+        !sendNow(client, peer, RTC_LANE_REALTIME, data, size, 0)) {
+        countDropped(client, peer, RTC_LANE_REALTIME);
+        DEBUG_PRINT("Dropped realtime message to %s\n", peer->id);
+    }
+}
+
+// sends right away while the connection keeps up, otherwise queues behind
+// what is already waiting on the lane, must be called with peers_lock held
+static void sendToPeer(rtc_client *client, struct rtc_peer *peer,
+                       rtc_lane lane, const char *data, int size) {
+    // queued messages wait compressed, so they take less of the queue too
+    compressMessage(client, peer, &data, &size);
+    if (peer->queues[lane].count == 0 && hasRoom(client, peer)) {
+        sendNow(client, peer, lane, data, size, 0);
+        return;
+    }
+    queueMessage(client, peer, lane, data, size);
+    pumpPeer(client, peer);
+}
+
+static void queueMessage(rtc_client *client, struct rtc_peer *peer,
+                         rtc_lane lane, const char *data, int size) {
+    struct rtc_send_queue *queue = &peer->queues[lane];
+
+    if (peer->dropPolicy == RTC_DROP_OLDEST &&
+        (size_t)size <= client->highWater) {
+        while (queue->bytes + size > client->highWater) {
+            rtc_send_queue_pop(queue);
+            queue->dropped++;
+            countDropped(client, peer, lane);
+        }
+    }
+
+    if (queue->bytes + size > client->highWater ||
+        rtc_send_queue_push(queue, data, size, nowMicros()) != 0) {
+        queue->dropped++;
+        countDropped(client, peer, lane);
+        DEBUG_PRINT("Dropped message to slow peer %s\n", peer->id);
+    }
+}
+
+// lanes share the peer's association, so the limit applies to the sum of
+// what they buffer, must be called with peers_lock held
+// every lane resumes the queues once it buffers less than this, so once the
+// last one drained that far all of them together are below the high water
+// mark and no queue stays paused without a callback coming
+static size_t lowWater(rtc_client *client) {
+    return client->highWater / LANE_COUNT;
+}
+
+static bool hasRoom(rtc_client *client, struct rtc_peer *peer) {
+    size_t total = 0;
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        if (!(peer->openLanes & (1u << lane)))
+            continue;
+        int buffered = rtcGetBufferedAmount(peer->lanes[lane]);
+        if (buffered < 0)
+            return false;
+        total += buffered;
+    }
+    return total < client->highWater;
+}
+
+// queued_at is 0 for messages that never waited
+static bool sendNow(rtc_client *client, struct rtc_peer *peer, rtc_lane lane,
+                    const char *data, int size, uint64_t queued_at) {
+    if (rtcSendMessage(peer->lanes[lane], data, size) < 0) {
+        DEBUG_PRINT("Failed to send to %s\n", peer->id);
+        return false;
+    }
+
+    struct rtc_lane_stats *stats = &client->laneStats[lane];
+    stats->messages++;
+    stats->bytes += size;
+    atomic_fetch_add_explicit(&peer->messagesSent, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&peer->bytesSent, size, memory_order_relaxed);
+    if (queued_at != 0) {
+        uint64_t delay = nowMicros() - queued_at;
+        stats->queue_delay_total += delay;
+        if (delay > stats->queue_delay_max)
+            stats->queue_delay_max = delay;
+    }
+    return true;
+}
+
+// deficit round robin over the queued lanes, each round a lane may send
+// its weight in quanta, and whatever it could not use carries over as long
+// as it has messages waiting, must be called with peers_lock held
+static void pumpPeer(rtc_client *client, struct rtc_peer *peer) {
+    bool pending = true;
+    // rounds only start while there is room, so lanes don't build up credit
+    // while the connection is backed up
+    while (pending && hasRoom(client, peer)) {
+        pending = false;
+        for (int lane = 0; lane < LANE_COUNT; lane++) {
+            struct rtc_send_queue *queue = &peer->queues[lane];
+            if (queue->count == 0) {
+                peer->deficits[lane] = 0;
+                continue;
+            }
+
+            // a lane turned off after queuing still has to drain
+            unsigned int weight = client->laneWeights[lane];
+            peer->deficits[lane] += (weight > 0 ? weight : 1) * LANE_QUANTUM;
+
+            struct rtc_queued_message *msg;
+            while ((msg = rtc_send_queue_front(queue)) != NULL &&
+                   msg->data.size <= peer->deficits[lane]) {
+                if (!hasRoom(client, peer))
+                    return;
+                peer->deficits[lane] -= msg->data.size;
+                sendNow(client, peer, lane, msg->data.data, msg->data.size,
+                        msg->queuedAt);
+                rtc_send_queue_pop(queue);
+            }
+
+            if (queue->count == 0)
+                peer->deficits[lane] = 0;
+            else
+                pending = true;
+        }
+    }
+}
+
+// must be called with peers_lock held
+static void countDropped(rtc_client *client, struct rtc_peer *peer,
+                         rtc_lane lane) {
+    client->laneStats[lane].dropped++;
+    atomic_fetch_add_explicit(&peer->dropped, 1, memory_order_relaxed);
+}
+
+static uint64_t nowMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// size follows libdatachannel and is negative for text messages
+// undoes the compression of a datagram, batches only arrive on the control
+// lane
+static void receiveMessage(rtc_client *client, struct rtc_peer *peer, int id,
+                           rtc_lane lane, const char *message, int size) {
+    bool allow_batch = lane == RTC_LANE_CONTROL;
+    int length = size < 0 ? -size - 1 : size;
+    atomic_fetch_add_explicit(&peer->messagesReceived, 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&peer->bytesReceived, length,
+                              memory_order_relaxed);
+
+    struct rtc_envelope env;
+    if (rtc_envelope_read(message, length, &env) != 0 ||
+        !(env.flags & RTC_ENVELOPE_COMPRESSED)) {
+        deliverMessage(client, peer, id, message, size, allow_batch);
         return;
     }
 
+    struct rtc_buffer *buf = &peer->inflateBuffers[lane];
+    rtc_buffer_reset(buf);
+    if (rtc_lz_unpack(env.payload, env.length, buf, MAX_INFLATED_SIZE) != 0 ||
+        buf->size == 0) {
+        DEBUG_PRINT("Dropped malformed compressed message from %s\n",
+                    peer->id);
+        return;
+    }
+
+    int inflated = buf->size;
+    if ((unsigned char)buf->data[0] == RTC_ENVELOPE_MAGIC) {
+        deliverMessage(client, peer, id, buf->data, inflated, allow_batch);
+        return;
+    }
+    // JSON is handed out terminated like any text message
+    if (rtc_buffer_append(buf, "", 1) == 0)
+        deliverMessage(client, peer, id, buf->data, -inflated - 1, allow_batch);
+}
+
+static void deliverMessage(rtc_client *client, struct rtc_peer *peer, int id,
+                           const char *message, int size, bool allow_batch) {
+    int length = size < 0 ? -size - 1 : size;
+
+    struct rtc_envelope env;
+    if (rtc_envelope_read(message, length, &env) == 0) {
+        if (env.flags & RTC_ENVELOPE_COMPRESSED)
+            DEBUG_PRINT("Dropped nested compressed message from %s\n",
+                        peer->id);
+        else if (env.flags & RTC_ENVELOPE_STREAM)
+            receiveStream(client, peer, id, &env);
+        else if (env.flags & RTC_ENVELOPE_PROBE)
+            receiveProbe(client, peer, &env);
+        else if (env.flags & RTC_ENVELOPE_MEMBER)
+            receiveMember(client, peer, &env);
+        else if (!(env.flags & RTC_ENVELOPE_BATCH)) {
+            if (relays(client, peer) && env.sender == RTC_ENVELOPE_DIRECT)
+                relayBinary(client, peer, &env);
+            deliverBinary(client, peer, id, &env);
+        } else if (allow_batch)
+            deliverBatch(client, peer, id, &env);
+        return;
+    }
+
+    if ((peer->caps & CAP_STATE_SYNC) &&
+        length > (int)sizeof(STATE_PREFIX) - 1 &&
+        memcmp(message, STATE_PREFIX, sizeof(STATE_PREFIX) - 1) == 0) {
+        receiveState(client, peer, id, message, length);
+        return;
+    }
+    if (relayedBy(client, peer)) {
+        deliverFromHub(client, peer, id, message, length);
+        return;
+    }
+
+    if (relays(client, peer))
+        relayJson(client, peer, message, length);
+    if (client->useInbox || client->payload_received_callback) {
+        deliverJson(client, peer, id, message, length);
+    } else if (client->message_received_callback) {
+        client->message_received_callback(id, message, length, peer->context);
+    }
+}
+
+static void deliverBatch(rtc_client *client, struct rtc_peer *peer, int id,
+                         const struct rtc_envelope *batch) {
+    const char *record;
+    int size;
+    int offset = 0;
+    while ((offset = rtc_envelope_read_record(batch, offset, &record, &size)) >
+           0) {
+        if ((unsigned char)record[0] == RTC_ENVELOPE_MAGIC) {
+            deliverMessage(client, peer, id, record, size, false);
+            continue;
+        }
+
+        // JSON records are handed out terminated like any text message
+        struct rtc_buffer *buf = &peer->recvBuffer;
+        rtc_buffer_reset(buf);
+        if (rtc_buffer_append(buf, record, size) != 0 ||
+            rtc_buffer_append(buf, "", 1) != 0)
+            continue;
+        deliverMessage(client, peer, id, buf->data, -size - 1, false);
+    }
+}
+
+// messages a hub forwards come from the member its sender marks
+static void deliverBinary(rtc_client *client, struct rtc_peer *peer, int id,
+                          const struct rtc_envelope *env) {
+    rtc_peer_context *context = peer->context;
+    bool relayed = env->sender != RTC_ENVELOPE_DIRECT;
+    if (relayed &&
+        (!relayedBy(client, peer) ||
+         (context = holdMember(client, peer, env->sender, NULL, &id)) ==
+             NULL)) {
+        DEBUG_PRINT("Dropped message of unknown member %u from %s\n",
+                    env->sender, peer->id);
+        return;
+    }
+    const char *type = lookupTypeName(client, env->type);
+
+    if (client->useInbox || client->payload_received_callback) {
+        deliverPayload(client, context, id, type, env->payload, env->length);
+    } else if (client->message_received_callback) {
+        // rebuild the JSON envelope for applications that only parse that
+        json_object *root = json_object_new_object();
+        json_object *value = NULL;
+        if (type != NULL) {
+            json_object_object_add(root, "type", json_object_new_string(type));
+            value = parseJson(env->payload, env->length);
+        }
+        if (value == NULL)
+            value = json_object_new_string_len(env->payload, env->length);
+        json_object_object_add(root, "payload", value);
+        deliverRebuilt(client, context, id, root);
+    }
+
+    if (relayed)
+        releaseMember(client, peer);
+}
+
+// takes ownership of root
+static void deliverRebuilt(rtc_client *client, rtc_peer_context *context,
+                           int id, json_object *root) {
+    size_t len;
+    const char *json_str =
+        json_object_to_json_string_length(root, JSON_C_TO_STRING_PLAIN, &len);
+    client->message_received_callback(id, json_str, len, context);
+    json_object_put(root);
+}
+
+static void deliverJson(rtc_client *client, struct rtc_peer *peer, int id,
+                        const char *message, int size) {
+    json_object *root = parseJson(message, size);
+    if (root == NULL) {
+        DEBUG_PRINT("Dropped malformed message from %s\n", peer->id);
+        return;
+    }
+    deliverJsonObject(client, peer->context, id, root);
+    json_object_put(root);
+}
+
+// hands the payload of a JSON envelope to the application, root stays owned
+// by the caller
+static void deliverJsonObject(rtc_client *client, rtc_peer_context *context,
+                              int id, json_object *root) {
+    json_object *type = json_object_object_get(root, "type");
+    json_object *payload = json_object_object_get(root, "payload");
+
+    const char *data;
+    size_t len;
+    if (json_object_is_type(payload, json_type_string)) {
+        data = json_object_get_string(payload);
+        len = json_object_get_string_len(payload);
+    } else {
+        data = json_object_to_json_string_length(payload,
+                                                 JSON_C_TO_STRING_PLAIN, &len);
+    }
+
+    deliverPayload(client, context, id, json_object_get_string(type), data,
+                   len);
+}
+
+// must be called with peers_lock held
+static int lookupState(rtc_client *client, const char *key) {
+    for (int i = 0; i < client->stateCount; i++) {
+        if (strcmp(client->states[i].key, key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// sends the latest version of an object to every open peer, must be called
+// with peers_lock held
+static void publishState(rtc_client *client, int index) {
+    bool legacy = false;
+    for (int i = 0; i < client->dataChannels.count; i++) {
+        struct rtc_peer *peer = client->dataChannels.peers[i];
+        if (peer->caps & CAP_STATE_SYNC)
+            sendState(client, peer, index, false);
+        else
+            legacy = true;
+    }
+    if (!legacy)
+        return;
+
+    // peers without deltas get every version whole, like a typed object
+    struct rtc_state_object *object = &client->states[index];
+    json_object *state = rtc_state_history_get(&object->history, object->seq);
+    size_t size;
+    const char *data =
+        json_object_to_json_string_length(state, JSON_C_TO_STRING_PLAIN, &size);
+    sendEnvelope(client, object->key, data, size, true, CAP_STATE_SYNC, NULL);
+}
+
+// sends the changes since the version the peer acknowledged, or all of the
+// object for a keyframe or when that version is too old, must be called with
+// peers_lock held
+static void sendState(rtc_client *client, struct rtc_peer *peer, int index,
+                      bool keyframe) {
+    struct rtc_state_object *object = &client->states[index];
+    struct rtc_state_link *link = &peer->stateLinks[index];
+    json_object *state = rtc_state_history_get(&object->history, object->seq);
+    json_object *base =
+        keyframe ? NULL : rtc_state_history_get(&object->history, link->acked);
+    uint32_t base_seq = base != NULL ? link->acked : 0;
+
+    json_object *msg = json_object_new_object();
+    json_object_object_add(msg, "state", json_object_new_string(object->key));
+    json_object_object_add(msg, "seq", json_object_new_int64(object->seq));
+    json_object_object_add(msg, "base", json_object_new_int64(base_seq));
+    if (rtc_state_diff(base, state, msg) >= 0) {
+        struct rtc_type *entry = lookupType(client, object->key);
+        rtc_lane lane = entry != NULL ? entry->lane : RTC_LANE_CONTROL;
+        size_t size;
+        const char *data = json_object_to_json_string_length(
+            msg, JSON_C_TO_STRING_PLAIN, &size);
+        sendOnLane(client, peer, lane, data, size);
+        link->sentAt = nowMicros();
+        // keyframes repeat a version, like retransmissions they are not
+        // timed
+        link->timedAt = link->sentSeq != object->seq ? link->sentAt : 0;
+        link->sentSeq = object->seq;
+    }
+    json_object_put(msg);
+}
+
+// resends objects whose latest version a peer has not acknowledged for a
+// keyframe interval, that is the only way a lost delta is recovered once the
+// object stops changing, must be called with peers_lock held
+static void refreshStates(rtc_client *client) {
+    if (client->keyframeInterval <= 0)
+        return;
+
+    uint64_t now = nowMicros();
+    uint64_t interval = (uint64_t)client->keyframeInterval * 1000;
+    for (int i = 0; i < client->dataChannels.count; i++) {
+        struct rtc_peer *peer = client->dataChannels.peers[i];
+        if (!(peer->caps & CAP_STATE_SYNC))
+            continue;
+        for (int index = 0; index < client->stateCount; index++) {
+            struct rtc_state_link *link = &peer->stateLinks[index];
+            uint32_t seq = client->states[index].seq;
+            if (seq != 0 && link->acked != seq &&
+                now - link->sentAt >= interval)
+                sendState(client, peer, index, true);
+        }
+    }
+}
+
+static void receiveState(rtc_client *client, struct rtc_peer *peer, int id,
+                         const char *message, int size) {
+    json_object *root = parseJson(message, size);
+    json_object *key;
+    if (root == NULL || !json_object_object_get_ex(root, "state", &key) ||
+        !json_object_is_type(key, json_type_string)) {
+        DEBUG_PRINT("Dropped malformed state from %s\n", peer->id);
+        if (root != NULL)
+            json_object_put(root);
+        return;
+    }
+
+    const char *name = json_object_get_string(key);
+    json_object *ack;
+    json_object *state = NULL;
+    pthread_mutex_lock(&client->peers_lock);
+    if (json_object_object_get_ex(root, "ack", &ack))
+        ackState(client, peer, name, json_object_get_int64(ack));
+    else
+        state = applyState(client, peer, name, root);
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (state != NULL) {
+        deliverState(client, peer, id, name, state);
+        json_object_put(state);
+    }
+    json_object_put(root);
+}
+
+// rebuilds the peer's version of an object from a delta and acknowledges it,
+// returns a new reference to it or NULL if the delta can't be applied, must
+// be called with peers_lock held
+static json_object *applyState(rtc_client *client, struct rtc_peer *peer,
+                               const char *key, json_object *delta) {
+    struct rtc_state_replica *replica = NULL;
+    for (int i = 0; i < peer->replicaCount && replica == NULL; i++) {
+        if (strcmp(peer->replicas[i].key, key) == 0)
+            replica = &peer->replicas[i];
+    }
+    if (replica == NULL) {
+        if (peer->replicaCount >= MAX_STATES ||
+            strlen(key) >= sizeof(replica->key))
+            return NULL;
+        size_t size =
+            (peer->replicaCount + 1) * sizeof(struct rtc_state_replica);
+        struct rtc_state_replica *replicas = realloc(peer->replicas, size);
+        if (replicas == NULL)
+            return NULL;
+        peer->replicas = replicas;
+        replica = &replicas[peer->replicaCount++];
+        memset(replica, 0, sizeof(struct rtc_state_replica));
+        strcpy(replica->key, key);
+    }
+
+    json_object *value;
+    uint32_t seq = json_object_object_get_ex(delta, "seq", &value)
+                       ? json_object_get_int64(value)
+                       : 0;
+    uint32_t base_seq = json_object_object_get_ex(delta, "base", &value)
+                            ? json_object_get_int64(value)
+                            : 0;
+    // realtime lanes reorder, anything older than what we have is stale
+    if (seq <= replica->latest)
+        return NULL;
+    json_object *base = NULL;
+    if (base_seq != 0) {
+        base = rtc_state_history_get(&replica->history, base_seq);
+        // the next keyframe brings us back
+        if (base == NULL)
+            return NULL;
+    }
+
+    json_object *state = rtc_state_apply(base, delta);
+    if (state == NULL)
+        return NULL;
+    rtc_state_history_put(&replica->history, seq, state);
+    replica->latest = seq;
+
+    // acks are superseded by the next one, so they may be lost as well
+    struct rtc_buffer *buf = &client->jsonBuffer;
+    char seq_str[16];
+    int seq_len = snprintf(seq_str, sizeof(seq_str), "%u", seq);
+    rtc_buffer_reset(buf);
+    if (rtc_buffer_append(buf, STATE_PREFIX, sizeof(STATE_PREFIX) - 1) == 0 &&
+        rtc_buffer_append_json_string(buf, key, strlen(key)) == 0 &&
+        rtc_buffer_append(buf, ",\"ack\":", 7) == 0 &&
+        rtc_buffer_append(buf, seq_str, seq_len) == 0 &&
+        rtc_buffer_append(buf, "}", 1) == 0)
+        sendOnLane(client, peer, RTC_LANE_REALTIME, buf->data, buf->size);
+
+    return json_object_get(state);
+}
+
+// must be called with peers_lock held
+static void ackState(rtc_client *client, struct rtc_peer *peer,
+                     const char *key, uint32_t seq) {
+    int index = lookupState(client, key);
+    if (index < 0)
+        return;
+    struct rtc_state_object *object = &client->states[index];
+    struct rtc_state_link *link = &peer->stateLinks[index];
+    // only versions still in the history can be the base of a delta
+    if (seq > link->acked && seq <= object->seq &&
+        rtc_state_history_get(&object->history, seq) != NULL)
+        link->acked = seq;
+    if (seq == link->sentSeq && link->timedAt != 0) {
+        sampleRtt(peer, nowMicros() - link->timedAt);
+        link->timedAt = 0;
+    }
+}
+
+// hands the application the whole object, as if it was sent as a typed
+// object
+static void deliverState(rtc_client *client, struct rtc_peer *peer, int id,
+                         const char *key, json_object *state) {
+    if (client->useInbox || client->payload_received_callback) {
+        size_t size;
+        const char *data = json_object_to_json_string_length(
+            state, JSON_C_TO_STRING_PLAIN, &size);
+        deliverPayload(client, peer->context, id, key, data, size);
+    } else if (client->message_received_callback) {
+        json_object *root = json_object_new_object();
+        json_object_object_add(root, "type", json_object_new_string(key));
+        json_object_object_add(root, "payload", json_object_get(state));
+        deliverRebuilt(client, peer->context, id, root);
+    }
+}
+
+// the bulk lane keeps large transfers from holding up other messages, must be
+// called with peers_lock held
+static rtc_lane streamLane(struct rtc_peer *peer) {
+    return (peer->openLanes & (1u << RTC_LANE_BULK)) ? RTC_LANE_BULK
+                                                     : RTC_LANE_CONTROL;
+}
+
+// must be called with peers_lock held
+static int writeStreamMessage(rtc_client *client, uint8_t kind,
+                              uint32_t stream, uint64_t offset,
+                              const char *data, int size) {
+    struct rtc_buffer *buf = &client->streamBuffer;
+    int total = RTC_ENVELOPE_HEADER_SIZE + RTC_ENVELOPE_STREAM_HEADER_SIZE +
+                size;
+    rtc_buffer_reset(buf);
+    if (rtc_buffer_reserve(buf, total) != 0)
+        return -1;
+
+    struct rtc_envelope env = {
+        .flags = RTC_ENVELOPE_STREAM,
+        .type = RTC_ENVELOPE_UNTYPED,
+        .sender = RTC_ENVELOPE_DIRECT,
+        .length = RTC_ENVELOPE_STREAM_HEADER_SIZE + size,
+    };
+    struct rtc_stream_header header = {
+        .kind = kind,
+        .stream = stream,
+        .offset = offset,
+    };
+    rtc_envelope_write_header(buf->data, &env);
+    rtc_envelope_write_stream_header(buf->data + RTC_ENVELOPE_HEADER_SIZE,
+                                     &header);
+    if (size > 0)
+        memcpy(buf->data + total - size, data, size);
+    buf->size = total;
+    return 0;
+}
+
+// must be called with peers_lock held
+static void sendStreamControl(rtc_client *client, struct rtc_peer *peer,
+                              rtc_lane lane, uint8_t kind, uint32_t stream,
+                              uint64_t offset, const char *data, int size) {
+    if (writeStreamMessage(client, kind, stream, offset, data, size) == 0)
+        sendToPeer(client, peer, lane, client->streamBuffer.data,
+                   client->streamBuffer.size);
+}
+
+// progress is signalled, the timeout only covers a channel draining without
+// a buffered amount low callback, must be called with peers_lock held
+static void waitStream(rtc_client *client) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += STREAM_POLL_INTERVAL * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&client->streamCond, &client->peers_lock,
+                           &deadline);
+}
+
+// must be called with peers_lock held
+static void removeStream(rtc_client *client, rtc_stream *stream) {
+    for (int i = 0; i < client->streamCount; i++) {
+        if (client->streams[i] == stream) {
+            client->streams[i] = client->streams[--client->streamCount];
+            return;
+        }
+    }
+}
+
+// kinds up to ABORT come from the peer's side of its own streams, the rest
+// answer ours
+static void receiveStream(rtc_client *client, struct rtc_peer *peer, int id,
+                          const struct rtc_envelope *env) {
+    struct rtc_stream_header header;
+    const char *data;
+    int size;
+    if (!(peer->caps & CAP_STREAMS) ||
+        rtc_envelope_read_stream_header(env, &header, &data, &size) != 0) {
+        DEBUG_PRINT("Dropped malformed stream message from %s\n", peer->id);
+        return;
+    }
+
+    switch (header.kind) {
+    case RTC_STREAM_OPEN:
+        openIncoming(client, peer, id, &header, data, size);
+        break;
+    case RTC_STREAM_DATA:
+        writeIncoming(client, peer, id, &header, data, size);
+        break;
+    case RTC_STREAM_ABORT:
+        abortIncoming(client, peer, id, header.stream);
+        break;
+    default:
+        updateOutgoing(client, peer, &header);
+        break;
+    }
+}
+
+// asks the application where the stream goes, header->offset is its size
+static void openIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                         const struct rtc_stream_header *header,
+                         const char *name, int length) {
+    struct rtc_incoming_stream incoming = {
+        .id = header->stream,
+        .size = header->offset,
+    };
+    int ret = -1;
+    if (length < STREAM_NAME_SIZE && client->stream_opened_callback) {
+        memcpy(incoming.name, name, length);
+        ret = client->stream_opened_callback(id, incoming.name, incoming.size,
+                                             &incoming.target, peer->context);
+    }
+    bool accepted = ret == 0 && incoming.target.offset <= incoming.size &&
+                    (incoming.target.buffer != NULL || incoming.size == 0);
+    incoming.received = incoming.target.offset;
+    incoming.acked = incoming.received;
+    bool complete = incoming.received == incoming.size;
+
+    pthread_mutex_lock(&client->peers_lock);
+    bool added = false;
+    if (accepted && !complete && peer->state == PEER_OPEN &&
+        findIncoming(peer, incoming.id) < 0) {
+        struct rtc_incoming_stream *streams =
+            realloc(peer->incoming, (peer->incomingCount + 1) *
+                                        sizeof(struct rtc_incoming_stream));
+        if (streams != NULL) {
+            peer->incoming = streams;
+            peer->incoming[peer->incomingCount++] = incoming;
+            added = true;
+        }
+    }
+    // an accepted stream that is already complete only needs the offset
+    if (added || (accepted && complete))
+        sendStreamControl(client, peer, streamLane(peer), RTC_STREAM_ACCEPT,
+                          incoming.id, incoming.received, NULL, 0);
+    else
+        sendStreamControl(client, peer, streamLane(peer), RTC_STREAM_REFUSE,
+                          incoming.id, 0, NULL, 0);
+    pthread_mutex_unlock(&client->peers_lock);
+
+    // the application hears back about every stream it accepted
+    if (ret == 0 && !added)
+        reportIncoming(client, peer, id, &incoming);
+}
+
+static void writeIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                          const struct rtc_stream_header *header,
+                          const char *data, int size) {
+    pthread_mutex_lock(&client->peers_lock);
+    int index = findIncoming(peer, header->stream);
+    if (index < 0) {
+        // refused or given up already
+        pthread_mutex_unlock(&client->peers_lock);
+        return;
+    }
+
+    struct rtc_incoming_stream *incoming = &peer->incoming[index];
+    // the lane is ordered, so a gap means the sender lost track
+    bool failed = header->offset != incoming->received ||
+                  (uint64_t)size > incoming->size - incoming->received;
+    if (!failed && size > 0) {
+        memcpy(incoming->target.buffer + incoming->received, data, size);
+        incoming->received += size;
+    }
+
+    bool done = incoming->received == incoming->size;
+    if (failed) {
+        sendStreamControl(client, peer, streamLane(peer), RTC_STREAM_REFUSE,
+                          incoming->id, incoming->received, NULL, 0);
+    } else if (done ||
+               incoming->received - incoming->acked >= STREAM_ACK_INTERVAL) {
+        incoming->acked = incoming->received;
+        sendStreamControl(client, peer, streamLane(peer), RTC_STREAM_ACK,
+                          incoming->id, incoming->acked, NULL, 0);
+    }
+
+    struct rtc_incoming_stream finished;
+    if (failed || done) {
+        finished = *incoming;
+        peer->incoming[index] = peer->incoming[--peer->incomingCount];
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (failed || done)
+        reportIncoming(client, peer, id, &finished);
+}
+
+static void abortIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                          uint32_t stream) {
+    pthread_mutex_lock(&client->peers_lock);
+    int index = findIncoming(peer, stream);
+    struct rtc_incoming_stream finished;
+    if (index >= 0) {
+        finished = peer->incoming[index];
+        peer->incoming[index] = peer->incoming[--peer->incomingCount];
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (index >= 0)
+        reportIncoming(client, peer, id, &finished);
+}
+
+// must be called with peers_lock held
+static int findIncoming(struct rtc_peer *peer, uint32_t stream) {
+    for (int i = 0; i < peer->incomingCount; i++) {
+        if (peer->incoming[i].id == stream)
+            return i;
+    }
+    return -1;
+}
+
+static void reportIncoming(rtc_client *client, struct rtc_peer *peer, int id,
+                           struct rtc_incoming_stream *incoming) {
+    if (client->stream_closed_callback)
+        client->stream_closed_callback(
+            id, incoming->name, &incoming->target, incoming->received,
+            incoming->received == incoming->size, peer->context);
+}
+
+static void updateOutgoing(rtc_client *client, struct rtc_peer *peer,
+                           const struct rtc_stream_header *header) {
+    pthread_mutex_lock(&client->peers_lock);
+    for (int i = 0; i < client->streamCount; i++) {
+        rtc_stream *stream = client->streams[i];
+        if (stream->dc != peer->dc || stream->id != header->stream)
+            continue;
+
+        if (header->kind == RTC_STREAM_ACCEPT &&
+            stream->state == STREAM_OPENING &&
+            header->offset <= stream->size) {
+            stream->state = STREAM_OPEN;
+            stream->sent = header->offset;
+            stream->acked = header->offset;
+        } else if (header->kind == RTC_STREAM_ACK &&
+                   header->offset > stream->acked &&
+                   header->offset <= stream->sent) {
+            stream->acked = header->offset;
+        } else if (header->kind != RTC_STREAM_ACK) {
+            stream->state = STREAM_FAILED;
+        }
+        pthread_cond_broadcast(&client->streamCond);
+        break;
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+// this client is the hub and the peer one of its members
+static bool relays(rtc_client *client, struct rtc_peer *peer) {
+    return client->topology == RTC_TOPOLOGY_HUB && (peer->caps & CAP_RELAY);
+}
+
+// this client is a member and the peer its hub
+static bool relayedBy(rtc_client *client, struct rtc_peer *peer) {
+    return client->topology == RTC_TOPOLOGY_MEMBER && peer->hub &&
+           (peer->caps & CAP_RELAY);
+}
+
+// members only connect to the hub, caps as the peer signaled them
+static bool acceptsPeer(rtc_client *client, int caps) {
+    return client->topology != RTC_TOPOLOGY_MEMBER || (caps & CAP_HUB);
+}
+
+// what a hub marks a member's messages with, RTC_ENVELOPE_DIRECT if the
+// member can't be told apart
+static uint16_t relayIndex(struct rtc_peer *peer) {
+    int index = peer->context->index;
+    return index >= 0 && index < UINT16_MAX ? index + 1 : RTC_ENVELOPE_DIRECT;
+}
+
+// tells the other members that member joined or left, and a member that
+// joined about everyone already there, must be called with peers_lock held
+static void announceMember(rtc_client *client, struct rtc_peer *member,
+                           uint8_t kind) {
+    if (relayIndex(member) == RTC_ENVELOPE_DIRECT)
+        return;
+
+    for (int i = 0; i < client->dataChannels.count; i++) {
+        struct rtc_peer *peer = client->dataChannels.peers[i];
+        if (peer == member || !relays(client, peer) ||
+            relayIndex(peer) == RTC_ENVELOPE_DIRECT)
+            continue;
+        sendMember(client, peer, member, kind);
+        if (kind == RTC_MEMBER_JOINED)
+            sendMember(client, member, peer, RTC_MEMBER_JOINED);
+    }
+}
+
+// announcements share the control lane with forwarded messages, so a member
+// hears of another one before anything it sent, must be called with
+// peers_lock held
+static void sendMember(rtc_client *client, struct rtc_peer *to,
+                       struct rtc_peer *member, uint8_t kind) {
+    char message[RTC_ENVELOPE_HEADER_SIZE + 1 + UUID_STR_LEN];
+    int length = 1;
+    message[RTC_ENVELOPE_HEADER_SIZE] = kind;
+    if (kind == RTC_MEMBER_JOINED) {
+        size_t uuid = strlen(member->id);
+        memcpy(message + RTC_ENVELOPE_HEADER_SIZE + 1, member->id, uuid);
+        length += uuid;
+    }
+
+    struct rtc_envelope env = {
+        .flags = RTC_ENVELOPE_MEMBER,
+        .type = RTC_ENVELOPE_UNTYPED,
+        .sender = relayIndex(member),
+        .length = length,
+    };
+    rtc_envelope_write_header(message, &env);
+    sendOnLane(client, to, RTC_LANE_CONTROL, message,
+               RTC_ENVELOPE_HEADER_SIZE + length);
+}
+
+// untyped messages and types nobody registered are always forwarded
+static bool relaysType(rtc_client *client, const char *type) {
+    struct rtc_type *entry = lookupType(client, type);
+    return entry == NULL || entry->relay;
+}
+
+// forwards what a member sent to every other member, reframed once per
+// framing like the hub's own messages
+static void relayBinary(rtc_client *client, struct rtc_peer *origin,
+                        const struct rtc_envelope *env) {
+    // members agree on type ids, but JSON framed ones need the name
+    const char *type = lookupTypeName(client, env->type);
+    if (env->type != RTC_ENVELOPE_UNTYPED && type == NULL) {
+        DEBUG_PRINT("Not forwarding unregistered type %u from %s\n", env->type,
+                    origin->id);
+        return;
+    }
+    if (!relaysType(client, type))
+        return;
+
+    // the sender marks JSON payloads, which JSON framed members get embedded
+    // as they are
+    bool data_is_json = (env->flags & RTC_ENVELOPE_JSON) != 0;
+    pthread_mutex_lock(&client->peers_lock);
+    if (relayIndex(origin) != RTC_ENVELOPE_DIRECT)
+        sendEnvelope(client, type, env->payload, env->length, data_is_json, 0,
+                     origin);
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+static void relayJson(rtc_client *client, struct rtc_peer *origin,
+                      const char *message, int size) {
+    json_object *root = parseJson(message, size);
+    json_object *payload;
+    if (root == NULL || !json_object_object_get_ex(root, "payload", &payload)) {
+        json_object_put(root);
+        return;
+    }
+
+    const char *type = getString(root, "type");
+    if (!relaysType(client, type)) {
+        json_object_put(root);
+        return;
+    }
+    bool data_is_json = !json_object_is_type(payload, json_type_string);
+    size_t length;
+    const char *data;
+    if (data_is_json) {
+        data = json_object_to_json_string_length(
+            payload, JSON_C_TO_STRING_PLAIN, &length);
+    } else {
+        data = json_object_get_string(payload);
+        length = json_object_get_string_len(payload);
+    }
+
+    pthread_mutex_lock(&client->peers_lock);
+    if (relayIndex(origin) != RTC_ENVELOPE_DIRECT)
+        sendEnvelope(client, type, data, length, data_is_json, 0, origin);
+    pthread_mutex_unlock(&client->peers_lock);
+    json_object_put(root);
+}
+
+// a member joined or left the hub, a joined index still in use means the
+// member behind it left unannounced
+static void receiveMember(rtc_client *client, struct rtc_peer *hub,
+                          const struct rtc_envelope *env) {
+    if (!relayedBy(client, hub) || env->sender == RTC_ENVELOPE_DIRECT ||
+        env->length < 1)
+        return;
+    uint8_t kind = env->payload[0];
+    int id = -env->sender;
+
+    rtc_peer_context *left = NULL;
+    rtc_peer_context *joined = NULL;
+    pthread_mutex_lock(&client->peers_lock);
+    for (int i = 0; i < hub->memberCount; i++) {
+        if (hub->members[i].sender != env->sender)
+            continue;
+        left = hub->members[i].context;
+        hub->members[i] = hub->members[--hub->memberCount];
+        // messages of the member still being delivered come before its
+        // closed event
+        while (hub->delivering > 0)
+            pthread_cond_wait(&client->memberCond, &client->peers_lock);
+        break;
+    }
+
+    struct rtc_relayed_member *members =
+        kind == RTC_MEMBER_JOINED && env->length > 1
+            ? realloc(hub->members,
+                      (hub->memberCount + 1) * sizeof(*hub->members))
+            : NULL;
+    if (members != NULL) {
+        hub->members = members;
+        joined = calloc(1, sizeof(rtc_peer_context));
+    }
+    if (joined != NULL) {
+        int length = env->length - 1;
+        if (length > (int)sizeof(joined->uuid) - 1)
+            length = sizeof(joined->uuid) - 1;
+        memcpy(joined->uuid, env->payload + 1, length);
+        joined->index = acquireIndex(client);
+        members[hub->memberCount++] = (struct rtc_relayed_member){
+            .sender = env->sender,
+            .context = joined,
+        };
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (left != NULL)
+        reportClosed(client, id, left);
+    if (joined != NULL)
+        reportOpened(client, id, joined);
+}
+
+// finds the member a message forwarded by the hub comes from, by sender or
+// uuid, and keeps it from being reported closed until releaseMember, NULL if
+// the hub never announced it
+static rtc_peer_context *holdMember(rtc_client *client, struct rtc_peer *hub,
+                                    uint16_t sender, const char *uuid,
+                                    int *id) {
+    rtc_peer_context *context = NULL;
+    pthread_mutex_lock(&client->peers_lock);
+    for (int i = 0; i < hub->memberCount && context == NULL; i++) {
+        struct rtc_relayed_member *member = &hub->members[i];
+        if (uuid != NULL ? strcmp(member->context->uuid, uuid) == 0
+                         : member->sender == sender) {
+            context = member->context;
+            *id = -member->sender;
+            hub->delivering++;
+        }
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+    return context;
+}
+
+static void releaseMember(rtc_client *client, struct rtc_peer *hub) {
+    pthread_mutex_lock(&client->peers_lock);
+    if (--hub->delivering == 0)
+        pthread_cond_broadcast(&client->memberCond);
+    pthread_mutex_unlock(&client->peers_lock);
+}
+
+// JSON envelopes from the hub name the member they come from, unless the hub
+// sent them itself
+static void deliverFromHub(rtc_client *client, struct rtc_peer *hub, int id,
+                           const char *message, int size) {
+    json_object *root = parseJson(message, size);
+    if (root == NULL) {
+        DEBUG_PRINT("Dropped malformed message from %s\n", hub->id);
+        return;
+    }
+
+    const char *sender = getString(root, "sender");
+    bool relayed = sender != NULL && strcmp(sender, hub->id) != 0;
+    rtc_peer_context *context =
+        relayed ? holdMember(client, hub, 0, sender, &id) : hub->context;
+    if (context == NULL) {
+        DEBUG_PRINT("Dropped message of unknown member %s\n", sender);
+        json_object_put(root);
+        return;
+    }
+
+    if (client->useInbox || client->payload_received_callback)
+        deliverJsonObject(client, context, id, root);
+    else if (client->message_received_callback)
+        client->message_received_callback(id, message, size, context);
+
+    if (relayed)
+        releaseMember(client, hub);
+    json_object_put(root);
+}
+
+// ticks as often as the most frequent periodic work needs
+static int updateService(rtc_client *client) {
+    pthread_mutex_lock(&client->peers_lock);
+    int interval = client->batchInterval;
+    int keyframes = client->stateCount > 0 ? client->keyframeInterval : 0;
+    if (keyframes > 0 && (interval <= 0 || keyframes < interval))
+        interval = keyframes;
+    int candidates =
+        client->pendingCandidates > 0 ? client->candidateInterval : 0;
+    if (candidates > 0 && (interval <= 0 || candidates < interval))
+        interval = candidates;
+    int probes = client->dataChannels.count > 0 ? client->probeInterval : 0;
+    if (probes > 0 && (interval <= 0 || probes < interval))
+        interval = probes;
+    pthread_mutex_unlock(&client->peers_lock);
+
+    // the service thread calls this too, so an unchanged interval must not
+    // cut its wait short
+    pthread_mutex_lock(&client->serviceLock);
+    if (client->serviceInterval != interval) {
+        client->serviceInterval = interval;
+        pthread_cond_signal(&client->serviceCond);
+    }
+    pthread_mutex_unlock(&client->serviceLock);
+
+    return interval > 0 ? startService(client) : 0;
+}
+
+static int startService(rtc_client *client) {
+    pthread_mutex_lock(&client->serviceLock);
+    int ret = 0;
+    if (!client->serviceRunning && !client->serviceStopped) {
+        if (pthread_create(&client->serviceThread, NULL, serviceMain, client) ==
+            0)
+            client->serviceRunning = true;
+        else
+            ret = -1;
+    }
+    pthread_mutex_unlock(&client->serviceLock);
+    return ret;
+}
+
+static void stopService(rtc_client *client) {
+    pthread_mutex_lock(&client->serviceLock);
+    bool running = client->serviceRunning;
+    client->serviceRunning = false;
+    client->serviceStopped = true;
+    pthread_cond_signal(&client->serviceCond);
+    pthread_mutex_unlock(&client->serviceLock);
+
+    if (running)
+        pthread_join(client->serviceThread, NULL);
+}
+
+static void *serviceMain(void *arg) {
+    rtc_client *client = (rtc_client *)arg;
+
+    pthread_mutex_lock(&client->serviceLock);
+    while (client->serviceRunning) {
+        if (client->serviceInterval <= 0) {
+            pthread_cond_wait(&client->serviceCond, &client->serviceLock);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += (long)client->serviceInterval * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        if (pthread_cond_timedwait(&client->serviceCond, &client->serviceLock,
+                                   &deadline) != ETIMEDOUT)
+            continue;
+
+        int interval = client->serviceInterval;
+        pthread_mutex_unlock(&client->serviceLock);
+        pthread_mutex_lock(&client->peers_lock);
+        flushBatches(client);
+        refreshStates(client);
+        flushCandidates(client);
+        probePeers(client);
+        // candidates no longer need their tick
+        bool slower = client->pendingCandidates == 0 &&
+                      interval == client->candidateInterval;
+        pthread_mutex_unlock(&client->peers_lock);
+        if (slower)
+            updateService(client);
+        pthread_mutex_lock(&client->serviceLock);
+    }
+    pthread_mutex_unlock(&client->serviceLock);
+
+    return NULL;
+}
+
+static void deliverPayload(rtc_client *client, rtc_peer_context *context,
+                           int id, const char *type, const char *payload,
+                           int size) {
+    if (client->useInbox)
+        pushEvent(client, RTC_EVENT_MESSAGE, id, context, type, payload, size);
+    else
+        client->payload_received_callback(id, type, payload, size, context);
+}
+
+static void reportOpened(rtc_client *client, int id,
+                         rtc_peer_context *context) {
+    if (client->useInbox)
+        pushLifecycle(client, RTC_EVENT_OPENED, id, context);
+    else if (client->message_opened_callback)
+        client->message_opened_callback(id, context);
+}
+
+// the application sees context for the last time
+static void reportClosed(rtc_client *client, int id,
+                         rtc_peer_context *context) {
+    if (client->useInbox) {
+        // the context is released once the application polled the event
+        if (pushLifecycle(client, RTC_EVENT_CLOSED, id, context) != 0)
+            releaseContext(client, context);
+    } else {
+        if (client->message_closed_callback)
+            client->message_closed_callback(id, context);
+        releaseContext(client, context);
+    }
+}
+
+// copies everything into an inbox slot, the sources only live as long as
+// the libdatachannel callback
+static int pushEvent(rtc_client *client, rtc_event_kind kind, int id,
+                     rtc_peer_context *context, const char *type,
+                     const char *payload, int size) {
+    // would be polled before opened events waiting outside of the inbox
+    if (kind == RTC_EVENT_MESSAGE &&
+        atomic_load_explicit(&client->lifecycleCount, memory_order_acquire) >
+            0) {
+        atomic_fetch_add_explicit(&client->inbox.dropped, 1,
+                                  memory_order_relaxed);
+        DEBUG_PRINT("Inbox full, dropped event from %s\n", context->uuid);
+        return -1;
+    }
+
+    struct rtc_inbox_slot *slot = rtc_inbox_claim(&client->inbox);
+    if (slot == NULL) {
+        DEBUG_PRINT("Inbox full, dropped event from %s\n", context->uuid);
+        return -1;
+    }
+
+    slot->kind = kind;
+    slot->id = id;
+    slot->context = context;
+    memcpy(slot->peer, context->uuid, sizeof(slot->peer));
+    slot->size = size;
+    slot->typeOffset = -1;
+
+    struct rtc_buffer *buf = &slot->data;
+    rtc_buffer_reset(buf);
+    int ret = rtc_buffer_append(buf, payload != NULL ? payload : "", size);
+    ret |= rtc_buffer_append(buf, "", 1);
+    if (type != NULL) {
+        slot->typeOffset = buf->size;
+        ret |= rtc_buffer_append(buf, type, strlen(type) + 1);
+    }
+    if (ret != 0 && kind == RTC_EVENT_MESSAGE) {
+        // claimed slots have to be published, the consumer skips this one
+        slot->kind = -1;
+    }
+
+    rtc_inbox_publish(slot);
+    return 0;
+}
+
+// opened and closed events go into the inbox while it has room and wait
+// outside of it otherwise, -1 only if even that failed
+static int pushLifecycle(rtc_client *client, rtc_event_kind kind, int id,
+                         rtc_peer_context *context) {
+    pthread_mutex_lock(&client->lifecycleLock);
+    // keeps them in order once some wait
+    int ret = -1;
+    if (client->lifecycleHead == NULL)
+        ret = pushEvent(client, kind, id, context, NULL, NULL, 0);
+    if (ret != 0) {
+        struct rtc_lifecycle_event *pending = malloc(sizeof(*pending));
+        if (pending != NULL) {
+            *pending = (struct rtc_lifecycle_event){
+                .kind = kind,
+                .id = id,
+                .context = context,
+            };
+            memcpy(pending->peer, context->uuid, sizeof(pending->peer));
+            if (client->lifecycleTail != NULL)
+                client->lifecycleTail->next = pending;
+            else
+                client->lifecycleHead = pending;
+            client->lifecycleTail = pending;
+            atomic_fetch_add_explicit(&client->lifecycleCount, 1,
+                                      memory_order_release);
+            ret = 0;
+        } else {
+            DEBUG_PRINT("Dropped event from %s\n", context->uuid);
+        }
+    }
+    pthread_mutex_unlock(&client->lifecycleLock);
+    return ret;
+}
+
+// frees a list of events, the contexts of closed ones with them
+static void releaseLifecycle(rtc_client *client,
+                             struct rtc_lifecycle_event *pending) {
+    while (pending != NULL) {
+        struct rtc_lifecycle_event *next = pending->next;
+        if (pending->kind == RTC_EVENT_CLOSED)
+            releaseContext(client, pending->context);
+        free(pending);
+        pending = next;
+    }
+}
+
+// must be called with peers_lock held
+static int acquireIndex(rtc_client *client) {
+    if (client->freeCount > 0)
+        return client->freeIndices[--client->freeCount];
+
+    // keep room to give every index back without allocating
+    int *indices =
+        realloc(client->freeIndices, (client->indexCount + 1) * sizeof(int));
+    if (indices == NULL)
+        return -1;
+    client->freeIndices = indices;
+    return client->indexCount++;
+}
+
+static void releaseContext(rtc_client *client, rtc_peer_context *context) {
+    if (context->index >= 0) {
+        pthread_mutex_lock(&client->peers_lock);
+        client->freeIndices[client->freeCount++] = context->index;
+        pthread_mutex_unlock(&client->peers_lock);
+    }
+    free(context);
+}
+
+static void releaseSlot(struct rtc_inbox_slot *slot, void *arg) {
+    if (slot->kind == RTC_EVENT_CLOSED)
+        releaseContext((rtc_client *)arg, slot->context);
+}
+
+static bool shouldRespond(rtc_client *client, const struct rtc_signal *signal) {
+    if (signal->from == NULL || strcmp(signal->from, client->username) == 0)
+        return false;
+
+    return (signal->endpoint != NULL &&
+            strcmp(signal->endpoint, client->username) == 0) ||
+           (signal->room != NULL && strcmp(signal->room, client->room) == 0);
+}
+
+static void rejectPeers(rtc_client *client, const char *peer_id) {
+    sendOneToOneNegotiation(client, "REJECT_CONNECTION", peer_id,
+                            "Max peers connected", 0);
+}
+
+// the fields every signaling message starts with, data is up to the caller
+static json_object *newSignal(rtc_client *client, const char *protocol,
+                              const char *endpoint, const char *type) {
     json_object *root = json_object_new_object();
-    json_object_object_add(root, "protocol",
-                           json_object_new_string("one-to-one"));
-    json_object_object_add(root, "room", json_object_new_string(room));
-    json_object_object_add(root, "from", json_object_new_string(username));
+    json_object_object_add(root, "protocol", json_object_new_string(protocol));
+    json_object_object_add(root, "room", json_object_new_string(client->room));
+    json_object_object_add(root, "from",
+                           json_object_new_string(client->username));
     json_object_object_add(root, "endpoint", json_object_new_string(endpoint));
     json_object_object_add(root, "type", json_object_new_string(type));
-    json_object_object_add(root, "data", json_object_new_string(sdp));
+    json_object_object_add(root, "caps",
+                           json_object_new_int(localCaps(client)));
+    return root;
+}
 
+// releases root
+static void sendSignal(rtc_client *client, json_object *root) {
     const char *json_string = json_object_to_json_string(root);
 
-    rtcSendMessage(ws_id, json_string, strlen(json_string));
+    rtcSendMessage(client->ws_id, json_string, strlen(json_string));
+    json_object_put(root);
+}
+
+static void sendNegotiation(rtc_client *client, const char *type,
+                            json_object *data) {
+    if (client->room[0] == '\0') {
+        DEBUG_PRINT("Please provide a room code\n");
+        return;
+    }
+
+    json_object *root = newSignal(client, "one-to-room", "any", type);
+    if (data != NULL)
+        json_object_object_add(root, "data", data);
+    else
+        json_object_object_add(root, "data",
+                               json_object_new_string(client->username));
+
+    sendSignal(client, root);
+}
+
+// peers that take batches get their candidates once a few have gathered,
+// everyone else one signaling message each
+static void queueCandidate(struct rtc_peer *peer, const char *cand) {
+    rtc_client *client = peer->client;
+
+    pthread_mutex_lock(&client->peers_lock);
+    recordStage(client, peer, RTC_STAGE_CANDIDATE);
+    bool queued = false;
+    bool first = false;
+    if (client->candidateInterval > 0 && (peer->caps & CAP_CANDIDATE_BATCH) &&
+        peer->state != PEER_CLOSED) {
+        if (peer->candidates == NULL) {
+            peer->candidates = json_object_new_array();
+            peer->candidatesAt = nowMicros();
+            first = peer->candidates != NULL &&
+                    ++client->pendingCandidates == 1;
+        }
+        queued = peer->candidates != NULL &&
+                 json_object_array_add(peer->candidates,
+                                       json_object_new_string(cand)) == 0;
+    }
+    pthread_mutex_unlock(&client->peers_lock);
+
+    if (!queued)
+        sendOneToOneNegotiation(client, "candidate", peer->id, cand,
+                                peer->caps);
+    // the service thread sends them once the interval is up
+    else if (first)
+        updateService(client);
+}
+
+// must be called with peers_lock held
+static void sendCandidates(rtc_client *client, struct rtc_peer *peer) {
+    if (peer->candidates == NULL)
+        return;
+
+    json_object *root = newSignal(client, "one-to-one", peer->id, "candidates");
+    json_object_object_add(root, "data", peer->candidates);
+    sendSignal(client, root);
+    peer->candidates = NULL;
+    client->pendingCandidates--;
+}
+
+// sends the candidates that waited long enough, must be called with
+// peers_lock held
+static void flushCandidates(rtc_client *client) {
+    if (client->pendingCandidates == 0)
+        return;
+
+    uint64_t now = nowMicros();
+    uint64_t interval = client->candidateInterval > 0
+                            ? (uint64_t)client->candidateInterval * 1000
+                            : 0;
+    for (int i = 0; i <= client->peers.mask; i++) {
+        struct rtc_peer *peer = client->peers.buckets[i].peer;
+        if (peer != NULL && peer->candidates != NULL &&
+            now - peer->candidatesAt >= interval)
+            sendCandidates(client, peer);
+    }
+}
+
+// caps are those of the endpoint, data is compressed for endpoints that can
+// take it
+static void sendOneToOneNegotiation(rtc_client *client, const char *type,
+                                    const char *endpoint, const char *sdp,
+                                    int caps) {
+    if (client->room[0] == '\0') {
+        DEBUG_PRINT("Please provide a room code\n");
+        return;
+    }
+
+    json_object *root = newSignal(client, "one-to-one", endpoint, type);
+
+    // SDP is mostly repeated attribute names, the signaling server relays
+    // fields it doesn't know as is
+    pthread_mutex_lock(&client->peers_lock);
+    size_t threshold = client->compressThreshold;
+    pthread_mutex_unlock(&client->peers_lock);
+    size_t length = strlen(sdp);
+    struct rtc_buffer packed = {0};
+    struct rtc_buffer text = {0};
+    if ((caps & CAP_COMPRESSION) && threshold > 0 && length >= threshold &&
+        rtc_lz_pack(sdp, length, &packed) == 0 &&
+        rtc_buffer_append_base64(&text, packed.data, packed.size) == 0 &&
+        text.size < length) {
+        json_object_object_add(root, "encoding", json_object_new_string("lz"));
+        json_object_object_add(
+            root, "data", json_object_new_string_len(text.data, text.size));
+    } else {
+        json_object_object_add(root, "data", json_object_new_string(sdp));
+    }
+    rtc_buffer_free(&packed);
+    rtc_buffer_free(&text);
+
+    sendSignal(client, root);
 }
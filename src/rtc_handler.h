@@ -1,7 +1,9 @@
 #ifndef RTC_HANDLER_H
 #define RTC_HANDLER_H
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
 #include <uuid/uuid.h>
@@ -9,14 +11,366 @@
 #include <rtc/rtc.h>
 #include <json-c/json.h>
 
+#include "rtc_histogram.h"
+
+// opaque handle owning one client's signaling connection, peers and callbacks
+// many clients can live in the same process and share libdatachannel's
+// thread pool
+typedef struct rtc_client rtc_client;
+
+// framing of data channel messages, binary is only used with peers that
+// enabled it as well, everyone else keeps getting the JSON envelope
+typedef enum {
+    RTC_FRAMING_JSON = 0,
+    RTC_FRAMING_BINARY = 1,
+} rtc_framing;
+
+// what a peer's send queue does with a message that does not fit below its
+// high-water mark
+typedef enum {
+    // refuse the new message, queued messages are kept in order
+    RTC_DROP_NEWEST = 0,
+    // evict the oldest queued messages until the new one fits, for streams
+    // where only the latest state matters
+    RTC_DROP_OLDEST = 1,
+} rtc_drop_policy;
+
+// data channels opened to every peer, a message goes over the lane chosen
+// for its type, messages on different lanes are not ordered with each other
+typedef enum {
+    // reliable and ordered, the default for every type
+    RTC_LANE_CONTROL = 0,
+    // unordered without retransmissions, a lost update is superseded by the
+    // next one instead of holding back everything sent after it
+    RTC_LANE_REALTIME = 1,
+    // reliable and ordered, for large transfers that must not hold up the
+    // other lanes
+    RTC_LANE_BULK = 2,
+} rtc_lane;
+
+// how the clients of a room connect, all of them use the same topology
+// except for the one hub
+typedef enum {
+    // every client connects to every other one
+    RTC_TOPOLOGY_MESH = 0,
+    // connects only to the hub, which forwards messages between the members,
+    // members reached through it have opened and closed events of their own
+    // with negative ids, replicated state, streams and clock probes only
+    // work with the hub itself
+    RTC_TOPOLOGY_MEMBER = 1,
+    // connects to every client and forwards what each member sends to all
+    // others, a typed message only if its type is registered here as well
+    RTC_TOPOLOGY_HUB = 2,
+} rtc_topology;
+
+// milestones of a peer's handshake, each timed from the signaling message
+// that started it, the peer's HANDLE_CONNECTION or offer
+typedef enum {
+    // from the client's own HANDLE_CONNECTION to the offer of a peer
+    // answering it, only peers this client answers
+    RTC_STAGE_OFFER_RECEIVED = 0,
+    RTC_STAGE_LOCAL_DESCRIPTION = 1,
+    // every local candidate
+    RTC_STAGE_CANDIDATE = 2,
+    RTC_STAGE_GATHERED = 3,
+    // the answer arrived, only peers this client offers to
+    RTC_STAGE_REMOTE_DESCRIPTION = 4,
+    // ICE and DTLS are done
+    RTC_STAGE_CONNECTED = 5,
+    // the control channel opened, the whole time to join
+    RTC_STAGE_OPEN = 6,
+    RTC_STAGE_COUNT = 7,
+} rtc_connect_stage;
+
+// library owned state of a peer with an open channel, passed as ptr to the
+// opened, received and closed callbacks, uuid comes first so ptr also reads
+// as the peer's uuid string
+typedef struct {
+    char uuid[UUID_STR_LEN];
+    // smallest integer not taken by another open peer, reused once the peer
+    // closed, suitable for indexing the application's own arrays
+    int index;
+    // left to the application, NULL when the channel opens
+    void *user_data;
+} rtc_peer_context;
+
+typedef enum {
+    RTC_EVENT_OPENED,
+    RTC_EVENT_MESSAGE,
+    RTC_EVENT_CLOSED,
+} rtc_event_kind;
+
+// what the callbacks would have been called with, the strings stay valid
+// until the next poll
+typedef struct {
+    rtc_event_kind kind;
+    int id;
+    // uuid of the remote peer
+    const char *peer;
+    // valid until the poll after the peer's closed event
+    rtc_peer_context *context;
+    // message events only, type is NULL for untyped messages and payload is
+    // NUL terminated
+    const char *type;
+    const char *payload;
+    int size;
+} rtc_event;
+
+// a transfer of one binary object to a peer, written in order and resumable
+// from wherever an earlier attempt stopped
+typedef struct rtc_stream rtc_stream;
+
+// where an incoming stream goes, filled in when it is accepted
+typedef struct {
+    // holds the whole stream, for instance from rtc_stream_map_file
+    char *buffer;
+    // bytes the buffer already holds from an earlier attempt, the sender
+    // continues after them
+    uint64_t offset;
+    // left to the application
+    void *user_data;
+} rtc_stream_target;
+
+struct rtc_lane_stats {
+    // handed to libdatachannel
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t dropped;
+    // time messages waited in the send queues, in microseconds
+    uint64_t queue_delay_total;
+    uint64_t queue_delay_max;
+};
+
+#define RTC_CANDIDATE_SIZE 256
+
+// one peer's traffic since its channel opened, messages are datagrams as
+// they cross the wire, so a batch counts once
+struct rtc_peer_stats {
+    uint64_t messages_sent;
+    uint64_t bytes_sent;
+    uint64_t messages_received;
+    uint64_t bytes_received;
+    // refused or evicted by the send queues, or realtime messages skipped
+    uint64_t dropped;
+    // waiting in the send queues of all lanes
+    int queue_depth;
+    size_t queue_bytes;
+    // waiting in libdatachannel's buffers on all lanes
+    size_t buffered;
+    // smoothed round trip time in microseconds, 0 until measured
+    uint64_t srtt;
+    // candidates of the pair in use, empty until ICE selected one
+    char local_candidate[RTC_CANDIDATE_SIZE];
+    char remote_candidate[RTC_CANDIDATE_SIZE];
+};
+
+// what clock probes tell about a peer, in microseconds
+struct rtc_clock_estimate {
+    // the peer's rtc_now_micros minus ours, subtracting it from a timestamp
+    // the peer took gives local time
+    int64_t offset;
+    // smoothed round trip time and its mean deviation
+    uint64_t rtt;
+    uint64_t jitter;
+    // probes answered so far
+    uint64_t samples;
+};
+
 void generate_uuid(char out[UUID_STR_LEN]);
+// the monotonic clock clock probes compare, in microseconds
+uint64_t rtc_now_micros(void);
+
+// max_peers caps the number of open data channels, 0 or less for no limit
+rtc_client *rtc_client_initialize(const char **stun_servers,
+                                  int stun_servers_count, const char *ws_url,
+                                  const char *username, const char *room,
+                                  int max_peers, pthread_mutex_t *lock,
+                                  pthread_cond_t *cond, int *ws_joined,
+                                  int *ws_ret_code);
+void rtc_client_destroy(rtc_client *client);
+void rtc_client_handle_connection(rtc_client *client);
+void rtc_client_send_message(rtc_client *client, const char *message);
+// obj stays owned by the caller, reusing the same object between sends keeps
+// the send path free of heap allocations
+void rtc_client_send_typed_object(rtc_client *client, const char *type,
+                                  json_object *obj);
+// sends obj only to peers whose interest covers (x, y) and to peers without
+// a position, a hub forwards a member's messages the same way by the
+// position set for that member
+void rtc_client_send_typed_object_at(rtc_client *client, const char *type,
+                                     json_object *obj, double x, double y);
+// places the peer on an open channel at (x, y), interested in updates within
+// radius, a negative radius removes it again, -1 if the channel is not open
+int rtc_client_set_peer_interest(rtc_client *client, int id, double x,
+                                 double y, double radius);
+// side of the grid cells indexing peer positions, best about as large as a
+// typical radius, 0 or less for the default
+void rtc_client_set_interest_cell(rtc_client *client, double size);
+// sends an opaque payload, binary framed peers get it as is
+void rtc_client_send_typed(rtc_client *client, const char *type,
+                           const char *payload, int size);
+
+// must be set before rtc_client_handle_connection to be negotiated
+void rtc_client_set_framing(rtc_client *client, rtc_framing framing);
+// must be set before rtc_client_handle_connection, the hub serializes what
+// it forwards once per framing, so members should agree on one
+void rtc_client_set_topology(rtc_client *client, rtc_topology topology);
+// messages of at least threshold bytes, batches included, are compressed for
+// peers that can decompress them, and so is signaling data sent to them, 0
+// turns compression off, receiving compressed messages always works
+void rtc_client_set_compression(rtc_client *client, size_t threshold);
+// binary framing carries types as ids, every peer has to register the same
+// id for a type, unregistered types are sent with the JSON envelope
+int rtc_client_register_type(rtc_client *client, uint16_t type_id,
+                             const char *type);
+// type must be registered, realtime messages are never queued or batched
+// but dropped while the channel is backed up, peers without a lane get its
+// messages over the control lane
+int rtc_client_set_type_lane(rtc_client *client, const char *type,
+                             rtc_lane lane);
+// type must be registered, a hub forwards every type to the other members
+// unless relay is false, for messages only the hub itself acts on
+int rtc_client_set_type_relay(rtc_client *client, const char *type,
+                              bool relay);
+// queued control and bulk messages share a peer's connection in proportion
+// to their weights, a weight of 0 keeps a lane from being opened to peers
+// connecting afterwards, the control lane always stays open
+int rtc_client_set_lane_weight(rtc_client *client, rtc_lane lane,
+                               unsigned int weight);
+// totals over every peer since the client was created
+int rtc_client_get_lane_stats(rtc_client *client, rtc_lane lane,
+                              struct rtc_lane_stats *stats);
+
+// -1 if the channel is not open
+int rtc_client_get_peer_stats(rtc_client *client, int id,
+                              struct rtc_peer_stats *stats);
+
+// peers are probed every interval_ms to estimate their clock offset and
+// round trip time, 0 or less stops probing
+int rtc_client_set_clock_probes(rtc_client *client, int interval_ms);
+// -1 if the channel is not open or has not answered a probe yet
+int rtc_client_get_clock(rtc_client *client, int id,
+                         struct rtc_clock_estimate *estimate);
+
+// latencies in microseconds over every peer since the client was created,
+// stages a handshake never reached are not counted
+int rtc_client_get_connect_stats(rtc_client *client, rtc_connect_stage stage,
+                                 struct rtc_histogram *stats);
+
+// messages are queued per peer once its channel buffers high_water bytes and
+// sent again as it drains, a queue holds at most high_water bytes, the policy
+// applies to peers connecting afterwards
+void rtc_client_set_send_queue(rtc_client *client, size_t high_water,
+                               rtc_drop_policy policy);
+// overrides the drop policy of one open channel
+int rtc_client_set_drop_policy(rtc_client *client, int id,
+                               rtc_drop_policy policy);
+// number of messages queued for a channel on all of its lanes, -1 if it is
+// not open, bytes receives their size unless it is NULL
+int rtc_client_get_queue_depth(rtc_client *client, int id, size_t *bytes);
+
+// coalesces messages sent within interval_ms into one datagram per peer, a
+// peer's batch goes out early once it would grow past max_bytes, an interval
+// of 0 or less sends everything right away again, peers that can't split
+// batches keep getting single messages
+int rtc_client_set_batching(rtc_client *client, int interval_ms,
+                            size_t max_bytes);
+// local ICE candidates gathered within interval_ms of each other are signaled
+// together, and all of them as soon as gathering completes, 0 or less
+// signals each one right away, peers that can't take batches always get
+// them one by one
+int rtc_client_set_candidate_batching(rtc_client *client, int interval_ms);
+
+// replicates state, a JSON object, to every peer under key, peers get the top
+// level fields changed since the version they acknowledged, or the whole
+// object if they can't take deltas, nothing is sent while state stays the
+// same, state stays owned by the caller, receivers get every new version
+// whole like an object sent with rtc_client_send_typed_object of type key
+int rtc_client_set_state(rtc_client *client, const char *key,
+                         json_object *state);
+// peers that have not acknowledged the latest version of an object get all
+// of it again every interval_ms, 0 or less turns keyframes off
+int rtc_client_set_state_keyframes(rtc_client *client, int interval_ms);
+
+// opens a stream of size bytes named name to the peer on channel id, blocks
+// until the peer accepted it, NULL if it refused, did not answer within the
+// open timeout, is gone or can't take streams, streams use the bulk lane if
+// the peer has it
+rtc_stream *rtc_stream_open(rtc_client *client, int id, const char *name,
+                            uint64_t size);
+// where writing starts, past the bytes the peer already has
+uint64_t rtc_stream_offset(rtc_stream *stream);
+// sends the next size bytes, blocks while the peer is a window behind or the
+// channel is backed up, -1 once the stream failed or would outgrow its size
+int rtc_stream_write(rtc_stream *stream, const void *data, size_t size);
+// waits until the peer has everything written and frees the stream, a stream
+// closed early is aborted and the peer keeps what it got, returns 0 if the
+// peer received all of it
+int rtc_stream_close(rtc_stream *stream);
+// bytes a stream may send ahead of the peer's acknowledgements
+void rtc_client_set_stream_window(rtc_client *client, size_t bytes);
+// how long rtc_stream_open waits for the peer to answer, 10 seconds unless
+// set
+void rtc_client_set_stream_open_timeout(rtc_client *client, int timeout_ms);
+// a peer started a stream, returning 0 accepts it into target, -1 refuses
+// it, called from libdatachannel's threads even with an inbox
+void rtc_client_set_stream_opened_callback(
+    rtc_client *client,
+    int (*on_stream_opened)(int id, const char *name, uint64_t size,
+                            rtc_stream_target *target, void *ptr));
+// an accepted stream ended, the first received bytes of the buffer are
+// filled, called from libdatachannel's threads even with an inbox
+void rtc_client_set_stream_closed_callback(
+    rtc_client *client,
+    void (*on_stream_closed)(int id, const char *name,
+                             rtc_stream_target *target, uint64_t received,
+                             bool complete, void *ptr));
+// maps size bytes of the file at path for receiving a stream into, creating
+// or growing it as needed, a partial file keeps what it holds, NULL on error
+char *rtc_stream_map_file(const char *path, uint64_t size);
+int rtc_stream_unmap_file(char *buffer, uint64_t size);
+
+void rtc_client_set_message_opened_callback(
+    rtc_client *client, void (*on_message_opened)(int id, void *ptr));
+// size is the length of message in bytes, never negative, text messages,
+// which includes every envelope rebuilt as JSON, are NUL terminated as well,
+// JSON arrives as the peer sent it, ptr's uuid names the sender
+void rtc_client_set_message_received_callback(
+    rtc_client *client,
+    void (*on_message_received)(int id, const char *message, int size,
+                                void *ptr));
+void rtc_client_set_message_closed_callback(
+    rtc_client *client, void (*on_message_closed)(int id, void *ptr));
+// queues opened, message and closed events in a lock-free inbox of capacity
+// events instead of calling the callbacks from libdatachannel's threads,
+// must be set before rtc_client_handle_connection, message events that find
+// the inbox full are dropped, opened and closed events never are
+int rtc_client_set_inbox(rtc_client *client, int capacity);
+// moves up to max events out of the inbox, returns how many, must always be
+// called from the same thread
+int rtc_client_poll(rtc_client *client, rtc_event *events, int max);
+
+// receives unwrapped payloads of both framings, takes precedence over the
+// message received callback, type is NULL for untyped messages
+void rtc_client_set_payload_received_callback(
+    rtc_client *client,
+    void (*on_payload_received)(int id, const char *type, const char *payload,
+                                int size, void *ptr));
+
+// single client API, operates on a process wide default client
 void rtc_initialize(const char **stun_servers, int stun_servers_count,
                     const char *ws_url, const char *username, const char *room,
-                    pthread_mutex_t *lock, pthread_cond_t *cond, int *ws_joined,
-                    int *ws_ret_code);
+                    int max_peers, pthread_mutex_t *lock, pthread_cond_t *cond,
+                    int *ws_joined, int *ws_ret_code);
 void rtc_handle_connection();
 void rtc_send_message(const char *message);
 void rtc_send_typed_object(const char *type, json_object *obj);
+void rtc_send_typed_object_at(const char *type, json_object *obj, double x,
+                              double y);
+int rtc_set_peer_interest(int id, double x, double y, double radius);
+int rtc_set_inbox(int capacity);
+int rtc_poll(rtc_event *events, int max);
+int rtc_get_peer_stats(int id, struct rtc_peer_stats *stats);
 
 void rtc_set_message_opened_callback(void (*on_message_opened)(int id,
                                                                void *ptr));
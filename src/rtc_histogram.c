@@ -0,0 +1,71 @@
+#include "rtc_histogram.h"
+
+// values of 2^e up to 2^(e + 1) share a sub-bucket per 2^(e - SUB_BITS)
+static int bucketOf(uint64_t value) {
+    if (value < RTC_HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - RTC_HISTOGRAM_SUB_BITS)) &
+              (RTC_HISTOGRAM_SUB_BUCKETS - 1);
+    int bucket = (exponent - RTC_HISTOGRAM_SUB_BITS + 1) *
+                     RTC_HISTOGRAM_SUB_BUCKETS +
+                 sub;
+    return bucket < RTC_HISTOGRAM_BUCKETS ? bucket : RTC_HISTOGRAM_BUCKETS - 1;
+}
+
+// largest value that falls into bucket
+static uint64_t upperBound(int bucket) {
+    if (bucket < RTC_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / RTC_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t first = (uint64_t)(RTC_HISTOGRAM_SUB_BUCKETS +
+                                bucket % RTC_HISTOGRAM_SUB_BUCKETS)
+                     << shift;
+    return first + ((uint64_t)1 << shift) - 1;
+}
+
+void rtc_histogram_record(struct rtc_histogram *histogram, uint64_t value) {
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->count++;
+    histogram->total += value;
+    histogram->buckets[bucketOf(value)]++;
+}
+
+void rtc_histogram_merge(struct rtc_histogram *histogram,
+                         const struct rtc_histogram *from) {
+    if (from->count == 0)
+        return;
+    if (histogram->count == 0 || from->min < histogram->min)
+        histogram->min = from->min;
+    if (from->max > histogram->max)
+        histogram->max = from->max;
+    histogram->count += from->count;
+    histogram->total += from->total;
+    for (int i = 0; i < RTC_HISTOGRAM_BUCKETS; i++)
+        histogram->buckets[i] += from->buckets[i];
+}
+
+uint64_t rtc_histogram_percentile(const struct rtc_histogram *histogram,
+                                  double p) {
+    if (histogram->count == 0)
+        return 0;
+
+    uint64_t rank = p * histogram->count;
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < RTC_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen < rank)
+            continue;
+        // the bucket's upper bound, but never past what was recorded
+        uint64_t bound = upperBound(i);
+        if (bound > histogram->max || i == RTC_HISTOGRAM_BUCKETS - 1)
+            bound = histogram->max;
+        return bound > histogram->min ? bound : histogram->min;
+    }
+    return histogram->max;
+}
@@ -0,0 +1,35 @@
+#ifndef RTC_HISTOGRAM_H
+#define RTC_HISTOGRAM_H
+
+#include <stdint.h>
+
+// every power of two is split into this many linear sub-buckets, values
+// below it get a bucket each
+#define RTC_HISTOGRAM_SUB_BITS 4
+#define RTC_HISTOGRAM_SUB_BUCKETS (1 << RTC_HISTOGRAM_SUB_BITS)
+// values up to 2^40 get their own bucket, the last one counts everything
+// above
+#define RTC_HISTOGRAM_MAX_BITS 40
+#define RTC_HISTOGRAM_BUCKETS                                                  \
+    ((RTC_HISTOGRAM_MAX_BITS - RTC_HISTOGRAM_SUB_BITS + 1) *                   \
+     RTC_HISTOGRAM_SUB_BUCKETS)
+
+// log-linear distribution of latencies, zeroed is empty
+struct rtc_histogram {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[RTC_HISTOGRAM_BUCKETS];
+};
+
+void rtc_histogram_record(struct rtc_histogram *histogram, uint64_t value);
+// adds everything recorded in from to histogram
+void rtc_histogram_merge(struct rtc_histogram *histogram,
+                         const struct rtc_histogram *from);
+// upper bound of the value below which the fraction p of the recorded ones
+// lie, at most 1/16th above the exact percentile, 0 for an empty histogram
+uint64_t rtc_histogram_percentile(const struct rtc_histogram *histogram,
+                                  double p);
+
+#endif // RTC_HISTOGRAM_H
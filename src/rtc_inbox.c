@@ -0,0 +1,88 @@
+#include "rtc_inbox.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+int rtc_inbox_init(struct rtc_inbox *inbox, int capacity) {
+    size_t count = 2;
+    while (count < (size_t)capacity)
+        count <<= 1;
+
+    inbox->slots = calloc(count, sizeof(struct rtc_inbox_slot));
+    if (inbox->slots == NULL)
+        return -1;
+
+    inbox->mask = count - 1;
+    for (size_t i = 0; i < count; i++)
+        atomic_init(&inbox->slots[i].sequence, i);
+    atomic_init(&inbox->head, 0);
+    atomic_init(&inbox->dropped, 0);
+    inbox->tail = 0;
+    inbox->released = 0;
+    return 0;
+}
+
+void rtc_inbox_free(struct rtc_inbox *inbox) {
+    if (inbox->slots == NULL)
+        return;
+    for (size_t i = 0; i <= inbox->mask; i++)
+        rtc_buffer_free(&inbox->slots[i].data);
+    free(inbox->slots);
+    inbox->slots = NULL;
+}
+
+struct rtc_inbox_slot *rtc_inbox_claim(struct rtc_inbox *inbox) {
+    size_t pos = atomic_load_explicit(&inbox->head, memory_order_relaxed);
+    for (;;) {
+        struct rtc_inbox_slot *slot = &inbox->slots[pos & inbox->mask];
+        size_t seq =
+            atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // our turn, unless another producer got here first
+            if (atomic_compare_exchange_weak_explicit(
+                    &inbox->head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                slot->position = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            // the consumer has not handed this slot back yet
+            atomic_fetch_add_explicit(&inbox->dropped, 1,
+                                      memory_order_relaxed);
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&inbox->head, memory_order_relaxed);
+        }
+    }
+}
+
+void rtc_inbox_publish(struct rtc_inbox_slot *slot) {
+    atomic_store_explicit(&slot->sequence, slot->position + 1,
+                          memory_order_release);
+}
+
+struct rtc_inbox_slot *rtc_inbox_next(struct rtc_inbox *inbox) {
+    struct rtc_inbox_slot *slot = &inbox->slots[inbox->tail & inbox->mask];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (seq != inbox->tail + 1)
+        return NULL;
+
+    inbox->tail++;
+    return slot;
+}
+
+void rtc_inbox_recycle(struct rtc_inbox *inbox,
+                       void (*release)(struct rtc_inbox_slot *slot, void *arg),
+                       void *arg) {
+    for (; inbox->released != inbox->tail; inbox->released++) {
+        struct rtc_inbox_slot *slot =
+            &inbox->slots[inbox->released & inbox->mask];
+        if (release != NULL)
+            release(slot, arg);
+        atomic_store_explicit(&slot->sequence,
+                              inbox->released + inbox->mask + 1,
+                              memory_order_release);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef RTC_INBOX_H
+#define RTC_INBOX_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <uuid/uuid.h>
+
+#include "rtc_buffer.h"
+
+// bounded lock-free queue carrying events from libdatachannel's threads to a
+// single consumer thread
+//
+// every slot has a sequence number telling whose turn it is: producers claim
+// a slot by advancing head with a compare and swap, fill it and publish it,
+// the consumer reads published slots in order and hands them back once the
+// application is done with them, a full inbox refuses new events instead of
+// blocking the network threads
+struct rtc_inbox_slot {
+    atomic_size_t sequence;
+    size_t position;
+
+    int kind;
+    int id;
+    char peer[UUID_STR_LEN];
+    void *context;
+    // payload and type, each NUL terminated, keeps its storage between uses
+    struct rtc_buffer data;
+    int size;
+    // -1 when there is no type
+    int typeOffset;
+};
+
+struct rtc_inbox {
+    struct rtc_inbox_slot *slots;
+    size_t mask;
+    // events refused because the inbox was full
+    atomic_size_t dropped;
+
+    // producers, on its own cache line so the consumer doesn't contend
+    _Alignas(64) atomic_size_t head;
+    // consumer only, next slot to read and oldest slot not handed back
+    _Alignas(64) size_t tail;
+    size_t released;
+};
+
+// capacity is rounded up to a power of two
+int rtc_inbox_init(struct rtc_inbox *inbox, int capacity);
+void rtc_inbox_free(struct rtc_inbox *inbox);
+
+// producer side, safe from any thread, every claimed slot must be published
+struct rtc_inbox_slot *rtc_inbox_claim(struct rtc_inbox *inbox);
+void rtc_inbox_publish(struct rtc_inbox_slot *slot);
+
+// consumer side, next published slot in order, or NULL if there is none
+struct rtc_inbox_slot *rtc_inbox_next(struct rtc_inbox *inbox);
+// hands every slot returned by rtc_inbox_next back to the producers, release
+// is called on each of them first unless it is NULL
+void rtc_inbox_recycle(struct rtc_inbox *inbox,
+                       void (*release)(struct rtc_inbox_slot *slot, void *arg),
+                       void *arg);
+
+#endif // RTC_INBOX_H
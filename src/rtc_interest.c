@@ -0,0 +1,142 @@
+#include "rtc_interest.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static int64_t cellOf(const struct rtc_interest_grid *grid, double value) {
+    return (int64_t)floor(value / grid->cellSize);
+}
+
+static unsigned int bucketOf(const struct rtc_interest_grid *grid,
+                             int64_t cell_x, int64_t cell_y) {
+    uint64_t hash = (uint64_t)cell_x * 0x9E3779B97F4A7C15ull ^
+                    (uint64_t)cell_y * 0xC2B2AE3D27D4EB4Full;
+    return (unsigned int)(hash >> 32) & (grid->bucketCount - 1);
+}
+
+// counting sort of the entries by bucket
+static int buildIndex(struct rtc_interest_grid *grid) {
+    int bucket_count = 1;
+    while (bucket_count < grid->count)
+        bucket_count <<= 1;
+    if (bucket_count != grid->bucketCount) {
+        int *starts = realloc(grid->starts, (bucket_count + 1) * sizeof(int));
+        if (starts == NULL)
+            return -1;
+        grid->starts = starts;
+        grid->bucketCount = bucket_count;
+    }
+
+    for (int b = 0; b <= grid->bucketCount; b++)
+        grid->starts[b] = 0;
+    for (int i = 0; i < grid->count; i++) {
+        struct rtc_interest_entry *entry = &grid->entries[i];
+        entry->cellX = cellOf(grid, entry->x);
+        entry->cellY = cellOf(grid, entry->y);
+        grid->starts[bucketOf(grid, entry->cellX, entry->cellY) + 1]++;
+    }
+    for (int b = 0; b < grid->bucketCount; b++)
+        grid->starts[b + 1] += grid->starts[b];
+    // starts[b] runs ahead while filling and ends up at the start of b + 1
+    for (int i = 0; i < grid->count; i++) {
+        struct rtc_interest_entry *entry = &grid->entries[i];
+        unsigned int b = bucketOf(grid, entry->cellX, entry->cellY);
+        grid->cells[grid->starts[b]++] = *entry;
+    }
+    for (int b = grid->bucketCount; b > 0; b--)
+        grid->starts[b] = grid->starts[b - 1];
+    grid->starts[0] = 0;
+
+    grid->indexed = true;
+    return 0;
+}
+
+static bool covers(const struct rtc_interest_entry *entry, double x,
+                   double y) {
+    double dx = entry->x - x;
+    double dy = entry->y - y;
+    return dx * dx + dy * dy <= entry->radius * entry->radius;
+}
+
+void rtc_interest_init(struct rtc_interest_grid *grid, double cell_size) {
+    *grid = (struct rtc_interest_grid){.cellSize = cell_size};
+}
+
+void rtc_interest_free(struct rtc_interest_grid *grid) {
+    free(grid->entries);
+    free(grid->cells);
+    free(grid->starts);
+    rtc_interest_init(grid, grid->cellSize);
+}
+
+void rtc_interest_reset(struct rtc_interest_grid *grid) {
+    grid->count = 0;
+    grid->maxRadius = 0;
+    grid->indexed = false;
+}
+
+int rtc_interest_add(struct rtc_interest_grid *grid, double x, double y,
+                     double radius, void *item) {
+    if (grid->count == grid->capacity) {
+        int capacity = grid->capacity > 0 ? grid->capacity * 2 : 16;
+        struct rtc_interest_entry *entries =
+            realloc(grid->entries, capacity * sizeof(*entries));
+        if (entries == NULL)
+            return -1;
+        grid->entries = entries;
+        struct rtc_interest_entry *cells =
+            realloc(grid->cells, capacity * sizeof(*cells));
+        if (cells == NULL)
+            return -1;
+        grid->cells = cells;
+        grid->capacity = capacity;
+    }
+
+    grid->entries[grid->count++] = (struct rtc_interest_entry){
+        .x = x,
+        .y = y,
+        .radius = radius,
+        .item = item,
+    };
+    if (radius > grid->maxRadius)
+        grid->maxRadius = radius;
+    grid->indexed = false;
+    return 0;
+}
+
+int rtc_interest_query(struct rtc_interest_grid *grid, double x, double y,
+                       void (*visit)(void *item, void *arg), void *arg) {
+    if (grid->count == 0)
+        return 0;
+    if (!grid->indexed && buildIndex(grid) != 0)
+        return -1;
+
+    int64_t min_x = cellOf(grid, x - grid->maxRadius);
+    int64_t max_x = cellOf(grid, x + grid->maxRadius);
+    int64_t min_y = cellOf(grid, y - grid->maxRadius);
+    int64_t max_y = cellOf(grid, y + grid->maxRadius);
+    // a radius spanning more cells than there are entries is cheaper to
+    // answer by looking at every entry
+    double span = (double)(max_x - min_x + 1) * (double)(max_y - min_y + 1);
+    if (span > grid->count) {
+        for (int i = 0; i < grid->count; i++) {
+            if (covers(&grid->entries[i], x, y))
+                visit(grid->entries[i].item, arg);
+        }
+        return 0;
+    }
+
+    for (int64_t cell_x = min_x; cell_x <= max_x; cell_x++) {
+        for (int64_t cell_y = min_y; cell_y <= max_y; cell_y++) {
+            unsigned int b = bucketOf(grid, cell_x, cell_y);
+            for (int i = grid->starts[b]; i < grid->starts[b + 1]; i++) {
+                const struct rtc_interest_entry *entry = &grid->cells[i];
+                // other cells share the bucket
+                if (entry->cellX == cell_x && entry->cellY == cell_y &&
+                    covers(entry, x, y))
+                    visit(entry->item, arg);
+            }
+        }
+    }
+    return 0;
+}
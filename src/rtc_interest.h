@@ -0,0 +1,52 @@
+#ifndef RTC_INTEREST_H
+#define RTC_INTEREST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// circle of interest around a position, item is left to the caller
+struct rtc_interest_entry {
+    double x;
+    double y;
+    double radius;
+    void *item;
+    // cell of the position, filled in by the grid
+    int64_t cellX;
+    int64_t cellY;
+};
+
+// finds the entries whose circle covers a point
+//
+// entries are hashed by the cell of their position, a query only visits the
+// cells within the largest radius of the point, so cells about as large as
+// a typical radius keep that to a handful, the index is built on the first
+// query after entries were added
+struct rtc_interest_grid {
+    double cellSize;
+    double maxRadius;
+    // as added
+    struct rtc_interest_entry *entries;
+    // grouped by bucket, bucket b holds cells[starts[b]] up to
+    // cells[starts[b + 1]]
+    struct rtc_interest_entry *cells;
+    int count;
+    int capacity;
+    int *starts;
+    // power of two
+    int bucketCount;
+    bool indexed;
+};
+
+void rtc_interest_init(struct rtc_interest_grid *grid, double cell_size);
+void rtc_interest_free(struct rtc_interest_grid *grid);
+
+// drops every entry, keeps the memory for the next ones
+void rtc_interest_reset(struct rtc_interest_grid *grid);
+int rtc_interest_add(struct rtc_interest_grid *grid, double x, double y,
+                     double radius, void *item);
+// calls visit with the item of every entry within its radius of (x, y),
+// -1 if the index could not be built
+int rtc_interest_query(struct rtc_interest_grid *grid, double x, double y,
+                       void (*visit)(void *item, void *arg), void *arg);
+
+#endif // RTC_INTEREST_H
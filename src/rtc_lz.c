@@ -0,0 +1,206 @@
+#include "rtc_lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define SIZE_HEADER 4
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash(uint32_t v, int bits) {
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+static unsigned char *writeLength(unsigned char *op, size_t length) {
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+// a match_length below 0 ends the block with literals only
+static unsigned char *writeSequence(unsigned char *op, unsigned char *end,
+                                    const unsigned char *literals,
+                                    size_t literal_length, int offset,
+                                    int match_length) {
+    size_t needed = 1 + literal_length + literal_length / 255 + 1;
+    if (match_length >= 0)
+        needed += 2 + match_length / 255 + 1;
+    if ((size_t)(end - op) < needed)
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15)
+        op = writeLength(op, literal_length - 15);
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length < 0)
+        return op;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15)
+        op = writeLength(op, match_length - 15);
+    return op;
+}
+
+size_t rtc_lz_bound(size_t size) { return size + size / 255 + 16; }
+
+int rtc_lz_compress(const char *src, int size, char *dst, int capacity) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *end = base + size;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + capacity;
+
+    // positions plus one, so a zeroed table is empty, small inputs only
+    // clear as much of it as they can fill
+    int table[1 << HASH_BITS];
+    int bits = 8;
+    while (bits < HASH_BITS && 1 << bits < size)
+        bits++;
+    memset(table, 0, sizeof(int) << bits);
+
+    while (size >= MIN_MATCH && ip <= end - MIN_MATCH) {
+        uint32_t sequence = read32(ip);
+        int h = hash(sequence, bits);
+        int candidate = table[h] - 1;
+        table[h] = ip - base + 1;
+
+        if (candidate < 0 || ip - base - candidate > MAX_OFFSET ||
+            read32(base + candidate) != sequence) {
+            // skip ahead faster the longer nothing matched, incompressible
+            // data then costs little
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        const unsigned char *match = base + candidate + MIN_MATCH;
+        const unsigned char *p = ip + MIN_MATCH;
+        while (p < end && *p == *match) {
+            p++;
+            match++;
+        }
+
+        op = writeSequence(op, op_end, anchor, ip - anchor,
+                           ip - base - candidate, p - ip - MIN_MATCH);
+        if (op == NULL)
+            return -1;
+        ip = anchor = p;
+    }
+
+    op = writeSequence(op, op_end, anchor, end - anchor, 0, -1);
+    return op != NULL ? (int)(op - (unsigned char *)dst) : -1;
+}
+
+static int readLength(const unsigned char **ip, const unsigned char *end,
+                      size_t *length) {
+    unsigned char b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 0;
+}
+
+int rtc_lz_decompress(const char *src, int size, char *dst, int capacity) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + size;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned char *op = out;
+    unsigned char *op_end = out + capacity;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && readLength(&ip, end, &literal_length) != 0)
+            return -1;
+        if (literal_length > (size_t)(end - ip) ||
+            literal_length > (size_t)(op_end - op))
+            return -1;
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out))
+            return -1;
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && readLength(&ip, end, &match_length) != 0)
+            return -1;
+        match_length += MIN_MATCH;
+        if (match_length > (size_t)(op_end - op))
+            return -1;
+
+        const unsigned char *match = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, match, match_length);
+            op += match_length;
+        } else {
+            // overlapping copies repeat the last offset bytes
+            for (size_t i = 0; i < match_length; i++)
+                *op++ = *match++;
+        }
+    }
+    return op - out;
+}
+
+int rtc_lz_pack(const char *src, int size, struct rtc_buffer *out) {
+    // anything that doesn't save at least a byte is not worth it
+    int capacity = size - SIZE_HEADER - 1;
+    if (capacity <= 0 ||
+        rtc_buffer_reserve(out, out->size + SIZE_HEADER + capacity) != 0)
+        return -1;
+
+    unsigned char *header = (unsigned char *)out->data + out->size;
+    int written =
+        rtc_lz_compress(src, size, (char *)header + SIZE_HEADER, capacity);
+    if (written < 0)
+        return -1;
+
+    header[0] = (uint32_t)size >> 24;
+    header[1] = (uint32_t)size >> 16;
+    header[2] = (uint32_t)size >> 8;
+    header[3] = (uint32_t)size;
+    out->size += SIZE_HEADER + written;
+    return 0;
+}
+
+int rtc_lz_unpack(const char *src, int size, struct rtc_buffer *out,
+                  size_t limit) {
+    if (size < SIZE_HEADER)
+        return -1;
+
+    const unsigned char *header = (const unsigned char *)src;
+    size_t original = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 |
+                      (uint32_t)header[2] << 8 | header[3];
+    if (original > limit ||
+        rtc_buffer_reserve(out, out->size + original) != 0)
+        return -1;
+
+    int written = rtc_lz_decompress(src + SIZE_HEADER, size - SIZE_HEADER,
+                                    out->data + out->size, original);
+    if (written < 0 || (size_t)written != original)
+        return -1;
+    out->size += written;
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef RTC_LZ_H
+#define RTC_LZ_H
+
+#include <stddef.h>
+
+#include "rtc_buffer.h"
+
+// byte oriented LZ77 codec in the spirit of LZ4, fast enough to run on every
+// message and without any dependency
+//
+// a block is a sequence of | token (1) | literals | offset (2) | where the
+// token's high nibble holds the literal length and its low nibble the match
+// length minus 4, a nibble of 15 continues in the following bytes, each
+// adding up to 255, offsets are little endian and the last sequence has
+// literals only
+
+// largest block size bytes of input can compress to
+size_t rtc_lz_bound(size_t size);
+// returns the size of the block written to dst, or -1 if it doesn't fit
+// into capacity bytes
+int rtc_lz_compress(const char *src, int size, char *dst, int capacity);
+// returns the size of the data written to dst, or -1 if the block is
+// malformed or doesn't fit into capacity bytes
+int rtc_lz_decompress(const char *src, int size, char *dst, int capacity);
+
+// appends the original size as a 4 byte big endian integer followed by the
+// block, fails unless that comes out smaller than the input
+int rtc_lz_pack(const char *src, int size, struct rtc_buffer *out);
+// appends what was packed, fails if that would be more than limit bytes
+int rtc_lz_unpack(const char *src, int size, struct rtc_buffer *out,
+                  size_t limit);
+
+#endif // RTC_LZ_H
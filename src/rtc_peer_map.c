@@ -0,0 +1,116 @@
+#include "rtc_peer_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+unsigned int rtc_peer_map_hash(const char *key) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int findBucket(const struct rtc_peer_map *map, const char *key) {
+    unsigned int i = rtc_peer_map_hash(key) & map->mask;
+    while (map->buckets[i].key != NULL) {
+        if (strcmp(map->buckets[i].key, key) == 0)
+            return i;
+        i = (i + 1) & map->mask;
+    }
+    return -1;
+}
+
+static void insertBucket(struct rtc_peer_map *map,
+                         const struct rtc_peer_map_entry *entry) {
+    unsigned int i = rtc_peer_map_hash(entry->key) & map->mask;
+    while (map->buckets[i].key != NULL)
+        i = (i + 1) & map->mask;
+    map->buckets[i] = *entry;
+}
+
+static int grow(struct rtc_peer_map *map, int bucket_count) {
+    struct rtc_peer_map_entry *old = map->buckets;
+    int old_count = old != NULL ? map->mask + 1 : 0;
+
+    map->buckets = calloc(bucket_count, sizeof(struct rtc_peer_map_entry));
+    if (map->buckets == NULL) {
+        map->buckets = old;
+        return -1;
+    }
+    map->mask = bucket_count - 1;
+
+    for (int i = 0; i < old_count; i++) {
+        if (old[i].key != NULL)
+            insertBucket(map, &old[i]);
+    }
+    free(old);
+    return 0;
+}
+
+int rtc_peer_map_init(struct rtc_peer_map *map, int capacity) {
+    map->buckets = NULL;
+    map->count = 0;
+    map->mask = 0;
+
+    int bucket_count = 16;
+    while (bucket_count < capacity * 2)
+        bucket_count <<= 1;
+    return grow(map, bucket_count);
+}
+
+void rtc_peer_map_free(struct rtc_peer_map *map) {
+    free(map->buckets);
+    map->buckets = NULL;
+    map->count = 0;
+    map->mask = 0;
+}
+
+int rtc_peer_map_put(struct rtc_peer_map *map, const char *key,
+                     struct rtc_peer *peer) {
+    if (findBucket(map, key) >= 0)
+        return -1;
+    // keep the load factor at or below one half
+    if ((map->count + 1) * 2 > map->mask + 1 &&
+        grow(map, (map->mask + 1) * 2) != 0)
+        return -1;
+
+    struct rtc_peer_map_entry entry = { key, peer };
+    insertBucket(map, &entry);
+    map->count++;
+    return 0;
+}
+
+struct rtc_peer *rtc_peer_map_get(const struct rtc_peer_map *map,
+                                  const char *key) {
+    int bucket = findBucket(map, key);
+    return bucket >= 0 ? map->buckets[bucket].peer : NULL;
+}
+
+struct rtc_peer *rtc_peer_map_remove(struct rtc_peer_map *map,
+                                     const char *key) {
+    int bucket = findBucket(map, key);
+    if (bucket < 0)
+        return NULL;
+
+    struct rtc_peer *peer = map->buckets[bucket].peer;
+
+    // backward shift deletion, same as the peer table
+    unsigned int hole = bucket;
+    unsigned int i = (hole + 1) & map->mask;
+    while (map->buckets[i].key != NULL) {
+        unsigned int home = rtc_peer_map_hash(map->buckets[i].key) & map->mask;
+        if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+            map->buckets[hole] = map->buckets[i];
+            hole = i;
+        }
+        i = (i + 1) & map->mask;
+    }
+    map->buckets[hole].key = NULL;
+    map->buckets[hole].peer = NULL;
+    map->count--;
+
+    return peer;
+}
@@ -0,0 +1,36 @@
+#ifndef RTC_PEER_MAP_H
+#define RTC_PEER_MAP_H
+
+struct rtc_peer;
+
+// every peer of a client keyed by remote UUID, from the first signaling
+// message until the connection is torn down
+//
+// keys are not copied, they have to stay valid while the peer is mapped
+struct rtc_peer_map_entry {
+    const char *key;
+    struct rtc_peer *peer;
+};
+
+struct rtc_peer_map {
+    struct rtc_peer_map_entry *buckets;
+    int count;
+    int mask;
+};
+
+int rtc_peer_map_init(struct rtc_peer_map *map, int capacity);
+void rtc_peer_map_free(struct rtc_peer_map *map);
+
+// returns -1 if the key is already present or the map could not grow
+int rtc_peer_map_put(struct rtc_peer_map *map, const char *key,
+                     struct rtc_peer *peer);
+struct rtc_peer *rtc_peer_map_get(const struct rtc_peer_map *map,
+                                  const char *key);
+// returns the removed peer, or NULL if key was not in the map
+struct rtc_peer *rtc_peer_map_remove(struct rtc_peer_map *map,
+                                     const char *key);
+
+// FNV-1a of key, also used for the client's other string tables
+unsigned int rtc_peer_map_hash(const char *key);
+
+#endif // RTC_PEER_MAP_H
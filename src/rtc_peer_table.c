@@ -0,0 +1,134 @@
+#include "rtc_peer_table.h"
+
+#include <stdlib.h>
+
+#define EMPTY -1
+
+static unsigned int hashId(int id) {
+    // ids are small sequential integers, spread them over the buckets
+    return (unsigned int)id * 2654435761u;
+}
+
+static int findBucket(const struct rtc_peer_table *table, int id) {
+    unsigned int i = hashId(id) & table->mask;
+    while (table->buckets[i] != EMPTY) {
+        if (table->ids[table->buckets[i]] == id)
+            return i;
+        i = (i + 1) & table->mask;
+    }
+    return -1;
+}
+
+static void insertBucket(struct rtc_peer_table *table, int slot) {
+    unsigned int i = hashId(table->ids[slot]) & table->mask;
+    while (table->buckets[i] != EMPTY)
+        i = (i + 1) & table->mask;
+    table->buckets[i] = slot;
+}
+
+static int grow(struct rtc_peer_table *table, int capacity) {
+    struct rtc_peer **peers =
+        realloc(table->peers, capacity * sizeof(struct rtc_peer *));
+    if (peers == NULL)
+        return -1;
+    table->peers = peers;
+
+    int *ids = realloc(table->ids, capacity * sizeof(int));
+    if (ids == NULL)
+        return -1;
+    table->ids = ids;
+
+    // keep the load factor at or below one half
+    int bucket_count = 1;
+    while (bucket_count < capacity * 2)
+        bucket_count <<= 1;
+    int *buckets = malloc(bucket_count * sizeof(int));
+    if (buckets == NULL)
+        return -1;
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->mask = bucket_count - 1;
+    table->capacity = capacity;
+    for (int i = 0; i < bucket_count; i++)
+        table->buckets[i] = EMPTY;
+    for (int slot = 0; slot < table->count; slot++)
+        insertBucket(table, slot);
+
+    return 0;
+}
+
+int rtc_peer_table_init(struct rtc_peer_table *table, int capacity) {
+    table->peers = NULL;
+    table->ids = NULL;
+    table->buckets = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->mask = 0;
+    return grow(table, capacity > 0 ? capacity : 8);
+}
+
+void rtc_peer_table_free(struct rtc_peer_table *table) {
+    free(table->peers);
+    free(table->ids);
+    free(table->buckets);
+    table->peers = NULL;
+    table->ids = NULL;
+    table->buckets = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
+
+int rtc_peer_table_add(struct rtc_peer_table *table, int id,
+                       struct rtc_peer *peer) {
+    if (findBucket(table, id) >= 0)
+        return -1;
+    if (table->count == table->capacity &&
+        grow(table, table->capacity * 2) != 0)
+        return -1;
+
+    int slot = table->count++;
+    table->peers[slot] = peer;
+    table->ids[slot] = id;
+    insertBucket(table, slot);
+    return 0;
+}
+
+struct rtc_peer *rtc_peer_table_get(const struct rtc_peer_table *table,
+                                    int id) {
+    int bucket = findBucket(table, id);
+    return bucket >= 0 ? table->peers[table->buckets[bucket]] : NULL;
+}
+
+struct rtc_peer *rtc_peer_table_remove(struct rtc_peer_table *table, int id) {
+    int bucket = findBucket(table, id);
+    if (bucket < 0)
+        return NULL;
+
+    int slot = table->buckets[bucket];
+    struct rtc_peer *peer = table->peers[slot];
+
+    // backward shift deletion keeps probe sequences intact without
+    // tombstones
+    unsigned int hole = bucket;
+    unsigned int i = (hole + 1) & table->mask;
+    while (table->buckets[i] != EMPTY) {
+        unsigned int home = hashId(table->ids[table->buckets[i]]) & table->mask;
+        if (((i - home) & table->mask) >= ((i - hole) & table->mask)) {
+            table->buckets[hole] = table->buckets[i];
+            hole = i;
+        }
+        i = (i + 1) & table->mask;
+    }
+    table->buckets[hole] = EMPTY;
+
+    // move the last peer into the freed slot to keep the array dense
+    int last = --table->count;
+    if (slot != last) {
+        table->peers[slot] = table->peers[last];
+        table->ids[slot] = table->ids[last];
+        table->buckets[findBucket(table, table->ids[slot])] = slot;
+    }
+
+    return peer;
+}
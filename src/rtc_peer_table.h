@@ -0,0 +1,32 @@
+#ifndef RTC_PEER_TABLE_H
+#define RTC_PEER_TABLE_H
+
+struct rtc_peer;
+
+// peers with an open data channel, keyed by data channel id
+//
+// peers are kept densely packed for broadcasting, and an open addressing
+// index maps channel ids to their slot so add, lookup and remove are all
+// constant time
+struct rtc_peer_table {
+    struct rtc_peer **peers;
+    int *ids;
+    int count;
+    int capacity;
+
+    // linear probing buckets holding dense slots, -1 when empty
+    int *buckets;
+    int mask;
+};
+
+int rtc_peer_table_init(struct rtc_peer_table *table, int capacity);
+void rtc_peer_table_free(struct rtc_peer_table *table);
+
+// returns -1 if the id is already present or the table could not grow
+int rtc_peer_table_add(struct rtc_peer_table *table, int id,
+                       struct rtc_peer *peer);
+struct rtc_peer *rtc_peer_table_get(const struct rtc_peer_table *table, int id);
+// returns the removed peer, or NULL if id was not in the table
+struct rtc_peer *rtc_peer_table_remove(struct rtc_peer_table *table, int id);
+
+#endif // RTC_PEER_TABLE_H
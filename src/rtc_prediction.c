@@ -0,0 +1,89 @@
+#include "rtc_prediction.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// whether sequence a comes before b, sequence numbers wrap around
+static bool before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+static int slotOf(const struct rtc_prediction *prediction, int i) {
+    return (prediction->head + i) % prediction->capacity;
+}
+
+int rtc_prediction_init(struct rtc_prediction *prediction, const void *initial,
+                        int state_size, int input_size, int capacity,
+                        rtc_prediction_apply apply, void *arg) {
+    *prediction = (struct rtc_prediction){
+        .stateSize = state_size,
+        .inputSize = input_size,
+        .capacity = capacity,
+        .apply = apply,
+        .arg = arg,
+        .nextSequence = 1,
+    };
+    if (state_size <= 0 || input_size <= 0 || capacity <= 0)
+        return -1;
+    prediction->state = malloc(state_size);
+    prediction->sequences = malloc(capacity * sizeof(uint32_t));
+    prediction->inputs = malloc((size_t)capacity * input_size);
+    if (prediction->state == NULL || prediction->sequences == NULL ||
+        prediction->inputs == NULL) {
+        rtc_prediction_free(prediction);
+        return -1;
+    }
+    memcpy(prediction->state, initial, state_size);
+    return 0;
+}
+
+void rtc_prediction_free(struct rtc_prediction *prediction) {
+    free(prediction->state);
+    free(prediction->sequences);
+    free(prediction->inputs);
+    prediction->state = NULL;
+    prediction->sequences = NULL;
+    prediction->inputs = NULL;
+    prediction->count = 0;
+}
+
+uint32_t rtc_prediction_input(struct rtc_prediction *prediction,
+                              const void *input) {
+    if (prediction->count == prediction->capacity) {
+        // a correction past it will be off by what it did
+        prediction->head = slotOf(prediction, 1);
+        prediction->count--;
+    }
+
+    int slot = slotOf(prediction, prediction->count++);
+    uint32_t sequence = prediction->nextSequence++;
+    if (prediction->nextSequence == 0)
+        prediction->nextSequence = 1;
+    prediction->sequences[slot] = sequence;
+    memcpy(&prediction->inputs[(size_t)slot * prediction->inputSize], input,
+           prediction->inputSize);
+
+    prediction->apply(prediction->state, input, prediction->arg);
+    return sequence;
+}
+
+int rtc_prediction_reconcile(struct rtc_prediction *prediction,
+                             uint32_t sequence, const void *state) {
+    if (before(sequence, prediction->acknowledged))
+        return -1;
+    prediction->acknowledged = sequence;
+
+    while (prediction->count > 0 &&
+           !before(sequence, prediction->sequences[prediction->head])) {
+        prediction->head = slotOf(prediction, 1);
+        prediction->count--;
+    }
+
+    memcpy(prediction->state, state, prediction->stateSize);
+    for (int i = 0; i < prediction->count; i++) {
+        int slot = slotOf(prediction, i);
+        prediction->apply(
+            prediction->state,
+            &prediction->inputs[(size_t)slot * prediction->inputSize],
+            prediction->arg);
+    }
+    return 0;
+}
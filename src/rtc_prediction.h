@@ -0,0 +1,54 @@
+#ifndef RTC_PREDICTION_H
+#define RTC_PREDICTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// applies one input to a state, must give the same result wherever it runs
+typedef void (*rtc_prediction_apply)(void *state, const void *input,
+                                     void *arg);
+
+// predicts a locally controlled state by applying inputs right away, and
+// corrects it once the authority reports the state after one of them by
+// replaying the inputs it has not seen yet
+//
+// everything is allocated by rtc_prediction_init, recording inputs and
+// reconciling never allocate
+struct rtc_prediction {
+    int stateSize;
+    int inputSize;
+    // inputs kept for replay, the oldest one is forgotten once more are
+    // waiting to be acknowledged
+    int capacity;
+    rtc_prediction_apply apply;
+    void *arg;
+    // every input recorded so far applied
+    void *state;
+    // sequence numbers start at 1, 0 stands for no input
+    uint32_t nextSequence;
+    uint32_t acknowledged;
+    // ring of count unacknowledged inputs, oldest first starting at head
+    int head;
+    int count;
+    uint32_t *sequences;
+    unsigned char *inputs;
+};
+
+// starts predicting from initial, a state of state_size bytes
+int rtc_prediction_init(struct rtc_prediction *prediction, const void *initial,
+                        int state_size, int input_size, int capacity,
+                        rtc_prediction_apply apply, void *arg);
+void rtc_prediction_free(struct rtc_prediction *prediction);
+
+// applies input to the predicted state and keeps it for replay, returns the
+// sequence number the authority acknowledges it with
+uint32_t rtc_prediction_input(struct rtc_prediction *prediction,
+                              const void *input);
+// state is the authoritative one after every input up to sequence, the
+// prediction restarts from it and replays the later inputs, -1 if an earlier
+// call already acknowledged a later input, which happens when states arrive
+// out of order
+int rtc_prediction_reconcile(struct rtc_prediction *prediction,
+                             uint32_t sequence, const void *state);
+
+#endif // RTC_PREDICTION_H
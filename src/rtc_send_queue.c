@@ -0,0 +1,65 @@
+#include "rtc_send_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 16
+
+static int grow(struct rtc_send_queue *queue) {
+    int capacity = queue->capacity > 0 ? queue->capacity * 2 : INITIAL_CAPACITY;
+    struct rtc_queued_message *slots =
+        calloc(capacity, sizeof(struct rtc_queued_message));
+    if (slots == NULL)
+        return -1;
+
+    // unwrap the ring, popped slots move along to keep their storage
+    for (int i = 0; i < queue->capacity; i++)
+        slots[i] = queue->slots[(queue->head + i) & (queue->capacity - 1)];
+
+    free(queue->slots);
+    queue->slots = slots;
+    queue->capacity = capacity;
+    queue->head = 0;
+    return 0;
+}
+
+void rtc_send_queue_init(struct rtc_send_queue *queue) {
+    memset(queue, 0, sizeof(struct rtc_send_queue));
+}
+
+void rtc_send_queue_free(struct rtc_send_queue *queue) {
+    for (int i = 0; i < queue->capacity; i++)
+        rtc_buffer_free(&queue->slots[i].data);
+    free(queue->slots);
+    rtc_send_queue_init(queue);
+}
+
+int rtc_send_queue_push(struct rtc_send_queue *queue, const char *data,
+                        size_t size, uint64_t now) {
+    if (queue->count == queue->capacity && grow(queue) != 0)
+        return -1;
+
+    struct rtc_queued_message *slot =
+        &queue->slots[(queue->head + queue->count) & (queue->capacity - 1)];
+    rtc_buffer_reset(&slot->data);
+    if (rtc_buffer_append(&slot->data, data, size) != 0)
+        return -1;
+    slot->queuedAt = now;
+
+    queue->count++;
+    queue->bytes += size;
+    return 0;
+}
+
+struct rtc_queued_message *rtc_send_queue_front(struct rtc_send_queue *queue) {
+    return queue->count > 0 ? &queue->slots[queue->head] : NULL;
+}
+
+void rtc_send_queue_pop(struct rtc_send_queue *queue) {
+    if (queue->count == 0)
+        return;
+
+    queue->bytes -= queue->slots[queue->head].data.size;
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    queue->count--;
+}
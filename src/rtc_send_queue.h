@@ -0,0 +1,41 @@
+#ifndef RTC_SEND_QUEUE_H
+#define RTC_SEND_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rtc_buffer.h"
+
+struct rtc_queued_message {
+    struct rtc_buffer data;
+    // caller supplied timestamp of the push
+    uint64_t queuedAt;
+};
+
+// FIFO of serialized messages waiting for a slow data channel
+//
+// slots form a ring and keep their buffers once popped, so a queue that
+// repeatedly fills and drains stops allocating after warming up
+struct rtc_send_queue {
+    struct rtc_queued_message *slots;
+    // power of two, 0 until the first push
+    int capacity;
+    int head;
+    int count;
+    // payload bytes of the queued messages
+    size_t bytes;
+    // messages refused or evicted since the queue was created
+    size_t dropped;
+};
+
+void rtc_send_queue_init(struct rtc_send_queue *queue);
+void rtc_send_queue_free(struct rtc_send_queue *queue);
+
+// copies data to the back of the queue
+int rtc_send_queue_push(struct rtc_send_queue *queue, const char *data,
+                        size_t size, uint64_t now);
+// oldest message, or NULL if the queue is empty
+struct rtc_queued_message *rtc_send_queue_front(struct rtc_send_queue *queue);
+void rtc_send_queue_pop(struct rtc_send_queue *queue);
+
+#endif // RTC_SEND_QUEUE_H
@@ -0,0 +1,94 @@
+#include "rtc_snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// ring position of the i-th oldest snapshot
+static int slotOf(const struct rtc_snapshot_buffer *buffer, int i) {
+    return (buffer->head + i) % buffer->capacity;
+}
+
+static void copySnapshot(struct rtc_snapshot_buffer *buffer, int to,
+                         int from) {
+    buffer->times[to] = buffer->times[from];
+    memcpy(&buffer->values[to * buffer->dims],
+           &buffer->values[from * buffer->dims],
+           buffer->dims * sizeof(double));
+}
+
+int rtc_snapshot_init(struct rtc_snapshot_buffer *buffer, int capacity,
+                      int dims) {
+    *buffer = (struct rtc_snapshot_buffer){
+        .dims = dims,
+        .capacity = capacity,
+    };
+    if (capacity <= 0 || dims <= 0)
+        return -1;
+    buffer->times = malloc(capacity * sizeof(uint64_t));
+    buffer->values = malloc(capacity * dims * sizeof(double));
+    if (buffer->times == NULL || buffer->values == NULL) {
+        rtc_snapshot_free(buffer);
+        return -1;
+    }
+    return 0;
+}
+
+void rtc_snapshot_free(struct rtc_snapshot_buffer *buffer) {
+    free(buffer->times);
+    free(buffer->values);
+    buffer->times = NULL;
+    buffer->values = NULL;
+    buffer->count = 0;
+}
+
+int rtc_snapshot_push(struct rtc_snapshot_buffer *buffer, uint64_t time,
+                      const double *values) {
+    // snapshots mostly arrive in order, so look from the newest
+    int i = buffer->count;
+    while (i > 0 && buffer->times[slotOf(buffer, i - 1)] > time)
+        i--;
+    if (i > 0 && buffer->times[slotOf(buffer, i - 1)] == time)
+        return -1;
+    if (buffer->count == buffer->capacity) {
+        if (i == 0)
+            return -1;
+        buffer->head = slotOf(buffer, 1);
+        buffer->count--;
+        i--;
+    }
+
+    for (int j = buffer->count; j > i; j--)
+        copySnapshot(buffer, slotOf(buffer, j), slotOf(buffer, j - 1));
+    int slot = slotOf(buffer, i);
+    buffer->times[slot] = time;
+    memcpy(&buffer->values[slot * buffer->dims], values,
+           buffer->dims * sizeof(double));
+    buffer->count++;
+    return 0;
+}
+
+int rtc_snapshot_sample(const struct rtc_snapshot_buffer *buffer,
+                        uint64_t time, double *values) {
+    if (buffer->count == 0)
+        return -1;
+
+    // newest snapshot not after time, rendering usually trails the newest
+    // by a few
+    int i = buffer->count - 1;
+    while (i > 0 && buffer->times[slotOf(buffer, i)] > time)
+        i--;
+    int from = slotOf(buffer, i);
+    const double *a = &buffer->values[from * buffer->dims];
+    if (i == buffer->count - 1 || buffer->times[from] > time) {
+        memcpy(values, a, buffer->dims * sizeof(double));
+        return time > buffer->times[from];
+    }
+
+    int to = slotOf(buffer, i + 1);
+    const double *b = &buffer->values[to * buffer->dims];
+    double t = (double)(time - buffer->times[from]) /
+               (double)(buffer->times[to] - buffer->times[from]);
+    for (int d = 0; d < buffer->dims; d++)
+        values[d] = a[d] + (b[d] - a[d]) * t;
+    return 0;
+}
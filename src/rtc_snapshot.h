@@ -0,0 +1,35 @@
+#ifndef RTC_SNAPSHOT_H
+#define RTC_SNAPSHOT_H
+
+#include <stdint.h>
+
+// timestamped states of one remote object, rendering them a little in the
+// past and interpolating in between hides the jitter they arrived with
+struct rtc_snapshot_buffer {
+    // values per snapshot
+    int dims;
+    int capacity;
+    // ring of count snapshots ordered by time, starting at head
+    int head;
+    int count;
+    uint64_t *times;
+    double *values;
+};
+
+int rtc_snapshot_init(struct rtc_snapshot_buffer *buffer, int capacity,
+                      int dims);
+void rtc_snapshot_free(struct rtc_snapshot_buffer *buffer);
+
+// snapshots may arrive out of order, a full buffer drops its oldest one, -1
+// if the snapshot is older than everything in a full buffer or its time is
+// already taken
+int rtc_snapshot_push(struct rtc_snapshot_buffer *buffer, uint64_t time,
+                      const double *values);
+// linearly interpolates the values at time between the snapshots around it,
+// outside of them the oldest or newest values are held, 1 when time is past
+// the newest snapshot, which means the render delay is too short to cover
+// the jitter, -1 if the buffer is empty
+int rtc_snapshot_sample(const struct rtc_snapshot_buffer *buffer,
+                        uint64_t time, double *values);
+
+#endif // RTC_SNAPSHOT_H
@@ -0,0 +1,92 @@
+#include "rtc_state.h"
+
+#include <string.h>
+
+void rtc_state_history_free(struct rtc_state_history *history) {
+    for (int i = 0; i < RTC_STATE_HISTORY; i++) {
+        if (history->states[i] != NULL)
+            json_object_put(history->states[i]);
+    }
+    memset(history, 0, sizeof(struct rtc_state_history));
+}
+
+void rtc_state_history_put(struct rtc_state_history *history, uint32_t seq,
+                           json_object *state) {
+    int slot = seq & (RTC_STATE_HISTORY - 1);
+    if (history->states[slot] != NULL)
+        json_object_put(history->states[slot]);
+    history->states[slot] = state;
+    history->seqs[slot] = seq;
+}
+
+json_object *rtc_state_history_get(const struct rtc_state_history *history,
+                                   uint32_t seq) {
+    int slot = seq & (RTC_STATE_HISTORY - 1);
+    if (seq == 0 || history->seqs[slot] != seq)
+        return NULL;
+    return history->states[slot];
+}
+
+int rtc_state_diff(json_object *base, json_object *state, json_object *delta) {
+    json_object *set = json_object_new_object();
+    if (set == NULL)
+        return -1;
+
+    // values are shared with state, not copied
+    int changes = 0;
+    json_object_object_foreach(state, key, value) {
+        json_object *old;
+        if (base == NULL || !json_object_object_get_ex(base, key, &old) ||
+            !json_object_equal(old, value)) {
+            json_object_object_add(set, key, json_object_get(value));
+            changes++;
+        }
+    }
+    json_object_object_add(delta, "set", set);
+
+    if (base == NULL)
+        return changes;
+
+    json_object *del = NULL;
+    json_object_object_foreach(base, name, unused) {
+        (void)unused;
+        if (json_object_object_get_ex(state, name, NULL))
+            continue;
+        if (del == NULL)
+            del = json_object_new_array();
+        json_object_array_add(del, json_object_new_string(name));
+        changes++;
+    }
+    if (del != NULL)
+        json_object_object_add(delta, "del", del);
+    return changes;
+}
+
+json_object *rtc_state_apply(json_object *base, json_object *delta) {
+    json_object *state = NULL;
+    if (base == NULL)
+        state = json_object_new_object();
+    else if (json_object_deep_copy(base, &state, NULL) != 0)
+        return NULL;
+    if (state == NULL)
+        return NULL;
+
+    json_object *set;
+    if (json_object_object_get_ex(delta, "set", &set) &&
+        json_object_is_type(set, json_type_object)) {
+        json_object_object_foreach(set, key, value) {
+            json_object_object_add(state, key, json_object_get(value));
+        }
+    }
+
+    json_object *del;
+    if (json_object_object_get_ex(delta, "del", &del) &&
+        json_object_is_type(del, json_type_array)) {
+        for (size_t i = 0; i < json_object_array_length(del); i++) {
+            json_object *name = json_object_array_get_idx(del, i);
+            if (json_object_is_type(name, json_type_string))
+                json_object_object_del(state, json_object_get_string(name));
+        }
+    }
+    return state;
+}
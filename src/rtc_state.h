@@ -0,0 +1,34 @@
+#ifndef RTC_STATE_H
+#define RTC_STATE_H
+
+#include <stdint.h>
+
+#include <json-c/json.h>
+
+// power of two, versions this many sequence numbers old can no longer serve
+// as the base of a delta
+#define RTC_STATE_HISTORY 32
+
+// recent versions of one replicated object by sequence number, a zeroed
+// history is empty, sequence numbers start at 1
+struct rtc_state_history {
+    json_object *states[RTC_STATE_HISTORY];
+    uint32_t seqs[RTC_STATE_HISTORY];
+};
+
+void rtc_state_history_free(struct rtc_state_history *history);
+// takes ownership of state, replaces the version RTC_STATE_HISTORY older
+void rtc_state_history_put(struct rtc_state_history *history, uint32_t seq,
+                           json_object *state);
+// borrowed, NULL if seq was never put or has been replaced since
+json_object *rtc_state_history_get(const struct rtc_state_history *history,
+                                   uint32_t seq);
+
+// adds "set" with the top level fields of state that base lacks or holds a
+// different value for and "del" with the fields only base has to delta,
+// base may be NULL, returns the number of changed fields or -1
+int rtc_state_diff(json_object *base, json_object *state, json_object *delta);
+// new object holding base with delta applied, base may be NULL
+json_object *rtc_state_apply(json_object *base, json_object *delta);
+
+#endif // RTC_STATE_H
@@ -0,0 +1,17 @@
+#ifndef STUB_DATACHANNEL_H
+#define STUB_DATACHANNEL_H
+
+#include <stdint.h>
+
+// stands in for libdatachannel in the tests, nothing goes over the network,
+// sent messages are only counted
+
+// messages and bytes handed to rtcSendMessage
+extern uint64_t stub_messages_sent;
+extern uint64_t stub_bytes_sent;
+
+// nonzero on a thread while it is inside one of the stubs, so the tests can
+// tell allocations of the transport from those of the library
+extern __thread int stub_in_transport;
+
+#endif // STUB_DATACHANNEL_H
@@ -0,0 +1,168 @@
+// the send path must not allocate once its buffers have grown, every send
+// api is driven against a binary and a JSON framed peer over the stubbed
+// transport, unbatched and then with the binary peer's messages batched,
+// allocations of the library and of the transport are counted apart and
+// either fails the test
+//
+// the library sources are included so the test can open peers without a
+// signaling server
+
+#include "rtc_handler.c"
+#include "stub_datachannel.h"
+
+#define SENDS 1000000
+#define WARMUP_SENDS 1000
+// batches are flushed by the test, the service thread never gets to
+#define BATCH_INTERVAL 3600000
+#define BATCH_SIZE 65536
+#define FLUSH_EVERY 16
+// skipped, in ctest terms
+#define SKIP 77
+
+#ifdef __GLIBC__
+// glibc lets the program replace malloc, the replacements count and hand
+// the call on to the real allocator
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread int counting = 0;
+static uint64_t allocations = 0;
+static uint64_t transport_allocations = 0;
+
+static void countAllocation(void) {
+    if (!counting)
+        return;
+    if (stub_in_transport)
+        transport_allocations++;
+    else
+        allocations++;
+}
+
+void *malloc(size_t size) {
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    countAllocation();
+    return __libc_realloc(ptr, size);
+}
+
+static struct rtc_peer *openPeer(rtc_client *client, int caps) {
+    char id[UUID_STR_LEN];
+    generate_uuid(id);
+    struct rtc_peer *peer = createPeer(client, id, PEER_OFFERING);
+    if (peer == NULL)
+        return NULL;
+    peer->caps = caps;
+    onDataChannelOpen(rtcCreateDataChannel(peer->pc, "test"), peer);
+    return peer;
+}
+
+// cycles through the send apis, seq keeps the same number of digits over
+// the whole run so the serialized object doesn't grow
+static void sendOne(rtc_client *client, json_object *obj, json_object *seq,
+                    long i) {
+    switch (i % 3) {
+    case 0:
+        rtc_client_send_message(client, "message \"quoted\"\n");
+        break;
+    case 1:
+        json_object_set_int64(seq, SENDS + i);
+        rtc_client_send_typed_object(client, "move", obj);
+        break;
+    default:
+        rtc_client_send_typed(client, "input", "\x01\x02\x00\x03", 4);
+        break;
+    }
+}
+
+// sends SENDS messages after a warmup, flushing the batches every
+// flush_every sends the way the service tick does, 0 never flushes,
+// returns nonzero if a send allocated or not every message went out
+static int run(rtc_client *client, json_object *obj, json_object *seq,
+               const char *name, int flush_every, uint64_t expected) {
+    uint64_t messages = 0;
+    allocations = 0;
+    transport_allocations = 0;
+    for (long i = -WARMUP_SENDS; i < SENDS; i++) {
+        if (i == 0) {
+            messages = stub_messages_sent;
+            counting = 1;
+        }
+        sendOne(client, obj, seq, i + WARMUP_SENDS);
+        if (flush_every > 0 && (i + 1) % flush_every == 0) {
+            pthread_mutex_lock(&client->peers_lock);
+            flushBatches(client);
+            pthread_mutex_unlock(&client->peers_lock);
+        }
+    }
+    counting = 0;
+    messages = stub_messages_sent - messages;
+
+    printf("%s: %d sends, %llu messages: %llu allocations in the library, "
+           "%llu in the transport\n",
+           name, SENDS, (unsigned long long)messages,
+           (unsigned long long)allocations,
+           (unsigned long long)transport_allocations);
+    if (messages != expected) {
+        fprintf(stderr, "%s: expected %llu messages\n", name,
+                (unsigned long long)expected);
+        return 1;
+    }
+    return allocations != 0 || transport_allocations != 0;
+}
+#endif
+
+int main(void) {
+#ifndef __GLIBC__
+    fprintf(stderr, "Counting allocations needs glibc, skipped\n");
+    return SKIP;
+#else
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    int joined = 0;
+    int ret = 0;
+    rtc_client *client = rtc_client_initialize(NULL, 0, "ws://stub", "user",
+                                               "room", 2, &lock, &cond,
+                                               &joined, &ret);
+    if (client == NULL) {
+        fprintf(stderr, "Failed to create the client\n");
+        return 1;
+    }
+    // probes would go out from the service thread in the middle of a run
+    rtc_client_set_clock_probes(client, 0);
+    rtc_client_register_type(client, 1, "move");
+    rtc_client_register_type(client, 2, "input");
+
+    json_object *obj = json_object_new_object();
+    json_object *seq = json_object_new_int64(0);
+    json_object_object_add(obj, "x", json_object_new_double(1.5));
+    json_object_object_add(obj, "seq", seq);
+
+    struct rtc_peer *binary = openPeer(client, CAP_BINARY_FRAMING);
+    if (binary == NULL || openPeer(client, 0) == NULL) {
+        fprintf(stderr, "Failed to open the peers\n");
+        return 1;
+    }
+
+    // both peers get every send
+    int failed = run(client, obj, seq, "unbatched", 0, 2 * (uint64_t)SENDS);
+
+    // the binary peer gets one batch per flush
+    binary->caps |= CAP_BATCHING;
+    rtc_client_set_batching(client, BATCH_INTERVAL, BATCH_SIZE);
+    failed |= run(client, obj, seq, "batched", FLUSH_EVERY,
+                  SENDS + SENDS / FLUSH_EVERY);
+
+    json_object_put(obj);
+    rtc_client_destroy(client);
+    return failed;
+#endif
+}